@@ -1,656 +1,8552 @@
-#include <iostream>
-#include <string>
-#include <stack>
-#include <queue>
-#include <list>
-#include <fstream>
-#include <unordered_map>
-#include <cctype>
-#include <limits>
-#if defined(_WIN32) || defined(_WIN64)
-#include <windows.h>  
-#endif
-
-using namespace std;
-
-
-#if defined(_WIN32) || defined(_WIN64)
-void enableANSI() {
-    HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
-    DWORD dwMode = 0;
-    if (hConsole != INVALID_HANDLE_VALUE && GetConsoleMode(hConsole, &dwMode)) {
-        dwMode |= ENABLE_VIRTUAL_TERMINAL_PROCESSING;
-        SetConsoleMode(hConsole, dwMode);
-    }
-}
-#else
-void enableANSI() {
-    
-}
-#endif
-
-void clearScreen() {
-    #if defined(_WIN32) || defined(_WIN64) // For Windows
-        std::system("cls");
-    #else // For Unix-based systems (Linux/macOS)
-        std::system("clear");
-    #endif
-}
-
-// ANSI color codes for console text
-#define RESET   "\033[0m"
-#define RED     "\033[31m"
-#define GREEN   "\033[32m"
-#define YELLOW  "\033[33m"
-#define SEA_BLUE  "\033[38;5;32m"
-#define CYAN    "\033[36m"
-#define MAGENTA "\033[35m"
-#define WHITE   "\033[37m"
-
-// Class for the text editor
-class TextEditor {
-private:
-    list<string> document;  // Linked list to store document lines
-    stack<pair<string, string>> undoStack; // Stack for undo functionality (store action and content)
-    queue<pair<string, string>> redoQueue; // Queue for redo functionality (store action and content)
-    string currentFilename;  // Stores the current filename being edited
-
-public:
-    // Function to handle input safely (to avoid invalid entries)
-    int getIntInput(const string& prompt) {
-        int value;
-        while (true) {
-            cout << prompt;
-            if (cin >> value) {
-                cin.ignore(numeric_limits<streamsize>::max(), '\n');  // clear input buffer
-                return value;
-            } else {
-                cout << RED << "Invalid input. Please enter a valid number.\n" << RESET;
-                cin.clear();  // clear error flag
-                cin.ignore(numeric_limits<streamsize>::max(), '\n');  // discard invalid input
-            }
-        }
-    }
-
-    // Function to get string input safely
-    string getStringInput(const string& prompt) {
-        string input;
-        cout << prompt;
-        getline(cin, input);
-        return input;
-    }
-
-    // 1. Create a new document (reset the text)
-    void createNewDocument() {
-        document.clear();
-        currentFilename = "";
-        cout << GREEN << "New document created.\n" << RESET;
-    }
-
-    // 2. Load an existing document from a file
-    void loadDocument(const string& filename) {
-        document.clear();
-        ifstream file(filename);
-        if (file.is_open()) {
-            string line;
-            while (getline(file, line)) {
-                document.push_back(line);
-            }
-            file.close();
-            currentFilename = filename;
-            cout << GREEN << "Document loaded successfully.\n" << RESET;
-            displayDocument();  // Show the content after loading
-        } else {
-            cout << RED << "Failed to load document.\n" << RESET;
-        }
-    }
-
-    // 3. Save the current document to a file
-    void saveDocument() {
-        if (document.empty()) {
-            cout << RED << "The document is empty. Add content before saving.\n" << RESET;
-            return; // Exit the function to prevent saving
-        }
-
-        if (currentFilename.empty()) {
-            currentFilename = getStringInput("Enter the filename to save as: ");
-        }
-
-        ofstream file(currentFilename);
-        if (file.is_open()) {
-            for (const auto& line : document) {
-                file << line << endl;
-            }
-            file.close();
-            cout << GREEN << "Document saved successfully to " << currentFilename << ".\n" << RESET;
-        } else {
-            cout << RED << "Failed to save document. Please check the file path or permissions.\n" << RESET;
-        }
-    }
-
-    // 4. Display the document
-    void displayDocument() {
-        if (document.empty()) {
-            cout << YELLOW << "The document is empty.\n" << RESET;
-            return;
-        }
-        int lineNumber = 1;
-        for (const auto& line : document) {
-            cout << CYAN << lineNumber++ << ": " << RESET << line << endl;
-        }
-    }
-
-    // 5. Add a new line 
-    void addLine(const string& text) {
-        document.push_back(text);
-        undoStack.push({"add", text});
-        redoQueue = queue<pair<string, string>>(); // Clear redo history
-    }
-
-    // 6. Remove 
-    void removeLine() {
-        if (!document.empty()) {
-            string lastLine = document.back();
-            document.pop_back();
-            undoStack.push({"remove", lastLine});
-            redoQueue = queue<pair<string, string>>(); // Clear redo history
-        } else {
-            cout << RED << "No line to remove.\n" << RESET;
-        }
-    }
-
-    // 7. Undo 
-    void undo() {
-        if (!undoStack.empty()) {
-            auto action = undoStack.top();
-            undoStack.pop();
-
-            if (action.first == "add") {
-                document.pop_back();
-                redoQueue.push({"add", action.second});
-            } else if (action.first == "remove") {
-                document.push_back(action.second);
-                redoQueue.push({"remove", action.second});
-            }
-        } else {
-            cout << RED << "Nothing to undo.\n" << RESET;
-        }
-    }
-
-    // 8. Redo 
-    void redo() {
-        if (!redoQueue.empty()) {
-            auto action = redoQueue.front();
-            redoQueue.pop();
-
-            if (action.first == "add") {
-                document.push_back(action.second);
-                undoStack.push({"add", action.second});
-            } else if (action.first == "remove") {
-                document.pop_back();
-                undoStack.push({"remove", action.second});
-            }
-        } else {
-            cout << RED << "Nothing to redo.\n" << RESET;
-        }
-    }
-
-
-    // 9. Search for a word in the document
-    void searchWord(const string& word) {
-        unordered_map<int, string> wordMap;
-        int lineNumber = 1;
-        bool found = false;
-
-        // Build the hash table (map)
-        for (const auto& line : document) {
-            wordMap[lineNumber] = line;
-            lineNumber++;
-        }
-
-        // Search for the word in the map
-        for (const auto& entry : wordMap) {
-            if (entry.second.find(word) != string::npos) {
-                cout << CYAN << "Found at line " << entry.first << ": " << RESET << entry.second << endl;
-                found = true;
-            }
-        }
-
-        if (!found) {
-            cout << RED << "Word not found in the document.\n" << RESET;
-        }
-    }
-    
-   
-    //10. Replace word
-    void replaceWord(const string& oldWord, const string& newWord) {
-        unordered_map<int, string> wordMap;
-        int lineNumber = 1;
-
-        // Build the hash table (map)
-        for (auto& line : document) {
-            wordMap[lineNumber] = line;
-            lineNumber++;
-        }
-
-        // Replace the word in the map
-        for (auto& entry : wordMap) {
-            size_t pos = 0;
-            while ((pos = entry.second.find(oldWord, pos)) != string::npos) {
-                entry.second.replace(pos, oldWord.length(), newWord);
-                pos += newWord.length();
-            }
-        }
-
-        // Update the document with the modified content
-        lineNumber = 0;
-        for (auto& entry : wordMap) {
-            auto it = document.begin();
-            advance(it, lineNumber);
-            *it = entry.second;
-            lineNumber++;
-        }
-    }
-
-    // 11. Insert text at a specific line number
-    void insertAtLine(int lineNumber, const string& text) {
-        if (lineNumber < 1 || lineNumber > document.size() + 1) {
-            cout << RED << "Invalid line number.\n" << RESET;
-            return;
-        }
-
-        auto it = document.begin();
-        advance(it, lineNumber - 1); // Move iterator to the specified line number
-        document.insert(it, text);
-        undoStack.push({"insertAtLine", text});
-        redoQueue = queue<pair<string, string>>(); // Clear redo history
-    }
-
-    // 12. Delete a specific line by number
-    void deleteLineByNumber(int lineNumber) {
-        if (lineNumber < 1 || lineNumber > document.size()) {
-            cout << RED << "Invalid line number.\n" << RESET;
-            return;
-        }
-
-        auto it = document.begin();
-        advance(it, lineNumber - 1);
-        document.erase(it);
-        undoStack.push({"deleteLineByNumber", ""});
-        redoQueue = queue<pair<string, string>>(); // Clear redo history
-    }
-
-    // 13. Change content of a specific line
-    void changeLine(int lineNumber, const string& newContent) {
-        if (lineNumber < 1 || lineNumber > document.size()) {
-            cout << RED << "Invalid line number.\n" << RESET;
-            return;
-        }
-
-        auto it = document.begin();
-        advance(it, lineNumber - 1);
-        *it = newContent;
-        undoStack.push({"changeLine", newContent});
-        redoQueue = queue<pair<string, string>>(); // Clear redo history
-    }
-
-    // 14. Count total lines in the document
-    void countLines() {
-        cout << CYAN << "Total lines in the document: " << RESET << document.size() << endl;
-    }
-
-    // 15. Count occurrences of a word in the document using a hash table
-    void countWordOccurrences(const string& word) {
-        unordered_map<string, int> wordCount; // Hash table to store word frequencies
-
-        // Populate the hash table with word frequencies
-        for (const auto& line : document) {
-            size_t start = 0, end;
-            while ((end = line.find_first_of(" \t\n,.!?;:", start)) != string::npos) {
-                if (start < end) {
-                    string currentWord = line.substr(start, end - start);
-                    wordCount[currentWord]++;
-                }
-                start = end + 1;
-            }
-            if (start < line.size()) {
-                wordCount[line.substr(start)]++;
-            }
-        }
-
-        // Display the occurrence of the given word
-        if (wordCount.find(word) != wordCount.end()) {
-            cout << CYAN << "The word \"" << word << "\" appears " << RESET << wordCount[word] << " times.\n";
-        } else {
-            cout << RED << "The word \"" << word << "\" does not appear in the document.\n" << RESET;
-        }
-    }
-
-    // 16. Bold the entire document (simulated by wrapping text with **)
-    void boldText() {
-        for (auto& line : document) {
-            line = "**" + line + "**";
-        }
-    }
-
-    // 17. Italicize the entire document (simulated by wrapping text with _)
-    void italicizeText() {
-        for (auto& line : document) {
-            line = "_" + line + "_";
-        }
-    }
-
-    // 18. Convert the document to lowercase
-    void convertToLowerCase() {
-        for (auto& line : document) {
-            for (auto& ch : line) {
-                ch = tolower(ch);
-            }
-        }
-    }
-
-    // 19. Convert the document to uppercase
-    void convertToUpperCase() {
-        for (auto& line : document) {
-            for (auto& ch : line) {
-                ch = toupper(ch);
-            }
-        }
-    }
-};
-
-
-
-// Main menu function
-void mainMenu() {
-    TextEditor editor;
-    int choice;
-
-    do {
-        // Main Menu UI
-        cout << SEA_BLUE << "====================================\n";
-        cout << "        TEXT EDITOR MENU\n";
-        cout << "====================================\n";
-        cout << "1. Create New Document\n";
-        cout << "2. Load Document\n";
-        cout << "3. Exit\n";
-        cout << SEA_BLUE << "====================================\n" << RESET;
-        choice = editor.getIntInput("Enter your choice: ");
-        clearScreen() ;
-
-        if (choice == 1) {
-            editor.createNewDocument();
-            // After creating a new document, display text editor menu (functions 20 actions)
-            bool editing = true;
-            while (editing) {
-                cout << YELLOW << "====================================\n";
-                cout << "          EDITING MENU\n";
-                cout << "====================================\n";
-                cout << "1. Add Line\n";
-                cout << "2. Remove Line\n";
-                cout << "3. Undo\n";
-                cout << "4. Redo\n";
-                cout << "5. Display Document\n";
-                cout << "6. Save Document\n";
-                cout << "7. Search Word\n";
-                cout << "8. Replace Word\n";
-
-                cout << "9. Insert at Line\n";
-                cout << "10. Delete Line by Number\n";
-                cout << "11. Change Line Content\n";
-                cout << "12. Count Lines\n";
-                cout << "13. Count Word Occurrences\n";
-                cout << "14. Bold Text\n";
-                cout << "15. Italicize Text\n";
-                cout << "16. Convert to Lowercase\n";
-                cout << "17. Convert to Uppercase\n";
-                cout << "18. Exit\n";
-                cout << YELLOW << "====================================\n" << RESET;
-                int action = editor.getIntInput("Enter your choice: ");
-                clearScreen() ; 
-                switch (action) {
-                    case 1: {
-                        string text = editor.getStringInput("Enter line to add: ");
-                        editor.addLine(text);
-                        
-                        break;
-                        
-                    }
-                    case 2:
-                        editor.removeLine();
-                        
-                        break;
-                    case 3:
-                        editor.undo();
-                        
-                        break;
-                    case 4:
-                        editor.redo();
-                      
-                        break;
-                    case 5:
-                        editor.displayDocument();
-                        
-                        break;
-                    case 6:
-                        editor.saveDocument();
-                       
-                        break;
-                    case 7: {
-                        string word = editor.getStringInput("Enter word to search: ");
-                        editor.searchWord(word);
-                        
-                        break;
-                    }
-                    case 8: {
-                        string oldWord = editor.getStringInput("Enter word to replace: ");
-                        string newWord = editor.getStringInput("Enter new word: ");
-                        editor.replaceWord(oldWord, newWord);
-                        
-                        break;
-                    }
-                   
-                    case 9: {
-                        int lineNumber = editor.getIntInput("Enter line number to insert at: ");
-                        string text = editor.getStringInput("Enter text to insert: ");
-                        editor.insertAtLine(lineNumber, text);
-                        
-                        break;
-                    }
-                    case 10: {
-                        int lineNumber = editor.getIntInput("Enter line number to delete: ");
-                        editor.deleteLineByNumber(lineNumber);
-                       
-                        break;
-                    }
-                    case 11: {
-                        int lineNumber = editor.getIntInput("Enter line number to change: ");
-                        string newText = editor.getStringInput("Enter new content: ");
-                        editor.changeLine(lineNumber, newText);
-                        
-                        break;
-                    }
-                    case 12:
-                        editor.countLines();
-                       
-                        break;
-                    case 13: {
-                        string word = editor.getStringInput("Enter word to count: ");
-                        editor.countWordOccurrences(word);
-                       
-                        break;
-                    }
-                    case 14:
-                        editor.boldText();
-                        
-                        break;
-                    case 15:
-                        editor.italicizeText();
-                       
-                        break;
-                    case 16:
-                        editor.convertToLowerCase();
-                       
-                        break;
-                    case 17:
-                        editor.convertToUpperCase();
-                        
-                        break;
-                    case 18:
-                        editing = false;
-                        clearScreen() ;
-                        break;
-                    default:
-                        cout << RED << "Invalid choice, try again.\n" << RESET;
-                }
-            }
-        } else if (choice == 2) {
-            string filename = editor.getStringInput("Enter the filename to load: ");
-            editor.loadDocument(filename);
-            bool editing = true;
-            while (editing) {
-            	cout << YELLOW << "====================================\n";
-                cout << "          EDITING MENU\n";
-                cout << "====================================\n";
-            	cout << "\nText Editing Menu:\n";
-                cout << "1. Add Line\n";
-                cout << "2. Remove Line\n";
-                cout << "3. Undo\n";
-                cout << "4. Redo\n";
-                cout << "5. Display Document\n";
-                cout << "6. Save Document\n";
-                cout << "7. Search Word\n";
-                cout << "8. Replace Word\n";
-                cout << "9. Insert at Line\n";
-                cout << "10. Delete Line by Number\n";
-                cout << "11. Change Line Content\n";
-                cout << "12. Count Lines\n";
-                cout << "13. Count Word Occurrences\n";
-                cout << "14. Bold Text\n";
-                cout << "15. Italicize Text\n";
-                cout << "16. Convert to Lowercase\n";
-                cout << "17. Convert to Uppercase\n";
-                cout << "18. Exit\n";
-                cout << YELLOW << "====================================\n" << RESET;
-                cout << "Enter your choice: ";
-                
-                int action;
-                cin >> action;
-                cin.ignore();
-                clearScreen() ; 
-
-                switch (action) {
-                    case 1: {
-                        string text;
-                        cout << "Enter line to add: ";
-                        getline(cin, text);
-                        editor.addLine(text);
-                        break;
-                    }
-                    case 2:
-                        editor.removeLine();
-                        break;
-                    case 3:
-                        editor.undo();
-                        break;
-                    case 4:
-                        editor.redo();
-                        break;
-                    case 5:
-                        editor.displayDocument();
-                        break;
-                    case 6:
-                        editor.saveDocument();
-                        break;
-                    case 7: {
-                        string word;
-                        cout << "Enter word to search: ";
-                        getline(cin, word);
-                        editor.searchWord(word);
-                        break;
-                    }
-                    case 8: {
-                        string oldWord, newWord;
-                        cout << "Enter word to replace: ";
-                        getline(cin, oldWord);
-                        cout << "Enter new word: ";
-                        getline(cin, newWord);
-                        editor.replaceWord(oldWord, newWord);
-                        break;
-                    }
-                   
-                        
-                    case 9: {
-                        int lineNumber;
-                        string text;
-                        cout << "Enter line number to insert at: ";
-                        cin >> lineNumber;
-                        cin.ignore();
-                        cout << "Enter text to insert: ";
-                        getline(cin, text);
-                        editor.insertAtLine(lineNumber, text);
-                        break;
-                    }
-                    case 10: {
-                        int lineNumber;
-                        cout << "Enter line number to delete: ";
-                        cin >> lineNumber;
-                        editor.deleteLineByNumber(lineNumber);
-                        break;
-                    }
-                    case 11: {
-                        int lineNumber;
-                        string newContent;
-                        cout << "Enter line number to change: ";
-                        cin >> lineNumber;
-                        cin.ignore();
-                        cout << "Enter new content for the line: ";
-                        getline(cin, newContent);
-                        editor.changeLine(lineNumber, newContent);
-                        break;
-                    }
-                    case 12:
-                        editor.countLines();
-                        break;
-                    case 13: {
-                        string word;
-                        cout << "Enter word to count: ";
-                        getline(cin, word);
-                        editor.countWordOccurrences(word);
-                        break;
-                    }
-                    case 14:
-                        editor.boldText();
-                        break;
-                    case 15:
-                        editor.italicizeText();
-                        break;
-                    case 16:
-                        editor.convertToLowerCase();
-                        break;
-                    case 17:
-                        editor.convertToUpperCase();
-                        break;
-                    case 18:
-                        editing = false;
-                        clearScreen() ;
-                        break;
-                    default:
-                        cout << "Invalid choice, try again.\n";
-                    }
-                // The same editing menu logic as above for loaded file...
-            }
-        } else if (choice == 3) {
-            cout << GREEN << "Exiting program.\n" << RESET;
-        } else {
-            cout << RED << "Invalid choice, please try again.\n" << RESET;
-        }
-    } while (choice != 3);
-}
-
-int main() {
-	enableANSI();
-    mainMenu();
-    
-    return 0;
+#include <iostream>
+#include <string>
+#include <queue>
+#include <deque>
+#include <list>
+#include <fstream>
+#include <unordered_map>
+#include <unordered_set>
+#include <cctype>
+#include <limits>
+#include <string_view>
+#include <vector>
+#include <iterator>
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <map>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <cstdio>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <random>
+#include <sstream>
+#include <filesystem>
+#include <cmath>
+#include <csignal>
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>  
+#include <conio.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#endif
+
+using namespace std;
+
+
+#if defined(_WIN32) || defined(_WIN64)
+void enableANSI() {
+    HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
+    DWORD dwMode = 0;
+    if (hConsole != INVALID_HANDLE_VALUE && GetConsoleMode(hConsole, &dwMode)) {
+        dwMode |= ENABLE_VIRTUAL_TERMINAL_PROCESSING;
+        SetConsoleMode(hConsole, dwMode);
+    }
+}
+#else
+void enableANSI() {
+    
+}
+#endif
+
+// Clear the screen with ANSI sequences (enableANSI turns them on for the
+// Windows console) instead of starting a cls/clear process
+void clearScreen() {
+    cout << "\033[H\033[2J\033[3J" << flush;
+}
+
+// ANSI color codes for console text (switched off for plain output)
+bool useColors = true;
+#define RESET   (useColors ? "\033[0m" : "")
+#define RED     (useColors ? "\033[31m" : "")
+#define GREEN   (useColors ? "\033[32m" : "")
+#define YELLOW  (useColors ? "\033[33m" : "")
+#define SEA_BLUE  (useColors ? "\033[38;5;32m" : "")
+#define CYAN    (useColors ? "\033[36m" : "")
+#define MAGENTA (useColors ? "\033[35m" : "")
+#define WHITE   (useColors ? "\033[37m" : "")
+
+// Identity of a file on disk: enough to notice that another program
+// rewrote or replaced it since we last looked
+struct FileStamp {
+    bool exists = false;
+    uint64_t device = 0;
+    uint64_t inode = 0;
+    uint64_t size = 0;
+    int64_t modified = 0;   // Nanoseconds where the platform has them
+
+    static FileStamp of(const string& filename) {
+        FileStamp stamp;
+#if defined(_WIN32) || defined(_WIN64)
+        error_code error;
+        stamp.size = (uint64_t)filesystem::file_size(filename, error);
+        if (error) return FileStamp();
+        auto modified = filesystem::last_write_time(filename, error);
+        if (error) return FileStamp();
+        stamp.modified = (int64_t)modified.time_since_epoch().count();
+        stamp.exists = true;
+#else
+        struct stat info;
+        if (stat(filename.c_str(), &info) == 0) stamp = of(info);
+#endif
+        return stamp;
+    }
+
+#if !defined(_WIN32) && !defined(_WIN64)
+    static FileStamp of(const struct stat& info) {
+        FileStamp stamp;
+        stamp.exists = true;
+        stamp.device = (uint64_t)info.st_dev;
+        stamp.inode = (uint64_t)info.st_ino;
+        stamp.size = (uint64_t)info.st_size;
+#if defined(__APPLE__)
+        stamp.modified = (int64_t)info.st_mtimespec.tv_sec * 1000000000 + info.st_mtimespec.tv_nsec;
+#else
+        stamp.modified = (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+#endif
+        return stamp;
+    }
+#endif
+
+    bool operator==(const FileStamp& other) const {
+        return exists == other.exists && device == other.device && inode == other.inode && size == other.size &&
+               modified == other.modified;
+    }
+    bool operator!=(const FileStamp& other) const { return !(*this == other); }
+};
+
+// Read-only view of a whole file. On POSIX systems the file is memory
+// mapped, so loading does not copy it; elsewhere it is read in one block.
+class MappedText {
+private:
+    const char* bytes = nullptr;
+    size_t length = 0;
+    string path;
+    FileStamp identity;     // The file as it was when opened
+#if defined(_WIN32) || defined(_WIN64)
+    string buffer;
+#else
+    int fd = -1;            // Kept open so saves can copy unchanged ranges
+    struct stat opened;     // File identity when it was mapped
+#endif
+
+    MappedText() = default;
+
+public:
+    MappedText(const MappedText&) = delete;
+    MappedText& operator=(const MappedText&) = delete;
+
+    ~MappedText() {
+#if !defined(_WIN32) && !defined(_WIN64)
+        if (length > 0) munmap(const_cast<char*>(bytes), length);
+        if (fd >= 0) close(fd);
+#endif
+    }
+
+    // Returns nullptr when the file cannot be opened
+    static shared_ptr<MappedText> open(const string& filename) {
+        shared_ptr<MappedText> text(new MappedText);
+        text->path = filename;
+#if defined(_WIN32) || defined(_WIN64)
+        ifstream file(filename, ios::binary);
+        if (!file.is_open()) return nullptr;
+        text->buffer.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+        text->bytes = text->buffer.data();
+        text->length = text->buffer.size();
+        text->identity = FileStamp::of(filename);
+#else
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return nullptr;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+            close(fd);
+            return nullptr;
+        }
+        if (info.st_size > 0) {
+            void* mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED) {
+                close(fd);
+                return nullptr;
+            }
+            madvise(mapping, info.st_size, MADV_SEQUENTIAL);
+            text->bytes = static_cast<const char*>(mapping);
+            text->length = info.st_size;
+        }
+        text->fd = fd;
+        text->opened = info;
+        text->identity = FileStamp::of(info);
+#endif
+        return text;
+    }
+
+    const char* data() const { return bytes; }
+    size_t size() const { return length; }
+    const string& filename() const { return path; }
+    const FileStamp& stamp() const { return identity; }
+
+    // True when `filename` is still the very file that was mapped
+    bool isCurrentFile(const string& filename) const {
+#if defined(_WIN32) || defined(_WIN64)
+        return false;
+#else
+        struct stat info;
+        return filename == path && stat(filename.c_str(), &info) == 0 &&
+               info.st_dev == opened.st_dev && info.st_ino == opened.st_ino &&
+               info.st_size == opened.st_size && info.st_mtime == opened.st_mtime;
+#endif
+    }
+
+    // Append [offset, offset + count) of this file to `out`, inside the
+    // kernel when possible. Returns how many bytes were appended; the
+    // caller copies the rest itself.
+    size_t copyTo(int out, size_t offset, size_t count) const {
+#if defined(__linux__)
+        off_t from = (off_t)offset;
+        size_t done = 0;
+        while (done < count) {
+            ssize_t copied = copy_file_range(fd, &from, out, nullptr, count - done, 0);
+            if (copied < 0 && errno == EINTR) continue;
+            if (copied <= 0) break;
+            done += copied;
+        }
+        return done;
+#else
+        (void)out; (void)offset; (void)count;
+        return 0;
+#endif
+    }
+
+    // Calls f(line) for each '\n' separated line in [begin, end), like getline
+    template <class F>
+    static void forEachLine(const char* begin, const char* end, F f) {
+        while (begin < end) {
+            const char* newline = static_cast<const char*>(memchr(begin, '\n', end - begin));
+            const char* stop = newline ? newline : end;
+            f(string_view(begin, stop - begin));
+            begin = newline ? newline + 1 : end;
+        }
+    }
+};
+
+// Writes a file through a large buffer into a temporary file next to the
+// target, then syncs it and renames it over the target, so a crash leaves
+// either the old file or the new one, never half of each.
+class AtomicFileWriter {
+private:
+    static const size_t BUFFER_SIZE = 1 << 20;
+
+    string target;
+    string temporary;
+    unique_ptr<char[]> buffer;
+    size_t used = 0;
+    bool failed = false;
+    bool committed = false;
+#if defined(_WIN32) || defined(_WIN64)
+    ofstream file;
+#else
+    int fd = -1;
+#endif
+
+    void flush() {
+        if (used == 0 || failed) return;
+        writeRaw(buffer.get(), used);
+        used = 0;
+    }
+
+    void writeRaw(const char* bytes, size_t count) {
+#if defined(_WIN32) || defined(_WIN64)
+        file.write(bytes, count);
+        failed |= !file;
+#else
+        while (count > 0 && !failed) {
+            ssize_t written = ::write(fd, bytes, count);
+            if (written < 0) {
+                failed = errno != EINTR;
+                continue;
+            }
+            bytes += written;
+            count -= written;
+        }
+#endif
+    }
+
+public:
+    explicit AtomicFileWriter(const string& filename)
+        : target(filename), temporary(filename + ".saving"), buffer(new char[BUFFER_SIZE]) {
+#if defined(_WIN32) || defined(_WIN64)
+        file.open(temporary, ios::binary | ios::trunc);
+        failed = !file.is_open();
+#else
+        struct stat info;
+        mode_t mode = stat(target.c_str(), &info) == 0 ? (info.st_mode & 07777) : 0644;
+        fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, mode);
+        failed = fd < 0;
+#endif
+    }
+
+    AtomicFileWriter(const AtomicFileWriter&) = delete;
+    AtomicFileWriter& operator=(const AtomicFileWriter&) = delete;
+
+    ~AtomicFileWriter() {
+#if defined(_WIN32) || defined(_WIN64)
+        if (file.is_open()) file.close();
+#else
+        if (fd >= 0) close(fd);
+#endif
+        if (!committed) remove(temporary.c_str());
+    }
+
+    bool isOpen() const { return !failed; }
+
+    void write(string_view bytes) {
+        if (bytes.size() >= BUFFER_SIZE) {
+            flush();
+            writeRaw(bytes.data(), bytes.size());
+            return;
+        }
+        if (used + bytes.size() > BUFFER_SIZE) flush();
+        memcpy(buffer.get() + used, bytes.data(), bytes.size());
+        used += bytes.size();
+    }
+
+    void writeLine(string_view line) {
+        write(line);
+        write("\n");
+    }
+
+    // Copy a byte range of a mapped file, letting the kernel do it if it can
+    void writeRange(const MappedText& source, size_t offset, size_t count) {
+        flush();
+        size_t copied = 0;
+#if !defined(_WIN32) && !defined(_WIN64)
+        if (!failed) copied = source.copyTo(fd, offset, count);  // May stop partway (EXDEV, ENOSYS)
+#endif
+        if (copied < count) writeRaw(source.data() + offset + copied, count - copied);
+    }
+
+    // Flush, sync and move the temporary file over the target
+    bool commit() {
+        flush();
+#if defined(_WIN32) || defined(_WIN64)
+        file.close();
+        if (failed || !MoveFileExA(temporary.c_str(), target.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+            return false;
+        }
+#else
+        if (failed || fsync(fd) != 0) return false;
+        close(fd);
+        fd = -1;
+        if (rename(temporary.c_str(), target.c_str()) != 0) return false;
+        // Make the rename itself durable
+        size_t slash = target.find_last_of('/');
+        string directory = slash == string::npos ? "." : target.substr(0, max<size_t>(slash, 1));
+        int dirFd = ::open(directory.c_str(), O_RDONLY);
+        if (dirFd >= 0) {
+            fsync(dirFd);
+            close(dirFd);
+        }
+#endif
+        committed = true;
+        return true;
+    }
+};
+
+// 16-byte handle to the bytes of one line. Lines up to INLINE_MAX bytes are
+// stored in the handle itself; longer ones point either into a mapped file
+// or into a LineArena slab. The handle never owns memory, so copying it is
+// a plain 16-byte copy.
+class Line {
+public:
+    static const size_t INLINE_MAX = 15;
+
+private:
+    enum : uint8_t { MAPPED = 16, ARENA = 17 };
+
+    // Inline bytes, or a pointer followed by a 48-bit length (so a line of
+    // 4 GB or more, such as a minified log, keeps its length). The last
+    // byte is the tag: the inline length (0..15), MAPPED or ARENA.
+    static constexpr size_t LENGTH_BYTES = 6;
+    char raw[16];
+
+    uint8_t tag() const { return (uint8_t)raw[15]; }
+
+    static Line external(string_view text, uint8_t kind) {
+        Line line;
+        const char* ptr = text.data();
+        uint64_t length = text.size();
+        memcpy(line.raw, &ptr, sizeof ptr);
+        for (size_t i = 0; i < LENGTH_BYTES; i++) line.raw[sizeof ptr + i] = (char)(length >> (8 * i));
+        line.raw[15] = (char)kind;
+        return line;
+    }
+
+public:
+    Line() { raw[15] = 0; }
+
+    // Borrow bytes that outlive the line (a mapped file)
+    static Line view(string_view text) { return external(text, MAPPED); }
+
+    // Point at bytes owned by a LineArena
+    static Line arena(string_view text) { return external(text, ARENA); }
+
+    // Copy a short line into the handle
+    static Line inlined(string_view text) {
+        Line line;
+        memcpy(line.raw, text.data(), text.size());
+        line.raw[15] = (char)text.size();
+        return line;
+    }
+
+    bool inArena() const { return tag() == ARENA; }
+
+    string_view str() const {
+        if (tag() <= INLINE_MAX) return string_view(raw, tag());
+        const char* ptr;
+        uint64_t length = 0;
+        memcpy(&ptr, raw, sizeof ptr);
+        for (size_t i = 0; i < LENGTH_BYTES; i++) length |= (uint64_t)(uint8_t)raw[sizeof ptr + i] << (8 * i);
+        return string_view(ptr, (size_t)length);
+    }
+};
+
+// Bump allocator for the bytes of edited lines. Lines are packed into 1 MB
+// slabs and never freed one by one: replacing or erasing a line only counts
+// its bytes as dead, and the rope compacts the arena (copies the live lines
+// into fresh slabs) once most of it is dead. With interning on, identical
+// lines share one copy. Bytes never move once stored, and slabs are
+// reference counted so a snapshot can keep them alive after compaction.
+class LineArena {
+private:
+    static const size_t SLAB_SIZE = 1 << 20;
+
+    vector<shared_ptr<char[]>> slabs;
+    char* cursor = nullptr;     // Free space in the last regular slab
+    size_t left = 0;
+    size_t reserved = 0;        // Bytes in all slabs
+    size_t dead = 0;            // Bytes of lines released since the last compaction
+    bool interning = false;
+    unordered_set<string_view> interned;
+
+    const char* copy(string_view text) {
+        // Big lines get a slab of their own so they don't waste the current one
+        if (text.size() > SLAB_SIZE / 4) {
+            slabs.emplace_back(new char[text.size()]);
+            reserved += text.size();
+            memcpy(slabs.back().get(), text.data(), text.size());
+            return slabs.back().get();
+        }
+        if (text.size() > left) {
+            slabs.emplace_back(new char[SLAB_SIZE]);
+            reserved += SLAB_SIZE;
+            cursor = slabs.back().get();
+            left = SLAB_SIZE;
+        }
+        char* bytes = cursor;
+        memcpy(bytes, text.data(), text.size());
+        cursor += text.size();
+        left -= text.size();
+        return bytes;
+    }
+
+public:
+    explicit LineArena(bool interning = false) : interning(interning) {}
+    LineArena(LineArena&&) = default;
+    LineArena& operator=(LineArena&&) = default;
+
+    // Make a handle for `text`: inline if short, otherwise a copy in a slab
+    Line store(string_view text) {
+        if (text.size() <= Line::INLINE_MAX) return Line::inlined(text);
+        if (interning) {
+            auto found = interned.find(text);
+            if (found != interned.end()) return Line::arena(*found);
+        }
+        string_view bytes(copy(text), text.size());
+        if (interning) interned.insert(bytes);
+        return Line::arena(bytes);
+    }
+
+    // Note that a line handed out by store() is no longer referenced. With
+    // interning on the bytes may still be shared, so `dead` is an estimate.
+    void release(const Line& line) {
+        if (line.inArena()) dead += line.str().size();
+    }
+
+    bool needsCompaction() const { return reserved > 8 * SLAB_SIZE && dead > reserved / 2; }
+
+    // Add a reference to every slab to `out`, for a snapshot
+    void shareSlabs(vector<shared_ptr<char[]>>& out) const { out.insert(out.end(), slabs.begin(), slabs.end()); }
+    bool internsLines() const { return interning; }
+    size_t slabCount() const { return slabs.size(); }
+    size_t memoryUsage() const {
+        return reserved + interned.size() * (sizeof(string_view) + 2 * sizeof(void*));
+    }
+};
+
+// Hands out objects from blocks of BLOCK_SIZE, reusing freed ones, so a
+// tree of many small nodes costs a few large allocations
+template <class T>
+class BlockPool {
+private:
+    static const size_t BLOCK_SIZE = 4096;
+
+    struct alignas(T) Slot {
+        unsigned char bytes[sizeof(T)];
+    };
+
+    vector<unique_ptr<Slot[]>> blocks;
+    size_t usedInLast = BLOCK_SIZE;
+    vector<T*> freed;
+
+public:
+    BlockPool() = default;
+    BlockPool(const BlockPool&) = delete;
+    BlockPool& operator=(const BlockPool&) = delete;
+
+    T* create() {
+        void* slot;
+        if (!freed.empty()) {
+            slot = freed.back();
+            freed.pop_back();
+        } else {
+            if (usedInLast == BLOCK_SIZE) {
+                blocks.emplace_back(new Slot[BLOCK_SIZE]);
+                usedInLast = 0;
+            }
+            slot = &blocks.back()[usedInLast++];
+        }
+        return new (slot) T();
+    }
+
+    void destroy(T* object) {
+        object->~T();
+        freed.push_back(object);
+    }
+
+    // Drop every block; all objects must have been destroyed
+    void release() {
+        blocks.clear();
+        freed.clear();
+        usedInLast = BLOCK_SIZE;
+    }
+
+    size_t blockCount() const { return blocks.size(); }
+    size_t memoryUsage() const { return blocks.size() * BLOCK_SIZE * sizeof(Slot); }
+};
+
+// Byte-oriented LZ77 codec in the style of LZ4, for blocks of a few
+// hundred kilobytes at most. A block is a series of sequences: a token byte
+// (literal count in the high nibble, match length - 4 in the low one, 15
+// meaning "more length bytes follow"), the literals, then a 16-bit offset
+// back into the output. The last sequence has literals only. Matches are
+// found through a hash table of 4-byte prefixes, so compression is one
+// greedy pass and decompression is little more than memcpy.
+class BlockCodec {
+private:
+    static constexpr int HASH_BITS = 12;
+    static constexpr size_t MIN_MATCH = 4;
+    static constexpr size_t MAX_OFFSET = 65535;
+
+    static uint32_t hashAt(const char* p) {
+        uint32_t v;
+        memcpy(&v, p, sizeof v);
+        return (v * 2654435761u) >> (32 - HASH_BITS);
+    }
+
+    static void putLength(string& out, size_t length) {
+        for (; length >= 255; length -= 255) out += (char)255;
+        out += (char)length;
+    }
+
+    static bool getLength(const unsigned char*& in, const unsigned char* end, size_t& length) {
+        unsigned char byte;
+        do {
+            if (in == end) return false;
+            byte = *in++;
+            length += byte;
+        } while (byte == 255);
+        return true;
+    }
+
+    static void putSequence(string& out, const char* literals, size_t literalCount, size_t offset, size_t matchLength) {
+        size_t extraMatch = matchLength >= MIN_MATCH ? matchLength - MIN_MATCH : 0;
+        out += (char)((min<size_t>(literalCount, 15) << 4) | min<size_t>(extraMatch, 15));
+        if (literalCount >= 15) putLength(out, literalCount - 15);
+        out.append(literals, literalCount);
+        if (matchLength == 0) return;
+        out += (char)(offset & 0xff);
+        out += (char)(offset >> 8);
+        if (extraMatch >= 15) putLength(out, extraMatch - 15);
+    }
+
+public:
+    // Append the compressed form of [data, data + size) to `out`
+    static void compress(const char* data, size_t size, string& out) {
+        vector<uint32_t> table(1u << HASH_BITS, UINT32_MAX);
+        size_t i = 0, anchor = 0;
+        while (i + MIN_MATCH <= size) {
+            uint32_t h = hashAt(data + i);
+            size_t candidate = table[h];
+            table[h] = (uint32_t)i;
+            if (candidate == UINT32_MAX || i - candidate > MAX_OFFSET || memcmp(data + candidate, data + i, MIN_MATCH) != 0) {
+                i++;
+                continue;
+            }
+            size_t length = MIN_MATCH;
+            while (i + length < size && data[candidate + length] == data[i + length]) length++;
+            putSequence(out, data + anchor, i - anchor, i - candidate, length);
+            i += length;
+            anchor = i;
+        }
+        putSequence(out, data + anchor, size - anchor, 0, 0);
+    }
+
+    // Decompress a block into exactly `size` bytes at `out`; false if the
+    // block is damaged or does not have that size
+    static bool decompress(string_view block, char* out, size_t size) {
+        const unsigned char* in = reinterpret_cast<const unsigned char*>(block.data());
+        const unsigned char* end = in + block.size();
+        size_t written = 0;
+        while (in < end) {
+            unsigned char token = *in++;
+            size_t literals = token >> 4;
+            if (literals == 15 && !getLength(in, end, literals)) return false;
+            if (literals > (size_t)(end - in) || literals > size - written) return false;
+            memcpy(out + written, in, literals);
+            in += literals;
+            written += literals;
+            if (in == end) break;  // Last sequence
+
+            if (end - in < 2) return false;
+            size_t offset = in[0] | (in[1] << 8);
+            in += 2;
+            size_t length = token & 15;
+            if (length == 15 && !getLength(in, end, length)) return false;
+            length += MIN_MATCH;
+            if (offset == 0 || offset > written || length > size - written) return false;
+            char* target = out + written;
+            const char* source = target - offset;
+            if (offset >= length) {
+                memcpy(target, source, length);
+            } else {
+                for (size_t k = 0; k < length; k++) target[k] = source[k];  // Overlapping run
+            }
+            written += length;
+        }
+        return written == size;
+    }
+};
+
+// Lines of one decompressed block: line k is text[starts[k], starts[k + 1])
+struct UnpackedLines {
+    string text;
+    vector<uint32_t> starts;
+
+    size_t size() const { return starts.empty() ? 0 : starts.size() - 1; }
+    string_view line(size_t k) const { return string_view(text.data() + starts[k], starts[k + 1] - starts[k]); }
+};
+
+// A chunk of lines compressed as one BlockCodec block. Before compression
+// the block holds the LEB128 length of every line followed by the bytes of
+// all lines back to back. Blocks are never changed once built, so a
+// snapshot can share them.
+class PackedLines {
+private:
+    string block;
+    size_t rawSize = 0;
+    size_t count = 0;
+
+public:
+    template <class It>
+    PackedLines(It begin, It end) {
+        string raw;
+        for (It it = begin; it != end; ++it) {
+            for (size_t length = it->str().size(); ; length >>= 7) {
+                raw += (char)((length & 0x7f) | (length >= 0x80 ? 0x80 : 0));
+                if (length < 0x80) break;
+            }
+            count++;
+        }
+        for (It it = begin; it != end; ++it) raw.append(it->str());
+        rawSize = raw.size();
+        BlockCodec::compress(raw.data(), raw.size(), block);
+        block.shrink_to_fit();
+    }
+
+    size_t lines() const { return count; }
+    size_t uncompressedBytes() const { return rawSize; }
+    size_t compressedBytes() const { return block.capacity(); }
+
+    // The block was built in this process, so decompression cannot fail
+    // short of memory corruption; lengths are still clamped to the data so
+    // that a damaged block cannot make a line point outside it
+    void unpack(UnpackedLines& out) const {
+        string raw(rawSize, '\0');
+        BlockCodec::decompress(block, &raw[0], rawSize);
+        out.starts.assign(1, 0);
+        size_t pos = 0;
+        for (size_t k = 0; k < count; k++) {
+            size_t length = 0;
+            for (int shift = 0; pos < raw.size() && shift < 64; shift += 7) {
+                unsigned char byte = raw[pos++];
+                length |= (size_t)(byte & 0x7f) << shift;
+                if (!(byte & 0x80)) break;
+            }
+            out.starts.push_back(out.starts.back() + (uint32_t)length);
+        }
+        out.text.assign(raw, min(pos, raw.size()), string::npos);
+        for (auto& start : out.starts) start = min<uint32_t>(start, (uint32_t)out.text.size());
+    }
+};
+
+// Counters of the compressed cold chunks of a document
+struct ColdStorageStats {
+    size_t hotLimit = 0;            // Edited lines kept uncompressed (0: compression off)
+    size_t blocks = 0;              // Compressed chunks
+    size_t lines = 0;               // Lines in them
+    size_t rawBytes = 0;            // Their size before compression
+    size_t compressedBytes = 0;
+    size_t cachedBlocks = 0;        // Decompressed blocks held by the cache
+    size_t cacheHits = 0;
+    size_t cacheMisses = 0;
+
+    double ratio() const { return compressedBytes ? (double)rawBytes / compressedBytes : 0.0; }
+    double hitRate() const { return cacheHits + cacheMisses ? (double)cacheHits / (cacheHits + cacheMisses) : 0.0; }
+};
+
+// Frozen copy of a document that another thread can read while editing
+// goes on. The rope shares its chunks and arena slabs with the snapshot
+// instead of copying lines (see LineRope::snapshot), so taking one costs a
+// pointer per chunk.
+class DocumentSnapshot {
+private:
+    friend class LineList;
+    friend class LineRope;
+
+    // Unedited bytes of the mapped file, a chunk of line handles or a
+    // compressed chunk
+    struct Piece {
+        const char* mappedBegin = nullptr;
+        const char* mappedEnd = nullptr;
+        shared_ptr<const vector<Line>> lines;
+        shared_ptr<const PackedLines> packed;
+    };
+
+    shared_ptr<const MappedText> mapped;
+    vector<shared_ptr<char[]>> slabs;   // Arena bytes the handles point into
+    LineArena copies;                   // Lines copied by a backend that cannot share them
+    vector<Piece> pieces;
+    size_t count = 0;
+
+    void addMapped(const char* begin, const char* end) {
+        if (!pieces.empty() && pieces.back().mappedEnd == begin) {
+            pieces.back().mappedEnd = end;
+            return;
+        }
+        pieces.emplace_back();
+        pieces.back().mappedBegin = begin;
+        pieces.back().mappedEnd = end;
+    }
+
+    void addLines(shared_ptr<const vector<Line>> lines) {
+        pieces.emplace_back();
+        pieces.back().lines = move(lines);
+    }
+
+    void addPacked(shared_ptr<const PackedLines> packed) {
+        pieces.emplace_back();
+        pieces.back().packed = move(packed);
+    }
+
+public:
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    // Same contract as LineRope::forEachRun
+    template <class R, class L>
+    void forEachRun(R range, L line) const {
+        UnpackedLines unpacked;
+        for (const auto& piece : pieces) {
+            if (piece.mappedBegin) {
+                range(*mapped, piece.mappedBegin - mapped->data(), piece.mappedEnd - piece.mappedBegin);
+            } else if (piece.packed) {
+                piece.packed->unpack(unpacked);
+                for (size_t k = 0; k < unpacked.size(); k++) line(unpacked.line(k));
+            } else {
+                for (const Line& l : *piece.lines) line(l.str());
+            }
+        }
+    }
+};
+
+// Old document storage: a plain linked list of lines.
+// Positional operations walk the list, so they cost O(n).
+class LineList {
+private:
+    list<string> lines;
+
+    list<string>::iterator locate(size_t index) {
+        auto it = lines.begin();
+        advance(it, index);
+        return it;
+    }
+
+public:
+    size_t size() const { return lines.size(); }
+    bool empty() const { return lines.empty(); }
+    void clear() { lines.clear(); }
+
+    // Copy every line of a file into the list
+    void load(shared_ptr<const MappedText> text) {
+        clear();
+        MappedText::forEachLine(text->data(), text->data() + text->size(), [this](string_view line) {
+            lines.emplace_back(line);
+        });
+    }
+
+    // Copy the lines in bytes [begin, end) of `text` after the last line
+    void append(shared_ptr<const MappedText> text, size_t begin, size_t end) {
+        MappedText::forEachLine(text->data() + begin, text->data() + end, [this](string_view line) {
+            lines.emplace_back(line);
+        });
+    }
+
+    string_view at(size_t index) const {
+        auto it = lines.begin();
+        advance(it, index);
+        return *it;
+    }
+    string_view back() const { return lines.back(); }
+
+    void set(size_t index, string_view text) { locate(index)->assign(text); }
+    void insert(size_t index, string_view text) { lines.insert(locate(index), string(text)); }
+    void erase(size_t index) { lines.erase(locate(index)); }
+    void push_back(string_view text) { lines.emplace_back(text); }
+    void pop_back() { lines.pop_back(); }
+
+    // Calls f(index, line) for every line in [from, to)
+    template <class F>
+    void forEach(size_t from, size_t to, F f) const {
+        auto it = lines.begin();
+        advance(it, min(from, lines.size()));
+        for (size_t i = from; i < to && it != lines.end(); ++i, ++it) {
+            f(i, string_view(*it));
+        }
+    }
+
+    // Approximate heap used by the list nodes and their strings
+    size_t memoryUsage() const {
+        size_t bytes = 0;
+        for (const auto& text : lines) {
+            bytes += sizeof(text) + 2 * sizeof(void*) + (text.capacity() > 15 ? text.capacity() + 1 : 0);
+        }
+        return bytes;
+    }
+
+    // The strings are edited in place, so a snapshot has to copy every line
+    DocumentSnapshot snapshot() const {
+        DocumentSnapshot copy;
+        auto lines = make_shared<vector<Line>>();
+        lines->reserve(this->lines.size());
+        for (const auto& text : this->lines) lines->push_back(copy.copies.store(text));
+        copy.count = lines->size();
+        copy.addLines(move(lines));
+        return copy;
+    }
+
+    // Every line is its own string, so there is no arena to intern into
+    // and no chunk to compress
+    void setInterning(bool) {}
+    bool interning() const { return false; }
+    size_t slabCount() const { return 0; }
+    void setHotLimit(size_t) {}
+    ColdStorageStats coldStats() const { return ColdStorageStats(); }
+
+    // Walks the whole document as runs of unchanged file bytes and single
+    // lines. The list copies everything on load, so it only has lines.
+    template <class R, class L>
+    void forEachRun(R range, L line) const {
+        (void)range;
+        for (const auto& text : lines) line(string_view(text));
+    }
+
+    // Calls f(index, line, out) for every line in [from, to); when f returns
+    // true the line is replaced by `out`. `out` is reused between calls.
+    template <class F>
+    void rewrite(size_t from, size_t to, F f) {
+        string out;
+        auto it = locate(min(from, lines.size()));
+        for (size_t i = from; i < to && it != lines.end(); ++i, ++it) {
+            if (f(i, string_view(*it), out)) it->assign(out);
+        }
+    }
+};
+
+// New document storage: a rope of line chunks kept in a treap.
+// Every node owns a chunk of up to CHUNK_MAX lines and knows how many
+// lines live in its subtree, so line lookup, insert and erase are O(log n).
+// Chunks loaded from a mapped file only remember their byte range; their
+// lines are split out the first time the chunk is edited. Nodes come from a
+// block pool and edited line bytes from an arena, so views returned by at()
+// and forEach() are only valid until the next edit. Chunks are copy on
+// write: a snapshot shares them, and the rope copies a shared chunk before
+// changing it. Once more than hotLineLimit edited lines are held, the
+// chunks edited least recently are compressed into PackedLines blocks;
+// reading them goes through a small LRU cache of decompressed blocks, and
+// editing one turns it back into line handles.
+class LineRope {
+private:
+    static const size_t CHUNK_MAX = 256;
+    static const size_t CACHE_BLOCKS = 64;
+    static const size_t DEFAULT_HOT_LIMIT = 1 << 18;
+
+    struct Node {
+        shared_ptr<vector<Line>> chunk;  // Lines stored in this node
+        const char* mappedBegin = nullptr;  // Unsplit mapped bytes, if any
+        const char* mappedEnd = nullptr;
+        shared_ptr<const PackedLines> packed;  // Compressed lines, if any
+        uint64_t lastUsed = 0;  // Edit clock when the chunk was last changed
+        size_t count = 0;       // Lines in this node
+        Node* left = nullptr;
+        Node* right = nullptr;
+        unsigned priority;
+        size_t lines = 0;       // Lines in this subtree
+        size_t chunks = 1;      // Chunks in this subtree
+        bool shared = false;    // `chunk` is also held by a snapshot
+    };
+
+    struct CacheEntry {
+        shared_ptr<const PackedLines> block;
+        shared_ptr<const UnpackedLines> lines;
+        uint64_t used;
+    };
+
+    Node* root = nullptr;
+    shared_ptr<const MappedText> mapped;  // File the unedited lines point into
+    BlockPool<Node> nodes;
+    LineArena arena;
+    unsigned seed = 2463534242u;
+    size_t hotLineLimit = DEFAULT_HOT_LIMIT;  // 0: never compress
+    size_t hotChunks = 0;   // Nodes holding their lines in `chunk`
+    uint64_t clock = 0;     // Counts chunk edits, for Node::lastUsed
+
+    // Decompressed blocks. Readers may run on several threads at once, so
+    // the cache has its own lock. Blocks evicted from it stay in `retired`
+    // until the next edit (or until CACHE_BLOCKS more are evicted), because
+    // views returned by at() may point into them.
+    mutable mutex cacheLock;
+    mutable vector<CacheEntry> cache;
+    mutable vector<shared_ptr<const UnpackedLines>> retired;
+    mutable uint64_t cacheClock = 0;
+    mutable size_t cacheHits = 0, cacheMisses = 0;
+
+    unsigned nextPriority() {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    }
+
+    static size_t linesOf(Node* n) { return n ? n->lines : 0; }
+    static size_t chunksOf(Node* n) { return n ? n->chunks : 0; }
+
+    static void update(Node* n) {
+        n->lines = linesOf(n->left) + n->count + linesOf(n->right);
+        n->chunks = chunksOf(n->left) + 1 + chunksOf(n->right);
+    }
+
+    void freeNode(Node* n) {
+        if (n->chunk) hotChunks--;
+        nodes.destroy(n);
+    }
+
+    void destroy(Node* n) {
+        if (!n) return;
+        destroy(n->left);
+        destroy(n->right);
+        freeNode(n);
+    }
+
+    // Copy the live arena lines into fresh slabs and free the old ones
+    void compact() {
+        LineArena fresh(arena.internsLines());
+        auto node = [this, &fresh](Node* n, size_t) {
+            if (!n->chunk) return;
+            for (Line& l : edit(n, false)) {
+                if (l.inArena()) l = fresh.store(l.str());
+            }
+        };
+        visit(root, 0, 0, size(), node);
+        arena = move(fresh);
+    }
+
+    void compactIfNeeded() {
+        if (arena.needsCompaction()) compact();
+    }
+
+    // Decompressed lines of a block. Lookups of a few lines keep what they
+    // decompress in the cache; scans (remember = false) only use blocks
+    // already there, so one pass over the document does not flush it.
+    shared_ptr<const UnpackedLines> unpacked(const shared_ptr<const PackedLines>& block, bool remember) const {
+        {
+            lock_guard<mutex> guard(cacheLock);
+            for (auto& entry : cache) {
+                if (entry.block == block) {
+                    entry.used = ++cacheClock;
+                    cacheHits++;
+                    return entry.lines;
+                }
+            }
+            cacheMisses++;
+        }
+        auto lines = make_shared<UnpackedLines>();
+        block->unpack(*lines);
+        if (!remember) return lines;
+
+        lock_guard<mutex> guard(cacheLock);
+        if (cache.size() == CACHE_BLOCKS) {
+            auto oldest = min_element(cache.begin(), cache.end(),
+                                      [](const CacheEntry& a, const CacheEntry& b) { return a.used < b.used; });
+            if (retired.size() == CACHE_BLOCKS) retired.erase(retired.begin());
+            retired.push_back(move(oldest->lines));
+            *oldest = move(cache.back());
+            cache.pop_back();
+        }
+        cache.push_back({block, lines, ++cacheClock});
+        return lines;
+    }
+
+    // Drop a block that is being turned back into line handles
+    void forgetCached(const shared_ptr<const PackedLines>& block) {
+        lock_guard<mutex> guard(cacheLock);
+        for (auto& entry : cache) {
+            if (entry.block != block) continue;
+            retired.push_back(move(entry.lines));
+            entry = move(cache.back());
+            cache.pop_back();
+            return;
+        }
+    }
+
+    // Called by every edit: views from earlier at() calls are invalid now
+    void releaseRetired() {
+        lock_guard<mutex> guard(cacheLock);
+        retired.clear();
+    }
+
+    // Lines of `n`, ready to be changed: a mapped chunk is split into line
+    // handles that still point at the file, a compressed one is unpacked
+    // into the arena, and a chunk shared with a snapshot is copied first.
+    // `use` marks the chunk as recently edited.
+    vector<Line>& edit(Node* n, bool use = true) {
+        if (use) n->lastUsed = ++clock;
+        if (n->mappedBegin) {
+            n->chunk = make_shared<vector<Line>>();
+            n->chunk->reserve(n->count);
+            MappedText::forEachLine(n->mappedBegin, n->mappedEnd, [n](string_view line) {
+                n->chunk->push_back(Line::view(line));
+            });
+            n->mappedBegin = n->mappedEnd = nullptr;
+            hotChunks++;
+        } else if (n->packed) {
+            shared_ptr<const UnpackedLines> lines = unpacked(n->packed, false);
+            forgetCached(n->packed);
+            n->chunk = make_shared<vector<Line>>();
+            n->chunk->reserve(lines->size());
+            for (size_t k = 0; k < lines->size(); k++) n->chunk->push_back(arena.store(lines->line(k)));
+            n->packed.reset();
+            hotChunks++;
+        } else if (!n->chunk) {
+            n->chunk = make_shared<vector<Line>>();
+            hotChunks++;
+        } else if (n->shared) {
+            n->chunk = make_shared<vector<Line>>(*n->chunk);
+        }
+        n->shared = false;
+        return *n->chunk;
+    }
+
+    // Compress the lines of an edited chunk and let the arena reclaim them
+    void pack(Node* n) {
+        n->packed = make_shared<const PackedLines>(n->chunk->begin(), n->chunk->end());
+        for (const Line& l : *n->chunk) arena.release(l);
+        n->chunk.reset();
+        n->shared = false;
+        hotChunks--;
+    }
+
+    // Once more than hotLineLimit lines sit in edited chunks, compress the
+    // least recently edited ones until half the limit is left, so the
+    // walk over all chunks is paid once per many edits
+    void coolIfNeeded() {
+        if (hotLineLimit == 0 || hotChunks * CHUNK_MAX <= hotLineLimit) return;
+        vector<Node*> hot;
+        auto node = [&hot](Node* n, size_t) {
+            if (n->chunk) hot.push_back(n);
+        };
+        visit(root, 0, 0, size(), node);
+        hotChunks = hot.size();
+        size_t keep = hotLineLimit / CHUNK_MAX / 2;
+        if (hot.size() > keep) {
+            auto cold = hot.end() - keep;
+            nth_element(hot.begin(), cold, hot.end(), [](Node* a, Node* b) { return a->lastUsed < b->lastUsed; });
+            for (auto it = hot.begin(); it != cold; ++it) pack(*it);
+        }
+        compactIfNeeded();
+    }
+
+    string_view lineOf(Node* n, size_t offset) const {
+        if (n->packed) return unpacked(n->packed, true)->line(offset);
+        if (!n->mappedBegin) return (*n->chunk)[offset].str();
+        string_view found;
+        size_t i = 0;
+        MappedText::forEachLine(n->mappedBegin, n->mappedEnd, [&](string_view line) {
+            if (i++ == offset) found = line;
+        });
+        return found;
+    }
+
+    // Merge two treaps where every chunk of a comes before every chunk of b
+    static Node* merge(Node* a, Node* b) {
+        if (!a) return b;
+        if (!b) return a;
+        if (a->priority > b->priority) {
+            a->right = merge(a->right, b);
+            update(a);
+            return a;
+        }
+        b->left = merge(a, b->left);
+        update(b);
+        return b;
+    }
+
+    // Split a treap into its first `count` chunks and the rest
+    static void split(Node* n, size_t count, Node*& a, Node*& b) {
+        if (!n) {
+            a = b = nullptr;
+            return;
+        }
+        if (chunksOf(n->left) < count) {
+            split(n->right, count - chunksOf(n->left) - 1, n->right, b);
+            a = n;
+        } else {
+            split(n->left, count, a, n->left);
+            b = n;
+        }
+        update(n);
+    }
+
+    // Find the chunk holding line `index`. On return `index` is the offset
+    // inside that chunk, `chunkIndex` is the chunk's position and `path`
+    // holds the nodes from the root down to it.
+    Node* locate(size_t& index, size_t& chunkIndex, vector<Node*>& path) const {
+        Node* n = root;
+        chunkIndex = 0;
+        while (n) {
+            path.push_back(n);
+            size_t leftLines = linesOf(n->left);
+            if (index < leftLines) {
+                n = n->left;
+            } else if (index < leftLines + n->count || !n->right) {
+                index -= leftLines;
+                chunkIndex += chunksOf(n->left);
+                return n;
+            } else {
+                index -= leftLines + n->count;
+                chunkIndex += chunksOf(n->left) + 1;
+                n = n->right;
+            }
+        }
+        return nullptr;
+    }
+
+    Node* newNode() {
+        Node* n = nodes.create();
+        n->priority = nextPriority();
+        return n;
+    }
+
+    // Move the upper half of an overfull chunk into a new node after it
+    void splitChunk(Node* n, size_t chunkIndex) {
+        Node* extra = newNode();
+        size_t half = n->count / 2;
+        vector<Line>& lines = edit(n);
+        edit(extra).assign(lines.begin() + half, lines.end());
+        extra->count = extra->chunk->size();
+        lines.resize(half);
+        n->count = half;
+        update(extra);
+
+        // Splitting right after the chunk walks through all of its ancestors,
+        // so their counts are recomputed on the way down
+        Node *a, *b;
+        split(root, chunkIndex + 1, a, b);
+        root = merge(merge(a, extra), b);
+    }
+
+    // Unlink and free an empty chunk
+    void removeChunk(size_t chunkIndex) {
+        Node *a, *b, *c;
+        split(root, chunkIndex, a, b);
+        split(b, 1, b, c);
+        freeNode(b);
+        root = merge(a, c);
+    }
+
+    // Calls f(node, firstLineOfNode) for every node overlapping [from, to)
+    template <class F>
+    static void visit(Node* n, size_t base, size_t from, size_t to, F& f) {
+        if (!n) return;
+        size_t own = base + linesOf(n->left);
+        if (from < own) visit(n->left, base, from, to, f);
+        if (from < own + n->count && to > own) f(n, own);
+        size_t next = own + n->count;
+        if (to > next) visit(n->right, next, from, to, f);
+    }
+
+public:
+    LineRope() = default;
+    LineRope(const LineRope&) = delete;
+    LineRope& operator=(const LineRope&) = delete;
+    ~LineRope() { destroy(root); }
+
+    size_t size() const { return linesOf(root); }
+    bool empty() const { return size() == 0; }
+
+    void clear() {
+        destroy(root);
+        root = nullptr;
+        nodes.release();
+        mapped.reset();
+        arena = LineArena(arena.internsLines());
+        hotChunks = 0;
+        lock_guard<mutex> guard(cacheLock);
+        cache.clear();
+        retired.clear();
+    }
+
+    // Share one copy of identical edited lines (common in logs). The edited
+    // lines are copied into a new arena that dedupes them.
+    void setInterning(bool on) {
+        if (on == arena.internsLines()) return;
+        LineArena fresh(on);
+        swap(arena, fresh);
+        auto node = [this](Node* n, size_t) {
+            if (!n->chunk) return;
+            for (Line& l : edit(n, false)) {
+                if (l.inArena()) l = arena.store(l.str());
+            }
+        };
+        visit(root, 0, 0, size(), node);
+    }
+    bool interning() const { return arena.internsLines(); }
+
+    // Keep about `lines` edited lines uncompressed (whole chunks are
+    // compressed); 0 stops compressing, leaving compressed chunks as they are
+    void setHotLimit(size_t lines) {
+        hotLineLimit = lines == 0 ? 0 : max(lines, 2 * CHUNK_MAX);
+        coolIfNeeded();
+    }
+
+    ColdStorageStats coldStats() const {
+        ColdStorageStats stats;
+        stats.hotLimit = hotLineLimit;
+        auto node = [&stats](Node* n, size_t) {
+            if (!n->packed) return;
+            stats.blocks++;
+            stats.lines += n->packed->lines();
+            stats.rawBytes += n->packed->uncompressedBytes();
+            stats.compressedBytes += n->packed->compressedBytes();
+        };
+        visit(root, 0, 0, size(), node);
+        lock_guard<mutex> guard(cacheLock);
+        stats.cachedBlocks = cache.size();
+        stats.cacheHits = cacheHits;
+        stats.cacheMisses = cacheMisses;
+        return stats;
+    }
+
+    // Index a mapped file: one pass of memchr finds the chunk boundaries,
+    // and no line is copied until it is edited
+    void load(shared_ptr<const MappedText> text) {
+        clear();
+        size_t size = text->size();
+        append(move(text), 0, size);
+    }
+
+    // Add the lines in bytes [begin, end) of `text` after the last line.
+    // The range holds whole lines, and a rope reads from one file only, so
+    // `text` is the file it was loaded from (if any). A background load
+    // publishes its batches this way.
+    void append(shared_ptr<const MappedText> text, size_t begin, size_t end) {
+        mapped = move(text);
+        const char* p = mapped->data() + begin;
+        const char* stop = mapped->data() + end;
+        const char* chunkBegin = p;
+        size_t count = 0;
+        while (p < stop) {
+            const char* newline = static_cast<const char*>(memchr(p, '\n', stop - p));
+            p = newline ? newline + 1 : stop;
+            if (++count == CHUNK_MAX || p == stop) {
+                Node* n = newNode();
+                n->mappedBegin = chunkBegin;
+                n->mappedEnd = p;
+                n->count = count;
+                update(n);
+                root = merge(root, n);
+                chunkBegin = p;
+                count = 0;
+            }
+        }
+    }
+
+    string_view at(size_t index) const {
+        size_t chunkIndex;
+        vector<Node*> path;
+        Node* n = locate(index, chunkIndex, path);
+        return lineOf(n, index);
+    }
+    string_view back() const { return at(size() - 1); }
+
+    void set(size_t index, string_view text) {
+        releaseRetired();
+        size_t chunkIndex;
+        vector<Node*> path;
+        Node* n = locate(index, chunkIndex, path);
+        Line& line = edit(n)[index];
+        Line old = line;
+        line = arena.store(text);
+        arena.release(old);
+        compactIfNeeded();
+        coolIfNeeded();
+    }
+
+    void insert(size_t index, string_view text) {
+        releaseRetired();
+        if (!root) {
+            root = newNode();
+            edit(root).push_back(arena.store(text));
+            root->count = 1;
+            update(root);
+            return;
+        }
+        size_t chunkIndex;
+        vector<Node*> path;
+        Node* n = locate(index, chunkIndex, path);
+        vector<Line>& lines = edit(n);
+        lines.insert(lines.begin() + index, arena.store(text));
+        n->count++;
+        for (Node* p : path) p->lines++;
+        if (n->count > CHUNK_MAX) splitChunk(n, chunkIndex);
+        coolIfNeeded();
+    }
+
+    void erase(size_t index) {
+        releaseRetired();
+        size_t chunkIndex;
+        vector<Node*> path;
+        Node* n = locate(index, chunkIndex, path);
+        vector<Line>& lines = edit(n);
+        arena.release(lines[index]);
+        lines.erase(lines.begin() + index);
+        n->count--;
+        for (Node* p : path) p->lines--;
+        if (n->count == 0) removeChunk(chunkIndex);
+        compactIfNeeded();
+        coolIfNeeded();
+    }
+
+    void push_back(string_view text) { insert(size(), text); }
+    void pop_back() { erase(size() - 1); }
+
+    // Calls f(index, line) for every line in [from, to). Short ranges (a
+    // screen of the viewer) keep the blocks they decompress in the cache.
+    template <class F>
+    void forEach(size_t from, size_t to, F f) const {
+        bool remember = to - from <= CHUNK_MAX;
+        auto node = [&](Node* n, size_t first) {
+            size_t i = first;
+            auto line = [&](string_view text) {
+                if (i >= from && i < to) f(i, text);
+                i++;
+            };
+            if (n->mappedBegin) {
+                MappedText::forEachLine(n->mappedBegin, n->mappedEnd, line);
+            } else if (n->packed) {
+                shared_ptr<const UnpackedLines> lines = unpacked(n->packed, remember);
+                for (size_t k = 0; k < lines->size(); k++) line(lines->line(k));
+            } else {
+                for (const Line& l : *n->chunk) line(l.str());
+            }
+        };
+        visit(root, 0, from, to, node);
+    }
+
+    // Approximate heap used by the node pool, the chunks, the compressed
+    // blocks, the block cache and the arena (mapped file bytes are not counted)
+    size_t memoryUsage() const {
+        size_t bytes = nodes.memoryUsage() + arena.memoryUsage();
+        auto node = [&bytes](Node* n, size_t) {
+            if (n->chunk) bytes += n->chunk->capacity() * sizeof(Line);
+            if (n->packed) bytes += sizeof(PackedLines) + n->packed->compressedBytes();
+        };
+        visit(root, 0, 0, size(), node);
+        lock_guard<mutex> guard(cacheLock);
+        for (const auto& entry : cache) {
+            bytes += entry.lines->text.capacity() + entry.lines->starts.capacity() * sizeof(uint32_t);
+        }
+        return bytes;
+    }
+
+    // Large allocations behind the document: pool blocks and arena slabs
+    size_t slabCount() const { return nodes.blockCount() + arena.slabCount(); }
+
+    // Share every chunk with a snapshot. Edited chunks are marked shared and
+    // get copied on their next edit; nothing is copied now.
+    DocumentSnapshot snapshot() {
+        DocumentSnapshot copy;
+        copy.mapped = mapped;
+        copy.count = size();
+        arena.shareSlabs(copy.slabs);
+        auto node = [&copy](Node* n, size_t) {
+            if (n->mappedBegin) {
+                copy.addMapped(n->mappedBegin, n->mappedEnd);
+            } else if (n->packed) {
+                copy.addPacked(n->packed);
+            } else {
+                n->shared = true;
+                copy.addLines(n->chunk);
+            }
+        };
+        visit(root, 0, 0, size(), node);
+        return copy;
+    }
+
+    // Walks the whole document as runs of unchanged file bytes and single
+    // lines: range(file, offset, length) for consecutive chunks that were
+    // never edited, line(text) for everything else
+    template <class R, class L>
+    void forEachRun(R range, L line) const {
+        const char* runBegin = nullptr;
+        const char* runEnd = nullptr;
+        auto node = [&](Node* n, size_t) {
+            if (n->mappedBegin && n->mappedBegin == runEnd) {
+                runEnd = n->mappedEnd;
+                return;
+            }
+            if (runBegin) range(*mapped, runBegin - mapped->data(), runEnd - runBegin);
+            runBegin = runEnd = nullptr;
+            if (n->mappedBegin) {
+                runBegin = n->mappedBegin;
+                runEnd = n->mappedEnd;
+            } else if (n->packed) {
+                shared_ptr<const UnpackedLines> lines = unpacked(n->packed, false);
+                for (size_t k = 0; k < lines->size(); k++) line(lines->line(k));
+            } else {
+                for (const Line& l : *n->chunk) line(l.str());
+            }
+        };
+        visit(root, 0, 0, size(), node);
+        if (runBegin) range(*mapped, runBegin - mapped->data(), runEnd - runBegin);
+    }
+
+    // Calls f(index, line, out) for every line in [from, to); when f returns
+    // true the line is replaced by `out`. `out` is reused between calls.
+    template <class F>
+    void rewrite(size_t from, size_t to, F f) {
+        releaseRetired();
+        string out;
+        auto node = [&](Node* n, size_t first) {
+            size_t i = first;
+            auto line = [&](string_view text) {
+                if (i >= from && i < to && f(i, text, out)) {
+                    Line& l = edit(n)[i - first];
+                    arena.release(l);
+                    l = arena.store(out);
+                }
+                i++;
+            };
+            if (n->mappedBegin) {
+                MappedText::forEachLine(n->mappedBegin, n->mappedEnd, line);
+            } else if (n->packed) {
+                shared_ptr<const UnpackedLines> lines = unpacked(n->packed, false);
+                for (size_t k = 0; k < lines->size(); k++) line(lines->line(k));
+            } else {
+                for (size_t k = 0; k < n->chunk->size(); k++) line((*n->chunk)[k].str());
+            }
+            // Compress as the pass goes, so rewriting the whole document
+            // never holds more than the limit in edited chunks
+            compactIfNeeded();
+            coolIfNeeded();
+        };
+        visit(root, 0, from, to, node);
+    }
+};
+
+// Compile with -DTEXT_EDITOR_LIST_BACKEND to compare against the old list storage
+#ifdef TEXT_EDITOR_LIST_BACKEND
+typedef LineList Document;
+#else
+typedef LineRope Document;
+#endif
+
+// Multi-pattern replacer built on an Aho-Corasick automaton.
+// Each line is scanned once; at every position the longest pattern ending
+// there is replaced and matching restarts right after it.
+class ReplaceEngine {
+private:
+    vector<array<int, 256>> next;   // Full transition table (goto + failure links)
+    vector<int> match;              // Longest pattern ending in each state, or -1
+    vector<size_t> depth;           // Length of the prefix each state stands for
+    vector<pair<string, string>> patterns;
+
+public:
+    explicit ReplaceEngine(const vector<pair<string, string>>& table) {
+        next.push_back({});
+        next[0].fill(-1);
+        match.push_back(-1);
+        depth.push_back(0);
+
+        // Build the trie of patterns
+        for (const auto& entry : table) {
+            if (entry.first.empty()) continue;
+            int state = 0;
+            for (unsigned char ch : entry.first) {
+                if (next[state][ch] < 0) {
+                    next[state][ch] = (int)next.size();
+                    next.push_back({});
+                    next.back().fill(-1);
+                    match.push_back(-1);
+                    depth.push_back(depth[state] + 1);
+                }
+                state = next[state][ch];
+            }
+            if (match[state] < 0) {
+                match[state] = (int)patterns.size();
+                patterns.push_back(entry);
+            }
+        }
+
+        // Breadth-first pass turns the trie into a DFA
+        vector<int> fail(next.size(), 0);
+        queue<int> pending;
+        for (int ch = 0; ch < 256; ch++) {
+            int child = next[0][ch];
+            if (child < 0) {
+                next[0][ch] = 0;
+            } else {
+                pending.push(child);
+            }
+        }
+        while (!pending.empty()) {
+            int state = pending.front();
+            pending.pop();
+            if (match[state] < 0) match[state] = match[fail[state]];
+            for (int ch = 0; ch < 256; ch++) {
+                int child = next[state][ch];
+                if (child < 0) {
+                    next[state][ch] = next[fail[state]][ch];
+                } else {
+                    fail[child] = next[fail[state]][ch];
+                    pending.push(child);
+                }
+            }
+        }
+    }
+
+    bool empty() const { return patterns.empty(); }
+
+    // Writes the rewritten line into `out` and returns the number of
+    // replacements. `out` is left alone when nothing matched.
+    //
+    // Matches are leftmost-longest, whatever the order of the table: of
+    // the words that occur, the one starting first is replaced, and of
+    // those starting there the longest. Scanning goes on past a match
+    // while the automaton may still be inside a longer or earlier one (its
+    // state's prefix reaches back to the match's start or before); then
+    // the match is replaced and the scan restarts right after it.
+    size_t apply(string_view line, string& out) const {
+        size_t count = 0, copied = 0;
+        size_t bestStart = 0, bestEnd = 0;
+        int best = -1;
+        int state = 0;
+        for (size_t i = 0; i <= line.size(); i++) {
+            if (i < line.size()) {
+                state = next[state][(unsigned char)line[i]];
+                int hit = match[state];
+                if (hit >= 0) {
+                    size_t start = i + 1 - patterns[hit].first.size();
+                    // Ends here, so it is longer than a best with the same start
+                    if (best < 0 || start <= bestStart) {
+                        best = hit;
+                        bestStart = start;
+                        bestEnd = i + 1;
+                    }
+                }
+                if (best < 0 || i + 1 - depth[state] <= bestStart) continue;
+            } else if (best < 0) {
+                break;
+            }
+            if (count == 0) out.clear();
+            out.append(line.data() + copied, bestStart - copied);
+            out.append(patterns[best].second);
+            copied = bestEnd;
+            count++;
+            best = -1;
+            state = 0;
+            i = bestEnd - 1;  // The loop moves on to the byte after the match
+        }
+        if (count > 0) out.append(line.data() + copied, line.size() - copied);
+        return count;
+    }
+};
+
+// Small fixed pool of worker threads for splitting work over line ranges
+class ThreadPool {
+private:
+    vector<thread> workers;
+    queue<function<void()>> tasks;
+    mutex lock;
+    condition_variable wake;
+    bool stopping = false;
+
+    void work() {
+        while (true) {
+            function<void()> task;
+            {
+                unique_lock<mutex> guard(lock);
+                wake.wait(guard, [this] { return stopping || !tasks.empty(); });
+                if (tasks.empty()) return;
+                task = move(tasks.front());
+                tasks.pop();
+            }
+            task();
+        }
+    }
+
+public:
+    explicit ThreadPool(unsigned count) {
+        for (unsigned i = 0; i < count; i++) workers.emplace_back([this] { work(); });
+    }
+
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) worker.join();
+    }
+
+    // One pool per process, sized so the calling thread makes up the last core
+    static ThreadPool& shared() {
+        static ThreadPool pool(max(1u, thread::hardware_concurrency()) - 1);
+        return pool;
+    }
+
+    size_t size() const { return workers.size(); }
+
+    void submit(function<void()> task) {
+        {
+            lock_guard<mutex> guard(lock);
+            tasks.push(move(task));
+        }
+        wake.notify_one();
+    }
+
+    // Splits [0, count) into at most one part per core (each at least
+    // minPart long), runs f(part, begin, end) on every part and waits.
+    // Part 0 runs on the calling thread.
+    template <class F>
+    size_t parallelFor(size_t count, size_t minPart, F f) {
+        size_t parts = min<size_t>(size() + 1, max<size_t>(1, count / max<size_t>(1, minPart)));
+        size_t step = (count + parts - 1) / max<size_t>(1, parts);
+        mutex doneLock;
+        condition_variable done;
+        size_t pending = parts - 1;
+        for (size_t part = 1; part < parts; part++) {
+            submit([&, part] {
+                f(part, min(count, part * step), min(count, (part + 1) * step));
+                lock_guard<mutex> guard(doneLock);
+                if (--pending == 0) done.notify_one();
+            });
+        }
+        f(0, 0, min(count, step));
+        unique_lock<mutex> guard(doneLock);
+        done.wait(guard, [&] { return pending == 0; });
+        return parts;
+    }
+};
+
+// Worker threads with a task deque each. A worker runs tasks from the back
+// of its own deque and, once that is empty, steals from the front of the
+// others', so a deque that happened to get the big files does not keep one
+// thread busy while the rest sit idle. Every task is told which worker runs
+// it, so it can use that worker's scratch state without locking.
+class WorkStealingPool {
+private:
+    typedef function<void(size_t)> Task;
+
+    struct Queue {
+        mutex lock;
+        deque<Task> tasks;
+        size_t stolen = 0;  // Tasks other workers took from this deque
+    };
+
+    vector<unique_ptr<Queue>> queues;
+    vector<thread> workers;
+    mutex idleLock;
+    condition_variable wake;    // A task was submitted, or the pool is closing
+    condition_variable room;    // A task was taken, so submit may go on
+    size_t waiting = 0;         // Tasks in the deques not yet claimed by a worker
+    size_t maxWaiting;
+    size_t nextQueue = 0;
+    bool closing = false;
+
+    bool take(size_t self, Task& task) {
+        Queue& own = *queues[self];
+        {
+            lock_guard<mutex> guard(own.lock);
+            if (!own.tasks.empty()) {
+                task = move(own.tasks.back());
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < queues.size(); i++) {
+            Queue& victim = *queues[(self + i) % queues.size()];
+            lock_guard<mutex> guard(victim.lock);
+            if (!victim.tasks.empty()) {
+                task = move(victim.tasks.front());
+                victim.tasks.pop_front();
+                victim.stolen++;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void work(size_t self) {
+        while (true) {
+            {
+                unique_lock<mutex> guard(idleLock);
+                wake.wait(guard, [this] { return closing || waiting > 0; });
+                if (waiting == 0) return;
+                waiting--;  // Claim one task; it is in some deque already
+            }
+            room.notify_one();
+            Task task;
+            while (!take(self, task)) this_thread::yield();
+            task(self);
+        }
+    }
+
+public:
+    // `maxWaiting` bounds the tasks queued ahead of the workers; submit
+    // blocks until there is room again
+    explicit WorkStealingPool(unsigned count, size_t maxWaiting = 4096) : maxWaiting(max<size_t>(1, maxWaiting)) {
+        for (unsigned i = 0; i < max(1u, count); i++) queues.emplace_back(new Queue);
+        for (size_t i = 0; i < queues.size(); i++) workers.emplace_back([this, i] { work(i); });
+    }
+
+    ~WorkStealingPool() { finish(); }
+
+    size_t size() const { return queues.size(); }
+
+    // Deal a task to the next deque in turn. Only one thread may submit.
+    void submit(Task task) {
+        {
+            unique_lock<mutex> guard(idleLock);
+            room.wait(guard, [this] { return waiting < maxWaiting; });
+        }
+        Queue& target = *queues[nextQueue];
+        nextQueue = (nextQueue + 1) % queues.size();
+        {
+            lock_guard<mutex> guard(target.lock);
+            target.tasks.push_back(move(task));
+        }
+        {
+            lock_guard<mutex> guard(idleLock);
+            waiting++;
+        }
+        wake.notify_one();
+    }
+
+    // Run every submitted task, then stop the workers
+    void finish() {
+        {
+            lock_guard<mutex> guard(idleLock);
+            closing = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) worker.join();
+        workers.clear();
+    }
+
+    // Tasks that ran on another worker than the one they were dealt to
+    size_t steals() {
+        size_t total = 0;
+        for (auto& queue : queues) {
+            lock_guard<mutex> guard(queue->lock);
+            total += queue->stolen;
+        }
+        return total;
+    }
+};
+
+// Substring search kernel. Candidate positions are found by comparing the
+// first and last byte of the word against 16 (SSE2) or 32 (AVX2) positions
+// at once; only candidates get a full memcmp. The widest kernel the CPU
+// supports is picked at runtime, with a scalar fallback.
+class SearchKernel {
+private:
+    typedef size_t (*FindFunction)(const char*, size_t, const char*, size_t);
+
+    static size_t findScalar(const char* text, size_t n, const char* word, size_t k) {
+        size_t pos = string_view(text, n).find(string_view(word, k));
+        return pos == string_view::npos ? n : pos;
+    }
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__)
+    static size_t findSse2(const char* text, size_t n, const char* word, size_t k) {
+        const __m128i first = _mm_set1_epi8(word[0]);
+        const __m128i last = _mm_set1_epi8(word[k - 1]);
+        size_t i = 0;
+        for (; i + k - 1 + 16 <= n; i += 16) {
+            __m128i blockFirst = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i));
+            __m128i blockLast = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i + k - 1));
+            unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, blockFirst),
+                                                            _mm_cmpeq_epi8(last, blockLast)));
+            while (mask) {
+                unsigned bit = countTrailingZeros(mask);
+                if (memcmp(text + i + bit + 1, word + 1, k - 2) == 0) return i + bit;
+                mask &= mask - 1;
+            }
+        }
+        return i + findScalar(text + i, n - i, word, k);
+    }
+#define SEARCH_KERNEL_SSE2
+#endif
+
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+    __attribute__((target("avx2")))
+    static size_t findAvx2(const char* text, size_t n, const char* word, size_t k) {
+        const __m256i first = _mm256_set1_epi8(word[0]);
+        const __m256i last = _mm256_set1_epi8(word[k - 1]);
+        size_t i = 0;
+        for (; i + k - 1 + 32 <= n; i += 32) {
+            __m256i blockFirst = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + i));
+            __m256i blockLast = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + i + k - 1));
+            unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first, blockFirst),
+                                                                            _mm256_cmpeq_epi8(last, blockLast)));
+            while (mask) {
+                unsigned bit = countTrailingZeros(mask);
+                if (memcmp(text + i + bit + 1, word + 1, k - 2) == 0) return i + bit;
+                mask &= mask - 1;
+            }
+        }
+        return i + findScalar(text + i, n - i, word, k);
+    }
+#define SEARCH_KERNEL_AVX2
+#endif
+
+    static unsigned countTrailingZeros(unsigned mask) {
+#if defined(_MSC_VER) && !defined(__clang__)
+        unsigned long bit;
+        _BitScanForward(&bit, mask);
+        return bit;
+#else
+        return __builtin_ctz(mask);
+#endif
+    }
+
+    static FindFunction pick(const char*& name) {
+#ifdef SEARCH_KERNEL_AVX2
+        if (__builtin_cpu_supports("avx2")) {
+            name = "avx2";
+            return findAvx2;
+        }
+#endif
+#ifdef SEARCH_KERNEL_SSE2
+        name = "sse2";
+        return findSse2;
+#else
+        name = "scalar";
+        return findScalar;
+#endif
+    }
+
+    static FindFunction& chosen(const char*& name) {
+        static const char* chosenName = nullptr;
+        static FindFunction function = pick(chosenName);
+        name = chosenName;
+        return function;
+    }
+
+public:
+    // Name of the kernel picked for this CPU
+    static const char* name() {
+        const char* kernelName;
+        chosen(kernelName);
+        return kernelName;
+    }
+
+    // Position of the first `word` in `text` at or after `from`, or npos
+    static size_t find(string_view text, string_view word, size_t from = 0) {
+        if (from > text.size() || word.size() > text.size() - from) return string_view::npos;
+        if (word.empty()) return from;
+        const char* start = text.data() + from;
+        size_t n = text.size() - from;
+        size_t pos;
+        if (word.size() == 1) {
+            const void* hit = memchr(start, word[0], n);
+            pos = hit ? static_cast<const char*>(hit) - start : n;
+        } else {
+            const char* kernelName;
+            pos = chosen(kernelName)(start, n, word.data(), word.size());
+        }
+        return pos >= n ? string_view::npos : from + pos;
+    }
+};
+
+// ASCII case conversion kernel. Letters are found with a range compare on
+// 16 (SSE2) or 32 (AVX2) bytes at once and flipped by toggling bit 0x20;
+// every other byte, including all bytes of UTF-8 sequences, is copied as is.
+// That matches toupper/tolower in the "C" locale without calling them per byte.
+class CaseKernel {
+private:
+    typedef bool (*ConvertFunction)(const char*, char*, size_t, char);
+
+    // `first` is 'a' to convert to upper case and 'A' to convert to lower case
+    static bool convertScalar(const char* src, char* dst, size_t n, char first) {
+        bool changed = false;
+        for (size_t i = 0; i < n; i++) {
+            bool letter = (unsigned char)(src[i] - first) < 26;
+            dst[i] = letter ? (char)(src[i] ^ 0x20) : src[i];
+            changed |= letter;
+        }
+        return changed;
+    }
+
+#ifdef SEARCH_KERNEL_SSE2
+    static bool convertSse2(const char* src, char* dst, size_t n, char first) {
+        // Shifting the range down to -128 turns "first <= c < first + 26"
+        // into a single signed compare
+        const __m128i shift = _mm_set1_epi8((char)(0x80 - first));
+        const __m128i limit = _mm_set1_epi8((char)(-128 + 26));
+        const __m128i flip = _mm_set1_epi8(0x20);
+        __m128i any = _mm_setzero_si128();
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            __m128i letters = _mm_cmplt_epi8(_mm_add_epi8(block, shift), limit);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_xor_si128(block, _mm_and_si128(letters, flip)));
+            any = _mm_or_si128(any, letters);
+        }
+        bool changed = _mm_movemask_epi8(any) != 0;
+        return convertScalar(src + i, dst + i, n - i, first) || changed;
+    }
+#endif
+
+#ifdef SEARCH_KERNEL_AVX2
+    __attribute__((target("avx2")))
+    static bool convertAvx2(const char* src, char* dst, size_t n, char first) {
+        const __m256i shift = _mm256_set1_epi8((char)(0x80 - first));
+        const __m256i limit = _mm256_set1_epi8((char)(-128 + 26));
+        const __m256i flip = _mm256_set1_epi8(0x20);
+        __m256i any = _mm256_setzero_si256();
+        size_t i = 0;
+        for (; i + 32 <= n; i += 32) {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+            __m256i letters = _mm256_cmpgt_epi8(limit, _mm256_add_epi8(block, shift));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i),
+                                _mm256_xor_si256(block, _mm256_and_si256(letters, flip)));
+            any = _mm256_or_si256(any, letters);
+        }
+        bool changed = _mm256_movemask_epi8(any) != 0;
+        return convertScalar(src + i, dst + i, n - i, first) || changed;
+    }
+#endif
+
+    static ConvertFunction pick() {
+#ifdef SEARCH_KERNEL_AVX2
+        if (__builtin_cpu_supports("avx2")) return convertAvx2;
+#endif
+#ifdef SEARCH_KERNEL_SSE2
+        return convertSse2;
+#else
+        return convertScalar;
+#endif
+    }
+
+public:
+    // Convert n bytes from src into dst (which may be src); returns true if
+    // any byte changed
+    static bool convert(const char* src, char* dst, size_t n, bool upper) {
+        static const ConvertFunction function = pick();
+        return function(src, dst, n, upper ? 'a' : 'A');
+    }
+};
+
+// One search result, 0-based
+struct SearchHit {
+    size_t line;
+    size_t column;
+};
+
+// Calls f(word) for every word of a line, split on spaces and punctuation
+template <class F>
+void forEachWord(string_view line, F f) {
+    size_t start = 0, end;
+    while ((end = line.find_first_of(" \t\n,.!?;:", start)) != string_view::npos) {
+        if (start < end) f(line.substr(start, end - start));
+        start = end + 1;
+    }
+    if (start < line.size()) f(line.substr(start));
+}
+
+// Approximate search: finds the substrings of a line within `k` edits
+// (inserted, deleted or substituted bytes) of a word of up to 64 bytes.
+// Lines are scanned with Myers' bit-parallel algorithm, which keeps a whole
+// column of the edit distance table in two 64-bit words and advances it
+// one text byte per step. Any match contains at least one of k + 1 pieces of
+// the word unchanged, so when the pieces are long enough to be selective a
+// line is only scanned if SearchKernel finds one of them in it.
+class FuzzyMatcher {
+public:
+    static constexpr size_t MAX_WORD = 64;
+
+    struct Match {
+        size_t start, end;      // Matched bytes [start, end)
+        unsigned distance;
+    };
+
+private:
+    static constexpr size_t MIN_PIECE = 3;
+
+    string word;
+    unsigned k;
+    uint64_t peq[256] = {};     // Bit i of peq[c] is set when word[i] == c
+    uint64_t high;              // Bit of the last row of the table
+    vector<string_view> pieces; // Empty when the filter would not be selective
+
+    // Where a match ending at `end` with `distance` edits starts: the
+    // length j closest to the word's own for which word and the last j
+    // bytes before `end` are that many edits apart
+    size_t startOf(string_view line, size_t end, unsigned distance) const {
+        size_t m = word.size();
+        size_t window = min(end, m + k);
+        vector<unsigned> previous(window + 1), current(window + 1);
+        for (size_t j = 0; j <= window; j++) previous[j] = (unsigned)j;
+        for (size_t i = 1; i <= m; i++) {
+            current[0] = (unsigned)i;
+            char c = word[m - i];
+            for (size_t j = 1; j <= window; j++) {
+                unsigned substitute = previous[j - 1] + (line[end - j] != c);
+                current[j] = min({substitute, previous[j] + 1, current[j - 1] + 1});
+            }
+            swap(previous, current);
+        }
+        auto gap = [m](size_t j) { return j > m ? j - m : m - j; };
+        size_t best = 0;
+        bool found = false;
+        for (size_t j = 0; j <= window; j++) {
+            if (previous[j] == distance && (!found || gap(j) < gap(best))) {
+                best = j;
+                found = true;
+            }
+        }
+        return end - best;
+    }
+
+public:
+    // `word` must be 1..MAX_WORD bytes and k smaller than its length
+    FuzzyMatcher(const string& word, unsigned k) : word(word), k(k), high(1ull << (word.size() - 1)) {
+        for (size_t i = 0; i < word.size(); i++) peq[(unsigned char)word[i]] |= 1ull << i;
+        size_t piece = word.size() / (k + 1);
+        if (piece >= MIN_PIECE) {
+            for (size_t i = 0; i <= k; i++) pieces.push_back(string_view(this->word).substr(i * piece, piece));
+        }
+    }
+
+    FuzzyMatcher(const FuzzyMatcher&) = delete;
+    FuzzyMatcher& operator=(const FuzzyMatcher&) = delete;
+
+    // Calls f(match) for each match in the line, left to right. Every run of
+    // adjacent end positions within k edits counts as one match, reported
+    // at the position with the fewest edits.
+    template <class F>
+    void forEachMatch(string_view line, F f) const {
+        if (!pieces.empty()) {
+            bool candidate = false;
+            for (string_view piece : pieces) {
+                if (SearchKernel::find(line, piece) != string_view::npos) {
+                    candidate = true;
+                    break;
+                }
+            }
+            if (!candidate) return;
+        }
+
+        uint64_t pv = ~0ull, mv = 0;
+        unsigned score = (unsigned)word.size();
+        bool inRun = false;
+        size_t bestEnd = 0;
+        unsigned best = 0;
+        for (size_t j = 0; j < line.size(); j++) {
+            uint64_t eq = peq[(unsigned char)line[j]];
+            uint64_t xv = eq | mv;
+            uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+            uint64_t ph = mv | ~(xh | pv);
+            uint64_t mh = pv & xh;
+            score += (ph & high) != 0;
+            score -= (mh & high) != 0;
+            ph <<= 1;
+            mh <<= 1;
+            pv = mh | ~(xv | ph);
+            mv = ph & xv;
+
+            if (score <= k) {
+                if (!inRun || score < best) {
+                    best = score;
+                    bestEnd = j + 1;
+                }
+                inRun = true;
+            } else if (inRun) {
+                f(Match{startOf(line, bestEnd, best), bestEnd, best});
+                inRun = false;
+            }
+        }
+        if (inRun) f(Match{startOf(line, bestEnd, best), bestEnd, best});
+    }
+};
+
+// Regular expressions for search and replace. The pattern is parsed into a
+// Thompson NFA over bytes, and matching runs DFAs whose states are built
+// lazily from sets of NFA states (and dropped if too many pile up), so every
+// line is scanned in linear time with no backtracking. A reverse DFA marks
+// where matches start, a forward DFA finds the longest match from there:
+// matches are leftmost-longest, as in POSIX. Capture groups are resolved
+// only for a known match, by simulating the NFA over the matched bytes.
+//
+// Syntax: literal characters, ., [...] and [^...] with ranges, \d \w \s
+// \D \W \S \t \n \r \xHH and escaped punctuation, (...) groups, (?:...),
+// |, *, +, ?, {m}, {m,}, {m,n}, and ^ / $ at the start / end of the pattern
+// (they anchor the whole pattern). . and negated classes match one whole
+// UTF-8 character.
+class Regex {
+public:
+    // Replacement text split into literal runs and group references
+    struct Replacement {
+        vector<pair<string, int>> parts;  // (literal, group or -1)
+        int highestGroup = 0;
+    };
+
+private:
+    struct Node {
+        enum Kind : uint8_t { EMPTY, BYTES, CONCAT, ALT, REPEAT, GROUP };
+        Kind kind;
+        bitset<256> bytes;      // BYTES
+        vector<int> children;   // CONCAT and ALT; REPEAT and GROUP have one
+        int min = 0, max = 0;   // REPEAT; max < 0 means no upper bound
+        int group = 0;          // GROUP
+    };
+
+    struct State {
+        enum Kind : uint8_t { BYTES, SPLIT, SAVE, MATCH };
+        Kind kind;
+        bitset<256> bytes;      // BYTES
+        int out = -1, out1 = -1;  // SPLIT prefers out
+        int slot = 0;           // SAVE
+    };
+
+    static const int MAX_REPEAT = 1000;
+    static const size_t MAX_STATES = 50000;
+
+    // DFA over the NFA states reachable from `start`, built one transition
+    // at a time. An unanchored DFA restarts the NFA at every byte.
+    class LazyDfa {
+    private:
+        static constexpr int UNKNOWN = -2;
+        static const size_t CACHE_LIMIT = 4096;
+
+        struct DState {
+            vector<int> set;
+            bool accepting;
+            array<int, 256> next;
+        };
+
+        const vector<State>* nfa = nullptr;
+        int start = 0;
+        bool unanchored = false;
+        vector<DState> states;
+        map<vector<int>, int> ids;
+        int startId = UNKNOWN;
+        vector<unsigned> marks;
+        unsigned generation = 0;
+        vector<int> stack;
+
+        void addClosure(vector<int>& set, int from) {
+            stack.push_back(from);
+            while (!stack.empty()) {
+                int s = stack.back();
+                stack.pop_back();
+                if (s < 0 || marks[s] == generation) continue;
+                marks[s] = generation;
+                const State& state = (*nfa)[s];
+                if (state.kind == State::SPLIT) {
+                    stack.push_back(state.out1);
+                    stack.push_back(state.out);
+                } else if (state.kind == State::SAVE) {
+                    stack.push_back(state.out);
+                } else {
+                    set.push_back(s);
+                }
+            }
+        }
+
+        int intern(vector<int>& set) {
+            if (set.empty()) return DEAD;
+            sort(set.begin(), set.end());
+            auto found = ids.find(set);
+            if (found != ids.end()) return found->second;
+            if (states.size() >= CACHE_LIMIT) {
+                // Start over rather than grow without bound; callers only
+                // hold on to the id returned here
+                states.clear();
+                ids.clear();
+                startId = UNKNOWN;
+            }
+            DState state;
+            state.set = set;
+            state.accepting = false;
+            for (int s : set) state.accepting |= (*nfa)[s].kind == State::MATCH;
+            state.next.fill(UNKNOWN);
+            states.push_back(move(state));
+            ids.emplace(set, (int)states.size() - 1);
+            return (int)states.size() - 1;
+        }
+
+    public:
+        static constexpr int DEAD = -1;
+
+        void reset(const vector<State>& automaton, int startState, bool restartEverywhere) {
+            nfa = &automaton;
+            start = startState;
+            unanchored = restartEverywhere;
+            states.clear();
+            ids.clear();
+            startId = UNKNOWN;
+            marks.assign(automaton.size(), 0);
+        }
+
+        int begin() {
+            if (startId == UNKNOWN) {
+                vector<int> set;
+                generation++;
+                addClosure(set, start);
+                startId = intern(set);
+            }
+            return startId;
+        }
+
+        bool accepting(int id) const { return id != DEAD && states[id].accepting; }
+
+        int step(int from, unsigned char c) {
+            int cached = states[from].next[c];
+            if (cached != UNKNOWN) return cached;
+            vector<int> set;
+            generation++;
+            for (int s : states[from].set) {
+                const State& state = (*nfa)[s];
+                if (state.kind == State::BYTES && state.bytes[c]) addClosure(set, state.out);
+            }
+            if (unanchored) addClosure(set, start);
+            size_t before = states.size();
+            int to = intern(set);
+            if (states.size() >= before) states[from].next[c] = to;  // Unless the cache was just dropped
+            return to;
+        }
+    };
+
+    string pattern;
+    size_t pos = 0;
+    string problem;
+    vector<Node> nodes;
+    int groups = 0;
+    bool anchorStart = false, anchorEnd = false;
+    vector<State> forwardNfa, reverseNfa;
+    int forwardStart = 0, reverseStart = 0;
+    LazyDfa forward, backward;
+    vector<char> starts;
+
+    int fail(const string& message) {
+        if (problem.empty()) problem = message + " at offset " + to_string(pos + anchorStart);
+        return -1;
+    }
+
+    int addNode(Node::Kind kind, vector<int> children = {}) {
+        Node node;
+        node.kind = kind;
+        node.children = move(children);
+        nodes.push_back(move(node));
+        return (int)nodes.size() - 1;
+    }
+
+    int bytesNode(const bitset<256>& bytes) {
+        int id = addNode(Node::BYTES);
+        nodes[id].bytes = bytes;
+        return id;
+    }
+
+    static bitset<256> byteRange(int lo, int hi) {
+        bitset<256> bytes;
+        for (int b = lo; b <= hi; b++) bytes.set(b);
+        return bytes;
+    }
+
+    // One character: an ASCII byte from `ascii`, any non-ASCII UTF-8
+    // character if `nonAscii`, or one of the `extra` byte sequences
+    int charNode(const bitset<256>& ascii, bool nonAscii, const vector<string>& extra = {}) {
+        vector<int> choices{bytesNode(ascii & byteRange(0, 0x7F))};
+        if (nonAscii) {
+            int lengths[3][2] = {{0xC0, 0xDF}, {0xE0, 0xEF}, {0xF0, 0xF7}};
+            for (int k = 0; k < 3; k++) {
+                vector<int> sequence{bytesNode(byteRange(lengths[k][0], lengths[k][1]))};
+                for (int i = 0; i <= k; i++) sequence.push_back(bytesNode(byteRange(0x80, 0xBF)));
+                choices.push_back(addNode(Node::CONCAT, sequence));
+            }
+            // Stray bytes of malformed text still count as one character
+            choices.push_back(bytesNode(byteRange(0x80, 0xBF) | byteRange(0xF8, 0xFF)));
+        }
+        for (const string& sequence : extra) choices.push_back(literalNode(sequence));
+        return choices.size() == 1 ? choices[0] : addNode(Node::ALT, choices);
+    }
+
+    int literalNode(const string& bytes) {
+        vector<int> sequence;
+        for (unsigned char c : bytes) sequence.push_back(bytesNode(byteRange(c, c)));
+        return sequence.size() == 1 ? sequence[0] : addNode(Node::CONCAT, sequence);
+    }
+
+    // \d \w \s (and upper case for the complement); false if `c` is none of them
+    static bool classEscape(char c, bitset<256>& ascii, bool& negated) {
+        ascii.reset();
+        switch (tolower(c)) {
+            case 'd': ascii = byteRange('0', '9'); break;
+            case 'w': ascii = byteRange('0', '9') | byteRange('A', 'Z') | byteRange('a', 'z') | byteRange('_', '_'); break;
+            case 's': ascii = byteRange(' ', ' ') | byteRange('\t', '\r'); break;
+            default: return false;
+        }
+        negated = isupper((unsigned char)c) != 0;
+        return true;
+    }
+
+    // One character of a literal or class (escapes resolved); UTF-8
+    // sequences are returned whole
+    bool readChar(string& bytes) {
+        bytes.clear();
+        unsigned char c = pattern[pos++];
+        if (c == '\\') {
+            if (pos >= pattern.size()) return fail("trailing backslash") >= 0;
+            char e = pattern[pos++];
+            switch (e) {
+                case 't': bytes = "\t"; return true;
+                case 'n': bytes = "\n"; return true;
+                case 'r': bytes = "\r"; return true;
+                case 'f': bytes = "\f"; return true;
+                case 'v': bytes = "\v"; return true;
+                case 'x': {
+                    if (pos + 2 > pattern.size() || !isxdigit((unsigned char)pattern[pos]) ||
+                        !isxdigit((unsigned char)pattern[pos + 1])) {
+                        return fail("\\x needs two hex digits") >= 0;
+                    }
+                    bytes = string(1, (char)stoi(pattern.substr(pos, 2), nullptr, 16));
+                    pos += 2;
+                    return true;
+                }
+                default:
+                    if (isalnum((unsigned char)e)) return fail(string("unknown escape \\") + e) >= 0;
+                    bytes = string(1, e);
+                    return true;
+            }
+        }
+        bytes += (char)c;
+        int more = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+        while (more-- > 0 && pos < pattern.size() && ((unsigned char)pattern[pos] & 0xC0) == 0x80) bytes += pattern[pos++];
+        return true;
+    }
+
+    int parseClass() {
+        pos++;  // '['
+        bool negate = pos < pattern.size() && pattern[pos] == '^';
+        if (negate) pos++;
+        bitset<256> ascii;
+        bool nonAscii = false;
+        vector<string> extra;
+        string lo, hi;
+        bool first = true;
+        while (pos < pattern.size() && (pattern[pos] != ']' || first)) {
+            first = false;
+            bitset<256> escaped;
+            bool negated;
+            if (pattern[pos] == '\\' && pos + 1 < pattern.size() && classEscape(pattern[pos + 1], escaped, negated)) {
+                pos += 2;
+                if (negated) {
+                    ascii |= ~escaped & byteRange(0, 0x7F);
+                    nonAscii = true;
+                } else {
+                    ascii |= escaped;
+                }
+                continue;
+            }
+            if (!readChar(lo)) return -1;
+            if (pos + 1 < pattern.size() && pattern[pos] == '-' && pattern[pos + 1] != ']') {
+                pos++;
+                if (!readChar(hi)) return -1;
+                if (lo.size() > 1 || hi.size() > 1) return fail("ranges of non-ASCII characters are not supported");
+                if ((unsigned char)lo[0] > (unsigned char)hi[0]) return fail("bad range");
+                ascii |= byteRange((unsigned char)lo[0], (unsigned char)hi[0]);
+            } else if (lo.size() > 1 || (unsigned char)lo[0] >= 0x80) {
+                extra.push_back(lo);
+            } else {
+                ascii.set((unsigned char)lo[0]);
+            }
+        }
+        if (pos >= pattern.size()) return fail("missing ]");
+        pos++;
+        if (!negate) return charNode(ascii, nonAscii, extra);
+        if (!extra.empty() || nonAscii) return fail("negated classes may only list ASCII characters");
+        return charNode(~ascii, true);
+    }
+
+    int parseAtom() {
+        char c = pattern[pos];
+        if (c == '(') {
+            pos++;
+            bool capture = pattern.compare(pos, 2, "?:") != 0;
+            if (!capture) pos += 2;
+            int group = capture ? ++groups : 0;
+            int inner = parseAlternation();
+            if (inner < 0) return -1;
+            if (pos >= pattern.size() || pattern[pos] != ')') return fail("missing )");
+            pos++;
+            if (!capture) return inner;
+            int id = addNode(Node::GROUP, {inner});
+            nodes[id].group = group;
+            return id;
+        }
+        if (c == '*' || c == '+' || c == '?') return fail("nothing to repeat");
+        if (c == '^' || c == '$') return fail("^ and $ are only supported at the start and end of the pattern");
+        if (c == '.') {
+            pos++;
+            return charNode(byteRange(0, 0x7F), true);
+        }
+        if (c == '[') return parseClass();
+        bitset<256> escaped;
+        bool negated;
+        if (c == '\\' && pos + 1 < pattern.size() && classEscape(pattern[pos + 1], escaped, negated)) {
+            pos += 2;
+            return negated ? charNode(~escaped, true) : charNode(escaped, false);
+        }
+        string bytes;
+        if (!readChar(bytes)) return -1;
+        return literalNode(bytes);
+    }
+
+    // {m}, {m,} or {m,n}; anything else leaves '{' to be read as a literal
+    bool parseBraces(int& lo, int& hi) {
+        size_t p = pos + 1;
+        auto number = [&](int& value) {
+            size_t begin = p;
+            value = 0;
+            while (p < pattern.size() && isdigit((unsigned char)pattern[p]) && value <= MAX_REPEAT) {
+                value = value * 10 + (pattern[p++] - '0');
+            }
+            return p > begin;
+        };
+        if (!number(lo)) return false;
+        hi = lo;
+        if (p < pattern.size() && pattern[p] == ',') {
+            p++;
+            if (!number(hi)) hi = -1;
+        }
+        if (p >= pattern.size() || pattern[p] != '}') return false;
+        pos = p + 1;
+        return true;
+    }
+
+    int parseRepeat() {
+        int atom = parseAtom();
+        while (atom >= 0 && pos < pattern.size()) {
+            char c = pattern[pos];
+            int lo, hi;
+            if (c == '*' || c == '+' || c == '?') {
+                lo = c == '+' ? 1 : 0;
+                hi = c == '?' ? 1 : -1;
+                pos++;
+            } else if (c != '{' || !parseBraces(lo, hi)) {
+                break;
+            }
+            if (lo > MAX_REPEAT || hi > MAX_REPEAT) return fail("repetition count above " + to_string(MAX_REPEAT));
+            if (hi >= 0 && hi < lo) return fail("bad repetition range");
+            int id = addNode(Node::REPEAT, {atom});
+            nodes[id].min = lo;
+            nodes[id].max = hi;
+            atom = id;
+        }
+        return atom;
+    }
+
+    int parseConcatenation() {
+        vector<int> items;
+        while (pos < pattern.size() && pattern[pos] != '|' && pattern[pos] != ')') {
+            int item = parseRepeat();
+            if (item < 0) return -1;
+            items.push_back(item);
+        }
+        if (items.empty()) return addNode(Node::EMPTY);
+        return items.size() == 1 ? items[0] : addNode(Node::CONCAT, items);
+    }
+
+    int parseAlternation() {
+        vector<int> branches{parseConcatenation()};
+        while (branches.back() >= 0 && pos < pattern.size() && pattern[pos] == '|') {
+            pos++;
+            branches.push_back(parseConcatenation());
+        }
+        if (branches.back() < 0) return -1;
+        return branches.size() == 1 ? branches[0] : addNode(Node::ALT, branches);
+    }
+
+    static int addState(vector<State>& nfa, State::Kind kind, int out, int out1 = -1) {
+        State state;
+        state.kind = kind;
+        state.out = out;
+        state.out1 = out1;
+        nfa.push_back(state);
+        return (int)nfa.size() - 1;
+    }
+
+    // Compile `node` so that it continues at state `next`; the reverse NFA
+    // matches the reversed language and has no capture states
+    int compile(vector<State>& nfa, int node, int next, bool reverse) {
+        if (nfa.size() > MAX_STATES) return next;  // Reported by the caller
+        const Node& n = nodes[node];
+        switch (n.kind) {
+            case Node::EMPTY:
+                return next;
+            case Node::BYTES: {
+                int id = addState(nfa, State::BYTES, next);
+                nfa[id].bytes = n.bytes;
+                return id;
+            }
+            case Node::CONCAT:
+                if (reverse) {
+                    for (int child : n.children) next = compile(nfa, child, next, reverse);
+                } else {
+                    for (auto it = n.children.rbegin(); it != n.children.rend(); ++it) next = compile(nfa, *it, next, reverse);
+                }
+                return next;
+            case Node::ALT: {
+                int choice = compile(nfa, n.children.back(), next, reverse);
+                for (size_t i = n.children.size() - 1; i-- > 0;) {
+                    int branch = compile(nfa, n.children[i], next, reverse);
+                    choice = addState(nfa, State::SPLIT, branch, choice);
+                }
+                return choice;
+            }
+            case Node::GROUP: {
+                if (reverse) return compile(nfa, n.children[0], next, reverse);
+                int close = addState(nfa, State::SAVE, next);
+                nfa[close].slot = 2 * n.group + 1;
+                int body = compile(nfa, n.children[0], close, reverse);
+                int open = addState(nfa, State::SAVE, body);
+                nfa[open].slot = 2 * n.group;
+                return open;
+            }
+            case Node::REPEAT: {
+                int tail = next;
+                if (n.max < 0) {
+                    int loop = addState(nfa, State::SPLIT, -1, next);
+                    int body = compile(nfa, n.children[0], loop, reverse);
+                    nfa[loop].out = body;
+                    tail = loop;
+                } else {
+                    for (int i = n.min; i < n.max; i++) {
+                        int body = compile(nfa, n.children[0], tail, reverse);
+                        tail = addState(nfa, State::SPLIT, body, next);
+                    }
+                }
+                for (int i = 0; i < n.min; i++) tail = compile(nfa, n.children[0], tail, reverse);
+                return tail;
+            }
+        }
+        return next;
+    }
+
+    // End of the longest match starting at `start`, or npos
+    size_t longestFrom(string_view line, size_t start) {
+        int state = forward.begin();
+        size_t last = string_view::npos;
+        if (forward.accepting(state) && (!anchorEnd || start == line.size())) last = start;
+        for (size_t i = start; i < line.size(); i++) {
+            state = forward.step(state, (unsigned char)line[i]);
+            if (state == LazyDfa::DEAD) break;
+            if (forward.accepting(state) && (!anchorEnd || i + 1 == line.size())) last = i + 1;
+        }
+        return last;
+    }
+
+    // Mark in `starts` every position where some match begins, scanning the
+    // line backwards once
+    void markStarts(string_view line) {
+        size_t n = line.size();
+        starts.assign(n + 1, 0);
+        int state = backward.begin();
+        starts[n] = backward.accepting(state);
+        for (size_t i = n; i-- > 0 && state != LazyDfa::DEAD;) {
+            state = backward.step(state, (unsigned char)line[i]);
+            starts[i] = backward.accepting(state);
+        }
+    }
+
+public:
+    Regex(const Regex&) = delete;  // The DFAs point into the NFAs
+    Regex& operator=(const Regex&) = delete;
+
+    explicit Regex(const string& text) : pattern(text) {
+        if (!pattern.empty() && pattern[0] == '^') {
+            anchorStart = true;
+            pattern.erase(0, 1);
+        }
+        size_t backslashes = 0;
+        for (size_t i = pattern.size() - (pattern.empty() ? 0 : 1); i-- > 0 && pattern[i] == '\\';) backslashes++;
+        if (!pattern.empty() && pattern.back() == '$' && backslashes % 2 == 0) {
+            anchorEnd = true;
+            pattern.pop_back();
+        }
+        int root = parseAlternation();
+        if (root >= 0 && pos < pattern.size()) root = fail("unmatched )");
+        if (root < 0) return;
+
+        int match = addState(forwardNfa, State::MATCH, -1);
+        forwardStart = compile(forwardNfa, root, match, false);
+        match = addState(reverseNfa, State::MATCH, -1);
+        reverseStart = compile(reverseNfa, root, match, true);
+        if (forwardNfa.size() > MAX_STATES || reverseNfa.size() > MAX_STATES) {
+            problem = "pattern is too large";
+            return;
+        }
+        forward.reset(forwardNfa, forwardStart, false);
+        // Matches may end anywhere unless the pattern ends with $
+        backward.reset(reverseNfa, reverseStart, !anchorEnd);
+    }
+
+    bool valid() const { return problem.empty(); }
+    const string& error() const { return problem; }
+    int groupCount() const { return groups; }
+
+    // Calls f(start, end) for every leftmost-longest match in the line,
+    // left to right and without overlaps
+    template <class F>
+    void forEachMatch(string_view line, F f) {
+        if (anchorStart) {
+            size_t end = longestFrom(line, 0);
+            if (end != string_view::npos) f((size_t)0, end);
+            return;
+        }
+        markStarts(line);
+        size_t from = 0;
+        while (from <= line.size()) {
+            const void* next = memchr(starts.data() + from, 1, line.size() + 1 - from);
+            if (!next) break;
+            size_t start = static_cast<const char*>(next) - starts.data();
+            size_t end = longestFrom(line, start);
+            f(start, end);
+            from = end > start ? end : start + 1;
+        }
+    }
+
+    // Capture slots for the match [start, end): group g spans
+    // [slots[2g], slots[2g + 1]), npos when the group took no part.
+    // Runs the NFA (Pike VM) over the matched bytes; earlier alternatives
+    // and longer repeats take priority inside the match.
+    void captures(string_view line, size_t start, size_t end, vector<size_t>& slots) {
+        size_t width = 2 * (groups + 1);
+        vector<int> current, following;
+        vector<size_t> currentSlots(forwardNfa.size() * width), followingSlots(forwardNfa.size() * width);
+        vector<unsigned> onList(forwardNfa.size(), 0);
+        unsigned generation = 0;
+        vector<size_t> scratch(width, string_view::npos);
+
+        // Follow the epsilon transitions from `from`, with an explicit stack
+        // like LazyDfa::addClosure. A SAVE sets its slot for the states
+        // reached through it; the frame pushed under them puts the old value
+        // back once they are done, so the search order (and with it the
+        // priority of alternatives) is the same as a recursive walk.
+        struct Frame {
+            int state;      // RESTORE to put `saved` back into `slot`
+            int slot;
+            size_t saved;
+        };
+        const int RESTORE = -2;
+        vector<Frame> stack;
+        auto add = [&](vector<int>& list, vector<size_t>& listSlots, int from, size_t at) {
+            stack.push_back({from, 0, 0});
+            while (!stack.empty()) {
+                Frame frame = stack.back();
+                stack.pop_back();
+                if (frame.state == RESTORE) {
+                    scratch[frame.slot] = frame.saved;
+                    continue;
+                }
+                int s = frame.state;
+                if (s < 0 || onList[s] == generation) continue;
+                onList[s] = generation;
+                const State& state = forwardNfa[s];
+                if (state.kind == State::SPLIT) {
+                    stack.push_back({state.out1, 0, 0});
+                    stack.push_back({state.out, 0, 0});
+                } else if (state.kind == State::SAVE) {
+                    stack.push_back({RESTORE, state.slot, scratch[state.slot]});
+                    scratch[state.slot] = at;
+                    stack.push_back({state.out, 0, 0});
+                } else {
+                    list.push_back(s);
+                    copy(scratch.begin(), scratch.end(), listSlots.begin() + s * width);
+                }
+            }
+        };
+
+        generation++;
+        add(current, currentSlots, forwardStart, start);
+        for (size_t i = start; i < end && !current.empty(); i++) {
+            generation++;
+            following.clear();
+            for (int s : current) {
+                const State& state = forwardNfa[s];
+                if (state.kind != State::BYTES || !state.bytes[(unsigned char)line[i]]) continue;
+                copy(currentSlots.begin() + s * width, currentSlots.begin() + (s + 1) * width, scratch.begin());
+                add(following, followingSlots, state.out, i + 1);
+            }
+            swap(current, following);
+            swap(currentSlots, followingSlots);
+        }
+        slots.assign(width, string_view::npos);
+        for (int s : current) {
+            if (forwardNfa[s].kind != State::MATCH) continue;
+            slots.assign(currentSlots.begin() + s * width, currentSlots.begin() + (s + 1) * width);
+            break;
+        }
+        slots[0] = start;
+        slots[1] = end;
+    }
+
+    // Split replacement text into literals and $0-$9, ${n}, $& references
+    // ($$ is a literal $)
+    static Replacement parseReplacement(const string& text) {
+        Replacement replacement;
+        string literal;
+        for (size_t i = 0; i < text.size(); i++) {
+            int group = -1;
+            if (text[i] == '$' && i + 1 < text.size()) {
+                char c = text[i + 1];
+                size_t close = text.find('}', i + 2);
+                if (isdigit((unsigned char)c)) {
+                    group = c - '0';
+                    i++;
+                } else if (c == '&') {
+                    group = 0;
+                    i++;
+                } else if (c == '$') {
+                    literal += '$';
+                    i++;
+                    continue;
+                } else if (c == '{' && close != string::npos && close > i + 2 && close - i - 2 <= 4 &&
+                           all_of(text.begin() + i + 2, text.begin() + close, [](char d) { return isdigit((unsigned char)d); })) {
+                    group = stoi(text.substr(i + 2, close - i - 2));
+                    i = close;
+                }
+            }
+            if (group < 0) {
+                literal += text[i];
+                continue;
+            }
+            replacement.parts.push_back({literal, group});
+            replacement.highestGroup = max(replacement.highestGroup, group);
+            literal.clear();
+        }
+        if (!literal.empty()) replacement.parts.push_back({literal, -1});
+        return replacement;
+    }
+
+    // Write `line` with every match replaced into `out`; returns the number of matches
+    size_t replace(string_view line, const Replacement& replacement, string& out) {
+        out.clear();
+        size_t copied = 0, count = 0;
+        vector<size_t> slots;
+        forEachMatch(line, [&](size_t start, size_t end) {
+            if (replacement.highestGroup > 0) captures(line, start, end, slots);
+            out.append(line.data() + copied, start - copied);
+            for (const auto& part : replacement.parts) {
+                out += part.first;
+                if (part.second == 0) {
+                    out.append(line.data() + start, end - start);
+                } else if (part.second > 0 && 2 * (size_t)part.second < slots.size() &&
+                           slots[2 * part.second] != string_view::npos) {
+                    out.append(line.data() + slots[2 * part.second], slots[2 * part.second + 1] - slots[2 * part.second]);
+                }
+            }
+            copied = end;
+            count++;
+        });
+        if (count > 0) out.append(line.data() + copied, line.size() - copied);
+        return count;
+    }
+};
+
+// Optional inverted index: word -> total count and the lines it is on.
+// Postings hold stable line ids; the ids are kept in document order in a
+// treap with parent links, so inserting or deleting a line never
+// renumbers postings and an id is turned back into a line number in O(log n).
+class WordIndex {
+private:
+    struct IdNode {
+        IdNode* left = nullptr;
+        IdNode* right = nullptr;
+        IdNode* parent = nullptr;
+        unsigned priority;
+        size_t size = 1;
+        uint32_t id;
+    };
+
+    struct Entry {
+        size_t count = 0;
+        unordered_map<uint32_t, uint32_t> lines;  // line id -> occurrences on it
+    };
+
+    unordered_map<string, Entry> words;
+    vector<IdNode*> nodes;      // Indexed by line id, nullptr when free
+    vector<uint32_t> freeIds;
+    IdNode* root = nullptr;
+    unsigned seed = 88172645u;
+
+    static size_t sizeOf(IdNode* n) { return n ? n->size : 0; }
+
+    static void update(IdNode* n) {
+        n->size = sizeOf(n->left) + 1 + sizeOf(n->right);
+        if (n->left) n->left->parent = n;
+        if (n->right) n->right->parent = n;
+    }
+
+    static IdNode* merge(IdNode* a, IdNode* b) {
+        if (!a) return b;
+        if (!b) return a;
+        if (a->priority > b->priority) {
+            a->right = merge(a->right, b);
+            update(a);
+            return a;
+        }
+        b->left = merge(a, b->left);
+        update(b);
+        return b;
+    }
+
+    static void split(IdNode* n, size_t count, IdNode*& a, IdNode*& b) {
+        if (!n) {
+            a = b = nullptr;
+            return;
+        }
+        if (sizeOf(n->left) < count) {
+            split(n->right, count - sizeOf(n->left) - 1, n->right, b);
+            a = n;
+        } else {
+            split(n->left, count, a, n->left);
+            b = n;
+        }
+        update(n);
+    }
+
+    void setRoot(IdNode* n) {
+        root = n;
+        if (root) root->parent = nullptr;
+    }
+
+    IdNode* nodeAt(size_t position) const {
+        IdNode* n = root;
+        while (n) {
+            size_t leftSize = sizeOf(n->left);
+            if (position < leftSize) {
+                n = n->left;
+            } else if (position == leftSize) {
+                return n;
+            } else {
+                position -= leftSize + 1;
+                n = n->right;
+            }
+        }
+        return nullptr;
+    }
+
+    size_t positionOf(uint32_t id) const {
+        IdNode* n = nodes[id];
+        size_t position = sizeOf(n->left);
+        for (; n->parent; n = n->parent) {
+            if (n == n->parent->right) position += sizeOf(n->parent->left) + 1;
+        }
+        return position;
+    }
+
+    void addWords(uint32_t id, string_view line) {
+        forEachWord(line, [&](string_view word) {
+            Entry& entry = words[string(word)];
+            entry.count++;
+            entry.lines[id]++;
+        });
+    }
+
+    void removeWords(uint32_t id, string_view line) {
+        forEachWord(line, [&](string_view word) {
+            auto it = words.find(string(word));
+            if (it == words.end()) return;
+            auto onLine = it->second.lines.find(id);
+            if (onLine != it->second.lines.end() && --onLine->second == 0) it->second.lines.erase(onLine);
+            if (--it->second.count == 0) words.erase(it);
+        });
+    }
+
+public:
+    WordIndex() = default;
+    WordIndex(const WordIndex&) = delete;
+    WordIndex& operator=(const WordIndex&) = delete;
+    ~WordIndex() {
+        for (IdNode* n : nodes) delete n;
+    }
+
+    void insertLine(size_t position, string_view text) {
+        uint32_t id;
+        if (!freeIds.empty()) {
+            id = freeIds.back();
+            freeIds.pop_back();
+        } else {
+            id = (uint32_t)nodes.size();
+            nodes.push_back(nullptr);
+        }
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        IdNode* n = new IdNode;
+        n->priority = seed;
+        n->id = id;
+        nodes[id] = n;
+
+        IdNode *a, *b;
+        split(root, position, a, b);
+        setRoot(merge(merge(a, n), b));
+        addWords(id, text);
+    }
+
+    void eraseLine(size_t position, string_view text) {
+        IdNode *a, *b, *c;
+        split(root, position, a, b);
+        split(b, 1, b, c);
+        setRoot(merge(a, c));
+        removeWords(b->id, text);
+        nodes[b->id] = nullptr;
+        freeIds.push_back(b->id);
+        delete b;
+    }
+
+    void changeLine(size_t position, string_view oldText, string_view newText) {
+        uint32_t id = nodeAt(position)->id;
+        removeWords(id, oldText);
+        addWords(id, newText);
+    }
+
+    size_t count(const string& word) const {
+        auto it = words.find(word);
+        return it == words.end() ? 0 : it->second.count;
+    }
+
+    // Sorted line numbers (0-based) that contain `word`
+    vector<size_t> linesWith(const string& word) const {
+        vector<size_t> lines;
+        auto it = words.find(word);
+        if (it == words.end()) return lines;
+        for (const auto& posting : it->second.lines) lines.push_back(positionOf(posting.first));
+        sort(lines.begin(), lines.end());
+        return lines;
+    }
+};
+
+// One formatting step pushed by bold, italic or a case conversion
+struct FormatStep {
+    enum Kind : uint8_t { WRAP, LOWERCASE, UPPERCASE };
+    Kind kind;
+    string prefix, suffix;  // WRAP only
+};
+
+// Formatting applied lazily on top of the stored lines. Any stack of steps
+// folds into prefix + convert(line) + suffix: a wrap adds markers around
+// what came before, and a case change converts the markers added so far
+// and overrides any earlier case change.
+class FormatStack {
+private:
+    vector<FormatStep> stack;
+    string prefix, suffix;
+    FormatStep::Kind caseChange = FormatStep::WRAP;  // WRAP means "keep case"
+
+    void recompose() {
+        prefix.clear();
+        suffix.clear();
+        caseChange = FormatStep::WRAP;
+        for (const auto& step : stack) {
+            if (step.kind == FormatStep::WRAP) {
+                prefix.insert(0, step.prefix);
+                suffix += step.suffix;
+            } else {
+                bool upper = step.kind == FormatStep::UPPERCASE;
+                CaseKernel::convert(prefix.data(), &prefix[0], prefix.size(), upper);
+                CaseKernel::convert(suffix.data(), &suffix[0], suffix.size(), upper);
+                caseChange = step.kind;
+            }
+        }
+    }
+
+public:
+    bool empty() const { return stack.empty(); }
+    const vector<FormatStep>& steps() const { return stack; }
+    size_t prefixSize() const { return prefix.size(); }
+    size_t suffixSize() const { return suffix.size(); }
+
+    void push(const FormatStep& step) {
+        stack.push_back(step);
+        recompose();
+    }
+
+    void pop() {
+        stack.pop_back();
+        recompose();
+    }
+
+    void assign(const vector<FormatStep>& steps) {
+        stack = steps;
+        recompose();
+    }
+
+    void clear() { assign({}); }
+
+    // Append `line` as it looks with every step applied and return true,
+    // or return false (appending nothing) if the steps don't change it
+    bool apply(string_view line, string& out) const {
+        size_t start = out.size();
+        out.resize(start + prefix.size() + line.size() + suffix.size());
+        char* text = &out[start];
+        memcpy(text, prefix.data(), prefix.size());
+        bool changed = !prefix.empty() || !suffix.empty();
+        if (caseChange == FormatStep::WRAP) {
+            memcpy(text + prefix.size(), line.data(), line.size());
+        } else {
+            changed |= CaseKernel::convert(line.data(), text + prefix.size(), line.size(),
+                                           caseChange == FormatStep::UPPERCASE);
+        }
+        memcpy(text + prefix.size() + line.size(), suffix.data(), suffix.size());
+        if (!changed) out.resize(start);
+        return changed;
+    }
+};
+
+// One line-level change, stored as the delta needed to undo and redo it.
+// A changed line only keeps the bytes between its common prefix and suffix.
+struct LineDelta {
+    enum Kind : uint8_t { INSERT, ERASE, CHANGE };
+    Kind kind;
+    size_t line;
+    size_t offset = 0;  // CHANGE: start of the changed span
+    string removed;     // ERASE: whole line; CHANGE: old span
+    string inserted;    // INSERT: whole line; CHANGE: new span
+
+    LineDelta(Kind kind, size_t line, size_t offset = 0) : kind(kind), line(line), offset(offset) {}
+
+    static LineDelta insert(size_t line, string_view text) {
+        LineDelta delta(INSERT, line);
+        delta.inserted = string(text);
+        return delta;
+    }
+
+    static LineDelta erase(size_t line, string_view text) {
+        LineDelta delta(ERASE, line);
+        delta.removed = string(text);
+        return delta;
+    }
+
+    static LineDelta change(size_t line, string_view before, string_view after) {
+        size_t shorter = min(before.size(), after.size());
+        size_t prefix = 0;
+        while (prefix < shorter && before[prefix] == after[prefix]) prefix++;
+        size_t suffix = 0;
+        while (suffix < shorter - prefix &&
+               before[before.size() - 1 - suffix] == after[after.size() - 1 - suffix]) suffix++;
+        LineDelta delta(CHANGE, line, prefix);
+        delta.removed = string(before.substr(prefix, before.size() - prefix - suffix));
+        delta.inserted = string(after.substr(prefix, after.size() - prefix - suffix));
+        return delta;
+    }
+};
+
+// One undo step: line edits (LINES), pushing a formatting step (FORMAT),
+// or writing the formatting stack into the stored lines (MATERIALIZE).
+// MATERIALIZE keeps the steps it folded and, for lines whose case changed,
+// only the old bytes: undo strips the markers and restores those bytes,
+// and redo simply applies the steps again.
+struct EditCommand {
+    enum Kind : uint8_t { LINES, FORMAT, MATERIALIZE };
+    Kind kind = LINES;
+    string name;
+    vector<LineDelta> deltas;
+    vector<FormatStep> steps;
+    chrono::steady_clock::time_point at;
+
+    size_t bytes() const {
+        size_t total = sizeof(EditCommand) + name.size();
+        for (const auto& delta : deltas) total += sizeof(LineDelta) + delta.removed.size() + delta.inserted.size();
+        for (const auto& step : steps) total += sizeof(FormatStep) + step.prefix.size() + step.suffix.size();
+        return total;
+    }
+};
+
+// Undo/redo history kept in a ring buffer. Slots [0, current) can be
+// undone and [current, count) redone. The oldest commands are dropped
+// once the ring is full or the history grows past its memory limit, and
+// quick runs of the same small edit on one line or the next (typing,
+// adding lines one after another) are coalesced into one step.
+class EditJournal {
+private:
+    static constexpr chrono::milliseconds COALESCE_WINDOW{1000};
+    static const size_t COALESCE_MAX_DELTAS = 256;
+
+    vector<EditCommand> ring;
+    vector<size_t> sizes;   // bytes() of each slot, so eviction is cheap
+    size_t first = 0;       // Ring position of the oldest command
+    size_t count = 0;
+    size_t current = 0;
+    size_t bytes = 0;
+    size_t limit;
+    bool coalescing = true;
+
+    size_t slot(size_t i) const { return (first + i) % ring.size(); }
+
+    void dropOldest() {
+        bytes -= sizes[first];
+        ring[first] = EditCommand();
+        first = (first + 1) % ring.size();
+        count--;
+        if (current > 0) current--;
+    }
+
+    void dropNewest() {
+        size_t last = slot(count - 1);
+        bytes -= sizes[last];
+        ring[last] = EditCommand();
+        count--;
+    }
+
+public:
+    explicit EditJournal(size_t capacity = 4096, size_t memoryLimit = 64u << 20)
+        : ring(max<size_t>(1, capacity)), sizes(ring.size(), 0), limit(memoryLimit) {}
+
+    void record(EditCommand command) {
+        while (count > current) dropNewest();  // A new edit forgets the redo history
+
+        // Merge with the previous step when it is the same small edit made just before
+        if (coalescing && current > 0 && command.kind == EditCommand::LINES && command.deltas.size() == 1) {
+            size_t last = slot(current - 1);
+            EditCommand& previous = ring[last];
+            size_t line = command.deltas[0].line;
+            bool adjacent = !previous.deltas.empty() && line + 1 >= previous.deltas.back().line &&
+                            line <= previous.deltas.back().line + 1;
+            if (previous.kind == EditCommand::LINES && previous.name == command.name && adjacent &&
+                command.at - previous.at < COALESCE_WINDOW && previous.deltas.size() < COALESCE_MAX_DELTAS) {
+                previous.deltas.push_back(move(command.deltas[0]));
+                previous.at = command.at;
+                bytes -= sizes[last];
+                sizes[last] = previous.bytes();
+                bytes += sizes[last];
+                return;
+            }
+        }
+
+        if (count == ring.size()) dropOldest();
+        size_t next = slot(count);
+        sizes[next] = command.bytes();
+        bytes += sizes[next];
+        ring[next] = move(command);
+        count++;
+        current = count;
+        while (count > 1 && bytes > limit) dropOldest();
+    }
+
+    // Command to undo next, or nullptr
+    const EditCommand* undo() {
+        if (current == 0) return nullptr;
+        return &ring[slot(--current)];
+    }
+
+    // Command to redo next, or nullptr
+    const EditCommand* redo() {
+        if (current == count) return nullptr;
+        return &ring[slot(current++)];
+    }
+
+    void clear() {
+        while (count > 0) dropNewest();
+        first = current = 0;
+    }
+
+    // Off when every command is a step of its own, as in a script
+    void setCoalescing(bool on) { coalescing = on; }
+
+    // A lower limit first forgets the redo history: evicting from the
+    // front with no undo steps left would drop commands that are still to
+    // be redone, and the later ones would then replay onto the wrong state
+    void setMemoryLimit(size_t memoryLimit) {
+        limit = memoryLimit;
+        if (bytes <= limit) return;
+        while (count > current) dropNewest();
+        while (count > 1 && bytes > limit) dropOldest();
+    }
+
+    size_t memoryUsed() const { return bytes; }
+    size_t undoSteps() const { return current; }
+    size_t redoSteps() const { return count - current; }
+};
+
+// Log-linear latency histogram in the style of HdrHistogram: values are
+// grouped by power of two and then into 16 linear steps, so every bucket
+// is within about 6% of the values it holds.
+class LatencyHistogram {
+private:
+    static const int SUB_BITS = 4;
+    static const size_t SUB_COUNT = 1 << SUB_BITS;
+
+    array<uint64_t, 64 * SUB_COUNT> counts{};
+    uint64_t total = 0;
+    uint64_t largest = 0;
+    double sum = 0;
+
+    static int highestBit(uint64_t value) {
+#if defined(_MSC_VER) && !defined(__clang__)
+        unsigned long bit;
+        _BitScanReverse64(&bit, value);
+        return (int)bit;
+#else
+        return 63 - __builtin_clzll(value);
+#endif
+    }
+
+    static size_t bucketOf(uint64_t value) {
+        if (value < SUB_COUNT) return (size_t)value;
+        int shift = highestBit(value) - SUB_BITS;
+        return SUB_COUNT + shift * SUB_COUNT + ((value >> shift) & (SUB_COUNT - 1));
+    }
+
+    // Largest value that lands in `bucket`
+    static uint64_t upperBound(size_t bucket) {
+        if (bucket < SUB_COUNT) return bucket;
+        size_t shift = (bucket - SUB_COUNT) / SUB_COUNT;
+        uint64_t low = (SUB_COUNT + (bucket % SUB_COUNT)) << shift;
+        return low + ((uint64_t)1 << shift) - 1;
+    }
+
+public:
+    void record(uint64_t value) {
+        counts[bucketOf(value)]++;
+        total++;
+        sum += (double)value;
+        largest = max(largest, value);
+    }
+
+    // Add the values recorded by another histogram, e.g. another thread's
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < counts.size(); i++) counts[i] += other.counts[i];
+        total += other.total;
+        sum += other.sum;
+        largest = max(largest, other.largest);
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t maximum() const { return largest; }
+    double mean() const { return total ? sum / total : 0; }
+
+    // Value at the given percentile (0-100)
+    uint64_t percentile(double p) const {
+        if (total == 0) return 0;
+        uint64_t rank = (uint64_t)ceil(p / 100.0 * total);
+        uint64_t seen = 0;
+        for (size_t bucket = 0; bucket < counts.size(); bucket++) {
+            seen += counts[bucket];
+            if (seen >= max<uint64_t>(rank, 1)) return min(upperBound(bucket), largest);
+        }
+        return largest;
+    }
+};
+
+// Calls, bytes touched and latency of one editor operation
+struct OperationStats {
+    string name;
+    uint64_t calls = 0;
+    uint64_t bytes = 0;
+    LatencyHistogram latencyNs;
+};
+
+// Process-wide operation statistics. Each thread records into a shard of
+// its own, so editors on different threads never wait for each other; a
+// shard's lock is only contended while a report merges the shards.
+class EditorStats {
+private:
+    struct Shard {
+        mutex lock;
+        vector<OperationStats> operations;  // By operation id
+    };
+
+    mutable mutex lock;                // Guards names and shards
+    vector<string> names;              // By operation id
+    vector<shared_ptr<Shard>> shards;  // Kept after their thread ends, so nothing recorded is lost
+
+    Shard& local() {
+        thread_local shared_ptr<Shard> shard;
+        if (!shard) {
+            shard = make_shared<Shard>();
+            lock_guard<mutex> guard(lock);
+            shards.push_back(shard);
+        }
+        return *shard;
+    }
+
+    // The caller holds the shard's lock
+    static OperationStats& slot(Shard& shard, size_t id) {
+        if (id >= shard.operations.size()) shard.operations.resize(id + 1);
+        return shard.operations[id];
+    }
+
+public:
+    static EditorStats& instance() {
+        static EditorStats stats;
+        return stats;
+    }
+
+    // Id of the operation called `name`; call sites look it up once
+    size_t operation(const string& name) {
+        lock_guard<mutex> guard(lock);
+        auto found = find(names.begin(), names.end(), name);
+        if (found != names.end()) return found - names.begin();
+        names.push_back(name);
+        return names.size() - 1;
+    }
+
+    void addCall(size_t id, size_t bytes, uint64_t ns) {
+        Shard& shard = local();
+        lock_guard<mutex> guard(shard.lock);
+        OperationStats& op = slot(shard, id);
+        op.calls++;
+        op.bytes += bytes;
+        op.latencyNs.record(ns);
+    }
+
+    // Every operation's statistics, summed over the threads
+    vector<OperationStats> all() const {
+        lock_guard<mutex> guard(lock);
+        vector<OperationStats> total(names.size());
+        for (size_t id = 0; id < names.size(); id++) total[id].name = names[id];
+        for (const auto& shard : shards) {
+            lock_guard<mutex> shardGuard(shard->lock);
+            for (size_t id = 0; id < shard->operations.size(); id++) {
+                const OperationStats& op = shard->operations[id];
+                total[id].calls += op.calls;
+                total[id].bytes += op.bytes;
+                total[id].latencyNs.merge(op.latencyNs);
+            }
+        }
+        return total;
+    }
+};
+
+// Times one call and adds it to its operation's statistics. Only the
+// outermost timed call of a thread is recorded, so an operation built on
+// another (replaceWord runs replaceWords) counts once, as itself.
+class OperationTimer {
+private:
+    size_t id;
+    size_t bytes;
+    bool outermost;
+    chrono::steady_clock::time_point start;
+
+    static int& depth() {
+        thread_local int nested = 0;
+        return nested;
+    }
+
+public:
+    OperationTimer(size_t id, size_t bytes)
+        : id(id), bytes(bytes), outermost(depth()++ == 0), start(chrono::steady_clock::now()) {}
+    ~OperationTimer() {
+        depth()--;
+        if (!outermost) return;
+        auto elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start);
+        EditorStats::instance().addCall(id, bytes, (uint64_t)elapsed.count());
+    }
+
+    void addBytes(size_t count) { bytes += count; }
+};
+
+// Compile with -DTEXT_EDITOR_NO_STATS to remove the instrumentation entirely
+#ifndef TEXT_EDITOR_NO_STATS
+#define EDITOR_STAT(name, bytes) \
+    static const size_t operationId_ = EditorStats::instance().operation(name); \
+    OperationTimer operationTimer_(operationId_, (bytes))
+// Add bytes touched that were only known after EDITOR_STAT
+#define EDITOR_STAT_BYTES(count) (operationTimer_.addBytes(count))
+#else
+#define EDITOR_STAT(name, bytes) ((void)0)
+#define EDITOR_STAT_BYTES(count) ((void)0)
+#endif
+
+// Set by SIGUSR1; the editor writes its statistics at the next safe point
+volatile sig_atomic_t statsDumpRequested = 0;
+
+void requestStatsDump(int) {
+    statsDumpRequested = 1;
+}
+
+// Raw terminal for the document viewer: window size, unbuffered key reads
+// and frames written with a single write(). Switches to the alternate
+// screen while it exists, so the menu comes back untouched afterwards.
+class Terminal {
+private:
+#if defined(_WIN32) || defined(_WIN64)
+    HANDLE output = GetStdHandle(STD_OUTPUT_HANDLE);
+#else
+    termios saved;
+    bool restore = false;
+#endif
+
+public:
+    enum Key { KEY_UP = 1000, KEY_DOWN, KEY_PAGE_UP, KEY_PAGE_DOWN, KEY_HOME, KEY_END, KEY_EOF };
+
+    // True when both stdin and stdout are a terminal
+    static bool interactive() {
+#if defined(_WIN32) || defined(_WIN64)
+        return _isatty(_fileno(stdin)) && _isatty(_fileno(stdout));
+#else
+        return isatty(STDIN_FILENO) && isatty(STDOUT_FILENO);
+#endif
+    }
+
+    Terminal() {
+        cout.flush();
+#if !defined(_WIN32) && !defined(_WIN64)
+        if (tcgetattr(STDIN_FILENO, &saved) == 0) {
+            termios raw = saved;
+            raw.c_lflag &= ~(ICANON | ECHO);
+            raw.c_cc[VMIN] = 1;
+            raw.c_cc[VTIME] = 0;
+            restore = tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == 0;
+        }
+#endif
+        write("\033[?1049h\033[?25l\033[2J");
+    }
+
+    ~Terminal() {
+        write("\033[0m\033[?25h\033[?1049l");
+#if !defined(_WIN32) && !defined(_WIN64)
+        if (restore) tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved);
+#endif
+    }
+
+    Terminal(const Terminal&) = delete;
+    Terminal& operator=(const Terminal&) = delete;
+
+    // Window size in character cells (24x80 if it can't be read)
+    void size(int& rows, int& cols) const {
+        rows = 24;
+        cols = 80;
+#if defined(_WIN32) || defined(_WIN64)
+        CONSOLE_SCREEN_BUFFER_INFO info;
+        if (GetConsoleScreenBufferInfo(output, &info)) {
+            rows = info.srWindow.Bottom - info.srWindow.Top + 1;
+            cols = info.srWindow.Right - info.srWindow.Left + 1;
+        }
+#else
+        winsize window;
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &window) == 0 && window.ws_row > 0 && window.ws_col > 0) {
+            rows = window.ws_row;
+            cols = window.ws_col;
+        }
+#endif
+    }
+
+    void write(const string& bytes) {
+#if defined(_WIN32) || defined(_WIN64)
+        DWORD written;
+        WriteConsoleA(output, bytes.data(), (DWORD)bytes.size(), &written, nullptr);
+#else
+        size_t done = 0;
+        while (done < bytes.size()) {
+            ssize_t n = ::write(STDOUT_FILENO, bytes.data() + done, bytes.size() - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            done += n;
+        }
+#endif
+    }
+
+    // Next key: a character, or one of the Key codes for arrows and paging.
+    // With a timeout, 0 when no key came within `timeoutMs` milliseconds.
+    int readKey(int timeoutMs = -1) {
+#if defined(_WIN32) || defined(_WIN64)
+        for (int waited = 0; timeoutMs >= 0 && !_kbhit(); waited += 10) {
+            if (waited >= timeoutMs) return 0;
+            Sleep(10);
+        }
+        int c = _getch();
+        if (c != 0 && c != 224) return c;
+        switch (_getch()) {
+            case 72: return KEY_UP;
+            case 80: return KEY_DOWN;
+            case 73: return KEY_PAGE_UP;
+            case 81: return KEY_PAGE_DOWN;
+            case 71: return KEY_HOME;
+            case 79: return KEY_END;
+            default: return 0;
+        }
+#else
+        pollfd input = {STDIN_FILENO, POLLIN, 0};
+        if (timeoutMs >= 0 && poll(&input, 1, timeoutMs) == 0) return 0;
+        unsigned char c;
+        if (read(STDIN_FILENO, &c, 1) != 1) return KEY_EOF;
+        if (c != 27) return c;
+
+        // Escape sequences arrive in one burst; a lone Esc does not
+        string sequence;
+        while (sequence.size() < 8 && poll(&input, 1, 30) == 1 && read(STDIN_FILENO, &c, 1) == 1) {
+            sequence += (char)c;
+            if (sequence.size() > 1 && (isalpha(c) || c == '~')) break;
+        }
+        if (sequence == "[A" || sequence == "OA") return KEY_UP;
+        if (sequence == "[B" || sequence == "OB") return KEY_DOWN;
+        if (sequence == "[5~") return KEY_PAGE_UP;
+        if (sequence == "[6~") return KEY_PAGE_DOWN;
+        if (sequence == "[H" || sequence == "OH" || sequence == "[1~") return KEY_HOME;
+        if (sequence == "[F" || sequence == "OF" || sequence == "[4~") return KEY_END;
+        return 27;
+#endif
+    }
+};
+
+// Scrollable view of the document. Each frame fetches only the lines that
+// fit on screen and repaints only the rows that differ from the last frame,
+// all in one buffered write. While the document is still loading, the
+// status line shows the progress and the frame is redrawn as lines arrive.
+class DocumentViewer {
+public:
+    // fetch(from, to, f) calls f(index, text) for the lines in [from, to)
+    typedef function<void(size_t, size_t, const function<void(size_t, string_view)>&)> Fetch;
+    // count(wanted) is the number of lines, once there are at least
+    // `wanted` or the document is fully loaded
+    typedef function<size_t(size_t)> Count;
+    // Load progress for the status line; empty once the document is loaded
+    typedef function<string()> Progress;
+
+private:
+    Terminal& terminal;
+    size_t lineCount = 0;
+    Count count;
+    Fetch fetch;
+    Progress progress;
+    function<void()> stop;  // Stops the load ('x')
+    string loading;         // Progress shown in the last frame
+    size_t top = 0;
+    int rows = 0, cols = 0;
+    vector<string> shown;   // Rows currently on screen
+    string input;           // Digits typed after ':'
+    bool jumping = false;
+
+    size_t pageSize() const { return (size_t)max(1, rows - 1); }
+
+    size_t lastTop() const { return lineCount > pageSize() ? lineCount - pageSize() : 0; }
+
+    // Append `text` cut to `width` columns: tabs are expanded, other
+    // control bytes shown as '?', and UTF-8 sequences never split
+    static void appendClipped(string& row, string_view text, int width) {
+        int column = 0;
+        for (size_t i = 0; i < text.size(); i++) {
+            unsigned char c = text[i];
+            if ((c & 0xC0) == 0x80) {   // Continuation byte of the previous character
+                row += (char)c;
+                continue;
+            }
+            if (c == '\t') {
+                int stop = min(width, (column / 8 + 1) * 8);
+                row.append(stop - column, ' ');
+                column = stop;
+            } else {
+                if (column >= width) break;
+                row += c < 32 || c == 127 ? '?' : (char)c;
+                column++;
+            }
+            if (column >= width) {
+                while (i + 1 < text.size() && ((unsigned char)text[i + 1] & 0xC0) == 0x80) row += text[++i];
+                break;
+            }
+        }
+    }
+
+    void render() {
+        int newRows, newCols;
+        terminal.size(newRows, newCols);
+        string frame;
+        if (newRows != rows || newCols != cols) {
+            rows = newRows;
+            cols = newCols;
+            shown.assign(rows, string());
+            frame += "\033[2J";
+        }
+        loading = progress ? progress() : string();
+        lineCount = count(top + pageSize());  // Waits only for the lines of this page
+        top = min(top, lastTop());
+
+        vector<string> next(rows);
+        size_t last = min(lineCount, top + pageSize());
+        int numberWidth = (int)to_string(max<size_t>(1, lineCount)).size();
+        fetch(top, last, [&](size_t index, string_view line) {
+            string& row = next[index - top];
+            string number = to_string(index + 1);
+            row.assign(numberWidth - number.size(), ' ');
+            row += "\033[36m" + number + "\033[0m ";
+            appendClipped(row, line, max(0, cols - numberWidth - 1));
+        });
+        for (size_t r = last - top; r < pageSize(); r++) next[r] = "\033[34m~\033[0m";
+
+        string status = jumping ? " Go to line: " + input
+                                : " Lines " + to_string(lineCount ? top + 1 : 0) + "-" + to_string(last) + " of " +
+                                      to_string(lineCount) + (loading.empty() ? "" : "+ (" + loading + ", x stops)") +
+                                      "   Up/Down j/k  PgUp/PgDn b/space  Home/End g/G  :N jump  q quit";
+        next[rows - 1] = "\033[7m";
+        appendClipped(next[rows - 1], status, cols);
+        next[rows - 1] += "\033[0m";
+
+        for (int r = 0; r < rows; r++) {
+            if (next[r] == shown[r]) continue;
+            frame += "\033[" + to_string(r + 1) + ";1H" + next[r] + "\033[K";
+            shown[r] = move(next[r]);
+        }
+        if (!frame.empty()) terminal.write(frame);
+    }
+
+    // Handle a key typed while entering a line number
+    void jumpKey(int key) {
+        if (isdigit(key) && input.size() < 19) {
+            input += (char)key;
+        } else if ((key == 127 || key == 8) && !input.empty()) {
+            input.pop_back();
+        } else if (key == '\n' || key == '\r') {
+            if (!input.empty()) top = (size_t)max(1ULL, stoull(input)) - 1;
+            jumping = false;
+        } else if (key == 27 || key == 'q') {
+            jumping = false;
+        }
+    }
+
+public:
+    DocumentViewer(Terminal& terminal, Count count, Fetch fetch, Progress progress = nullptr,
+                   function<void()> stop = nullptr)
+        : terminal(terminal), count(move(count)), fetch(move(fetch)), progress(move(progress)), stop(move(stop)) {}
+
+    // Show the viewport and page through it until 'q'
+    void run() {
+        while (true) {
+            render();
+            int key = terminal.readKey(loading.empty() ? -1 : 200);  // Redraw as the document loads
+            if (key == 0) continue;
+            if (key == Terminal::KEY_EOF) return;
+            if (jumping) {
+                jumpKey(key);
+                continue;
+            }
+            switch (key) {
+                case 'q': case 'Q': case 27: return;
+                case 'x': case 'X':
+                    if (stop && !loading.empty()) stop();
+                    break;
+                case 'j': case Terminal::KEY_DOWN: case '\n': case '\r': top++; break;
+                case 'k': case Terminal::KEY_UP: top = top > 0 ? top - 1 : 0; break;
+                case ' ': case 'f': case Terminal::KEY_PAGE_DOWN: top += pageSize(); break;
+                case 'b': case Terminal::KEY_PAGE_UP: top = top > pageSize() ? top - pageSize() : 0; break;
+                case 'g': case Terminal::KEY_HOME: top = 0; break;
+                case 'G': case Terminal::KEY_END: top = lastTop(); break;
+                case ':':
+                    jumping = true;
+                    input.clear();
+                    break;
+            }
+        }
+    }
+};
+
+// Write-ahead log of edits, kept next to the document as <file>.journal so
+// unsaved work survives a crash. Every change is appended as a small binary
+// record. A background thread writes and fsyncs whatever has piled up, so
+// one fsync covers all the records that arrived while the previous one ran
+// (group commit) and the editing loop never waits for the disk. Saving the
+// document is the checkpoint: the log then restarts from the new file, so
+// only a save rewrites the whole document.
+//
+// Layout: "EDJ1", then the size and modification time of the file the log
+// applies to (8 bytes each), then records of [payload length u32]
+// [CRC-32 of payload u32][payload]. A payload is a type byte followed by
+// LEB128 numbers and length-prefixed bytes. Replay stops at the first torn
+// or corrupt record.
+class WriteAheadLog {
+public:
+    enum Type : uint8_t { INSERT = 1, ERASE, CHANGE, PUSH_FORMAT, POP_FORMAT, SET_FORMAT, APPLY_FORMAT, STRIP_FORMAT };
+
+    // One decoded record. CHANGE replaces `length` bytes at `offset` of the
+    // line with `text`; STRIP_FORMAT cuts `offset` bytes from the start and
+    // `length` from the end of every line.
+    struct Record {
+        Type type = INSERT;
+        size_t line = 0;
+        size_t offset = 0;
+        size_t length = 0;
+        string_view text;
+        vector<FormatStep> steps;
+    };
+
+    enum ReplayResult { NO_LOG, REPLAYED, STALE };
+
+private:
+    static const size_t HEADER_SIZE = 20;
+
+    string path;
+    FILE* file = nullptr;
+    mutex fileLock;             // Held while the file is written or replaced
+    mutex lock;                 // Guards the fields below
+    condition_variable wake;
+    condition_variable synced;
+    string pending;             // Records not yet written
+    uint64_t appended = 0;      // Record bytes handed to append() (plus those replayed)
+    uint64_t durable = 0;       // How many of them are known to be on disk
+    uint64_t fileStart = 0;     // Where the records in the file start in that count
+    uint64_t syncs = 0;
+    bool failed = false;
+    bool stopping = false;
+    thread flusher;
+
+    static uint32_t crc32(const char* bytes, size_t count) {
+        static const array<uint32_t, 256> table = [] {
+            array<uint32_t, 256> t{};
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                t[i] = c;
+            }
+            return t;
+        }();
+        uint32_t c = 0xFFFFFFFFu;
+        for (size_t i = 0; i < count; i++) c = table[(c ^ (uint8_t)bytes[i]) & 0xFF] ^ (c >> 8);
+        return c ^ 0xFFFFFFFFu;
+    }
+
+    static void putNumber(string& out, uint64_t value) {
+        while (value >= 0x80) {
+            out += (char)(value | 0x80);
+            value >>= 7;
+        }
+        out += (char)value;
+    }
+
+    static void putBytes(string& out, string_view bytes) {
+        putNumber(out, bytes.size());
+        out.append(bytes.data(), bytes.size());
+    }
+
+    static void putSteps(string& out, const vector<FormatStep>& steps) {
+        putNumber(out, steps.size());
+        for (const auto& step : steps) {
+            out += (char)step.kind;
+            putBytes(out, step.prefix);
+            putBytes(out, step.suffix);
+        }
+    }
+
+    static bool getNumber(string_view& in, size_t& value) {
+        value = 0;
+        for (int shift = 0; shift < 64 && !in.empty(); shift += 7) {
+            uint8_t byte = (uint8_t)in[0];
+            in.remove_prefix(1);
+            value |= (size_t)(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) return true;
+        }
+        return false;
+    }
+
+    static bool getBytes(string_view& in, string_view& bytes) {
+        size_t size;
+        if (!getNumber(in, size) || size > in.size()) return false;
+        bytes = in.substr(0, size);
+        in.remove_prefix(size);
+        return true;
+    }
+
+    static bool getSteps(string_view& in, vector<FormatStep>& steps) {
+        size_t count;
+        if (!getNumber(in, count) || count > in.size()) return false;
+        for (size_t i = 0; i < count; i++) {
+            string_view prefix, suffix;
+            if (in.empty() || (uint8_t)in[0] > FormatStep::UPPERCASE) return false;
+            FormatStep::Kind kind = (FormatStep::Kind)in[0];
+            in.remove_prefix(1);
+            if (!getBytes(in, prefix) || !getBytes(in, suffix)) return false;
+            steps.push_back({kind, string(prefix), string(suffix)});
+        }
+        return true;
+    }
+
+    // Reserve the frame of a record; finish() fills in its length and CRC
+    static size_t begin(string& out, Type type) {
+        size_t start = out.size();
+        out.append(8, '\0');
+        out += (char)type;
+        return start;
+    }
+
+    static void finish(string& out, size_t start) {
+        uint32_t length = (uint32_t)(out.size() - start - 8);
+        uint32_t crc = crc32(out.data() + start + 8, length);
+        memcpy(&out[start], &length, 4);
+        memcpy(&out[start + 4], &crc, 4);
+    }
+
+    static bool parse(string_view payload, Record& record) {
+        record = Record();
+        record.type = (Type)payload[0];
+        payload.remove_prefix(1);
+        switch (record.type) {
+            case INSERT:
+                return getNumber(payload, record.line) && getBytes(payload, record.text);
+            case ERASE:
+                return getNumber(payload, record.line);
+            case CHANGE:
+                return getNumber(payload, record.line) && getNumber(payload, record.offset) &&
+                       getNumber(payload, record.length) && getBytes(payload, record.text);
+            case PUSH_FORMAT:
+            case SET_FORMAT:
+                return getSteps(payload, record.steps) && (record.type == SET_FORMAT || record.steps.size() == 1);
+            case POP_FORMAT:
+            case APPLY_FORMAT:
+                return true;
+            case STRIP_FORMAT:
+                return getNumber(payload, record.offset) && getNumber(payload, record.length);
+        }
+        return false;
+    }
+
+    // Size and modification time of the document, which the header pins
+    static string header(const string& document) {
+        error_code error;
+        uint64_t identity[2] = {(uint64_t)filesystem::file_size(document, error), 0};
+        if (error) identity[0] = 0;
+        auto modified = filesystem::last_write_time(document, error);
+        if (!error) identity[1] = (uint64_t)modified.time_since_epoch().count();
+        string bytes("EDJ1", 4);
+        bytes.append(reinterpret_cast<const char*>(identity), sizeof identity);
+        return bytes;
+    }
+
+    static void syncFile(FILE* f) {
+#if defined(_WIN32) || defined(_WIN64)
+        _commit(_fileno(f));
+#else
+        fsync(fileno(f));
+#endif
+    }
+
+    // Write out everything pending; fileLock must be held
+    void writePending() {
+        string batch;
+        uint64_t end;
+        {
+            lock_guard<mutex> guard(lock);
+            batch.swap(pending);
+            end = appended;
+        }
+        if (batch.empty()) return;
+        bool ok = fwrite(batch.data(), 1, batch.size(), file) == batch.size() && fflush(file) == 0;
+        if (ok) syncFile(file);
+        lock_guard<mutex> guard(lock);
+        failed |= !ok;
+        if (ok) durable = end;
+        syncs++;
+        synced.notify_all();
+    }
+
+    void flush() {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            wake.wait(guard, [this] { return stopping || !pending.empty(); });
+            if (pending.empty()) return;
+            guard.unlock();
+            {
+                lock_guard<mutex> writeGuard(fileLock);
+                writePending();
+            }
+            guard.lock();
+        }
+    }
+
+    WriteAheadLog(const string& path, FILE* file, uint64_t existing)
+        : path(path), file(file), appended(existing), durable(existing) {
+        flusher = thread([this] { flush(); });
+    }
+
+public:
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    // Everything appended is on disk before the log closes
+    ~WriteAheadLog() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_one();
+        flusher.join();
+        fclose(file);
+    }
+
+    static string pathFor(const string& document) { return document + ".journal"; }
+
+    // True when the log of `document` holds records past its header
+    static bool hasRecords(const string& document) {
+        error_code error;
+        uintmax_t size = filesystem::file_size(pathFor(document), error);
+        return !error && size > HEADER_SIZE;
+    }
+
+    // Start logging edits of `document`. The first `keep` record bytes of an
+    // existing log (the ones replay accepted) are kept and the rest is cut;
+    // with keep == 0 a fresh log is written. Returns nullptr on failure.
+    static shared_ptr<WriteAheadLog> open(const string& document, uint64_t keep = 0) {
+        string path = pathFor(document);
+        if (keep == 0) {
+            AtomicFileWriter fresh(path);
+            fresh.write(header(document));
+            if (!fresh.isOpen() || !fresh.commit()) return nullptr;
+        } else {
+            error_code error;
+            filesystem::resize_file(path, HEADER_SIZE + keep, error);
+            if (error) return nullptr;
+        }
+        FILE* file = fopen(path.c_str(), "ab");
+        if (!file) return nullptr;
+        return shared_ptr<WriteAheadLog>(new WriteAheadLog(path, file, keep));
+    }
+
+    // Calls apply(record) for every intact record in the log of `document`,
+    // stopping early when it returns false. `bytes` is set to the size of
+    // the records that were applied. A log written for another version of
+    // the file is STALE and left alone.
+    template <class F>
+    static ReplayResult replay(const string& document, F apply, uint64_t& bytes, size_t& records) {
+        bytes = 0;
+        records = 0;
+        shared_ptr<MappedText> log = MappedText::open(pathFor(document));
+        if (!log || log->size() < HEADER_SIZE) return NO_LOG;
+        if (string_view(log->data(), HEADER_SIZE) != header(document)) return STALE;
+        string_view rest(log->data() + HEADER_SIZE, log->size() - HEADER_SIZE);
+        Record record;
+        while (rest.size() >= 9) {
+            uint32_t length, crc;
+            memcpy(&length, rest.data(), 4);
+            memcpy(&crc, rest.data() + 4, 4);
+            if (length == 0 || length > rest.size() - 8) break;
+            string_view payload = rest.substr(8, length);
+            if (crc32(payload.data(), length) != crc || !parse(payload, record) || !apply(record)) break;
+            rest.remove_prefix(8 + length);
+            bytes += 8 + length;
+            records++;
+        }
+        return REPLAYED;
+    }
+
+    // Encoders: each appends one record to `out`
+    static void insert(string& out, size_t line, string_view text) {
+        size_t start = begin(out, INSERT);
+        putNumber(out, line);
+        putBytes(out, text);
+        finish(out, start);
+    }
+
+    static void erase(string& out, size_t line) {
+        size_t start = begin(out, ERASE);
+        putNumber(out, line);
+        finish(out, start);
+    }
+
+    // Only the bytes between the common prefix and suffix are stored
+    static void change(string& out, size_t line, string_view before, string_view after) {
+        size_t shorter = min(before.size(), after.size());
+        size_t prefix = 0;
+        while (prefix < shorter && before[prefix] == after[prefix]) prefix++;
+        size_t suffix = 0;
+        while (suffix < shorter - prefix && before[before.size() - 1 - suffix] == after[after.size() - 1 - suffix]) {
+            suffix++;
+        }
+        size_t start = begin(out, CHANGE);
+        putNumber(out, line);
+        putNumber(out, prefix);
+        putNumber(out, before.size() - prefix - suffix);
+        putBytes(out, after.substr(prefix, after.size() - prefix - suffix));
+        finish(out, start);
+    }
+
+    static void pushFormat(string& out, const FormatStep& step) {
+        size_t start = begin(out, PUSH_FORMAT);
+        putSteps(out, {step});
+        finish(out, start);
+    }
+
+    static void setFormat(string& out, const vector<FormatStep>& steps) {
+        size_t start = begin(out, SET_FORMAT);
+        putSteps(out, steps);
+        finish(out, start);
+    }
+
+    static void stripFormat(string& out, size_t prefix, size_t suffix) {
+        size_t start = begin(out, STRIP_FORMAT);
+        putNumber(out, prefix);
+        putNumber(out, suffix);
+        finish(out, start);
+    }
+
+    static void popFormat(string& out) { finish(out, begin(out, POP_FORMAT)); }
+    static void applyFormat(string& out) { finish(out, begin(out, APPLY_FORMAT)); }
+
+    // Queue encoded records for the flusher thread; never blocks on I/O
+    void append(string_view records) {
+        {
+            lock_guard<mutex> guard(lock);
+            pending.append(records.data(), records.size());
+            appended += records.size();
+        }
+        wake.notify_one();
+    }
+
+    // Position after the last record appended so far, for checkpoint()
+    uint64_t mark() {
+        lock_guard<mutex> guard(lock);
+        return appended;
+    }
+
+    // Wait until every record appended so far is on disk
+    bool sync() {
+        unique_lock<mutex> guard(lock);
+        uint64_t target = appended;
+        synced.wait(guard, [&] { return durable >= target || failed; });
+        return !failed;
+    }
+
+    // `document` was just saved with every record before `mark` in it:
+    // rewrite the log as a header for the new file plus the records after
+    // `mark`. The log follows the document when it was saved under a new name.
+    bool checkpoint(uint64_t mark, const string& document) {
+        lock_guard<mutex> writeGuard(fileLock);
+        writePending();
+        mark = max(mark, fileStart);
+        string tail;
+        {
+            ifstream old(path, ios::binary);
+            old.seekg((streamoff)(HEADER_SIZE + (mark - fileStart)));
+            tail.assign(istreambuf_iterator<char>(old), istreambuf_iterator<char>());
+        }
+        string target = pathFor(document);
+        AtomicFileWriter fresh(target);
+        fresh.write(header(document));
+        fresh.write(tail);
+        FILE* reopened = fresh.isOpen() && fresh.commit() ? fopen(target.c_str(), "ab") : nullptr;
+        if (!reopened) {
+            lock_guard<mutex> guard(lock);
+            failed = true;
+            return false;
+        }
+        fclose(file);
+        file = reopened;
+        if (target != path) remove(path.c_str());
+        path = target;
+        lock_guard<mutex> guard(lock);
+        fileStart = max(fileStart, mark);
+        return true;
+    }
+
+    // Record bytes written since the last checkpoint, fsyncs so far, and
+    // whether a write has failed
+    uint64_t size() {
+        lock_guard<mutex> guard(lock);
+        return appended - fileStart;
+    }
+    uint64_t syncCount() {
+        lock_guard<mutex> guard(lock);
+        return syncs;
+    }
+    bool healthy() {
+        lock_guard<mutex> guard(lock);
+        return !failed;
+    }
+};
+
+// 64-bit hash of every line of a mapped file, built on all cores when the
+// file is loaded. The byte offset of every STRIDE-th line is kept too, so
+// a run of unedited bytes from the file can be turned back into line
+// numbers (and so into hashes) without reading the run again.
+class FileLineHashes {
+private:
+    static constexpr size_t STRIDE = 64;
+
+    shared_ptr<const MappedText> text;
+    vector<uint64_t> hashes;
+    vector<pair<size_t, size_t>> marks;  // (byte offset, line number), by offset
+
+    FileLineHashes() = default;
+
+    // The hash is multiply-xorshift over 8-byte words, then the last
+    // partial word and the length
+    static constexpr uint64_t SEED = 0x9E3779B97F4A7C15ull;
+
+    static uint64_t mix(uint64_t h, uint64_t word) {
+        h = (h ^ word) * SEED;
+        return h ^ (h >> 29);
+    }
+
+    static uint64_t finish(uint64_t h, uint64_t tail, size_t length) {
+        h = mix(h, tail) ^ length;
+        h *= 0xBF58476D1CE4E5B9ull;
+        h ^= h >> 31;
+        h *= 0x94D049BB133111EBull;
+        return h ^ (h >> 32);
+    }
+
+    static unsigned lowestBit(uint64_t mask) {
+#if defined(_MSC_VER) && !defined(__clang__)
+        unsigned long bit;
+        _BitScanForward64(&bit, mask);
+        return bit;
+#else
+        return __builtin_ctzll(mask);
+#endif
+    }
+
+    // Hash the line starting at `p` while looking for its end, 8 bytes at
+    // a time; returns where the next line starts
+    static const char* hashLineAt(const char* p, const char* end, uint64_t& out) {
+        const char* start = p;
+        uint64_t h = SEED;
+        while (end - p >= 8) {
+            uint64_t word;
+            memcpy(&word, p, 8);
+            uint64_t x = word ^ 0x0A0A0A0A0A0A0A0Aull;  // Zero bytes where word has '\n'
+            uint64_t found = (x - 0x0101010101010101ull) & ~x & 0x8080808080808080ull;
+            if (found) {
+                unsigned at = lowestBit(found) / 8;
+                uint64_t tail = at > 0 ? word & (~0ull >> (64 - 8 * at)) : 0;
+                out = finish(h, tail, p + at - start);
+                return p + at + 1;
+            }
+            h = mix(h, word);
+            p += 8;
+        }
+        const char* newline = static_cast<const char*>(memchr(p, '\n', end - p));
+        const char* stop = newline ? newline : end;
+        uint64_t tail = 0;
+        memcpy(&tail, p, stop - p);
+        out = finish(h, tail, stop - start);
+        return newline ? newline + 1 : end;
+    }
+
+public:
+    // Not cryptographic, but two different lines share a hash with odds of
+    // about 2^-64. Assumes a little-endian machine.
+    static uint64_t hash(string_view line) {
+        const char* p = line.data();
+        size_t n = line.size();
+        uint64_t h = SEED;
+        for (; n >= 8; p += 8, n -= 8) {
+            uint64_t word;
+            memcpy(&word, p, 8);
+            h = mix(h, word);
+        }
+        uint64_t tail = 0;
+        memcpy(&tail, p, n);
+        return finish(h, tail, line.size());
+    }
+
+    static shared_ptr<const FileLineHashes> build(shared_ptr<const MappedText> text) {
+        shared_ptr<FileLineHashes> table(new FileLineHashes);
+        const char* data = text->data();
+        size_t size = text->size();
+        table->text = move(text);
+
+        // Each part hashes the lines that start inside its byte range
+        struct Part {
+            vector<uint64_t> hashes;
+            vector<pair<size_t, size_t>> marks;  // Line numbers local to the part
+        };
+        vector<Part> parts(ThreadPool::shared().size() + 1);
+        ThreadPool::shared().parallelFor(size, 1 << 20, [&](size_t part, size_t begin, size_t end) {
+            Part& p = parts[part];
+            const char* line = data + begin;
+            if (begin > 0) {
+                const char* newline = static_cast<const char*>(memchr(data + begin - 1, '\n', size - begin + 1));
+                line = newline ? newline + 1 : data + size;
+            }
+            uint64_t h;
+            while (line < data + end) {
+                if (p.hashes.size() % STRIDE == 0) p.marks.push_back({(size_t)(line - data), p.hashes.size()});
+                line = hashLineAt(line, data + size, h);
+                p.hashes.push_back(h);
+            }
+        });
+        size_t total = 0;
+        for (const auto& part : parts) total += part.hashes.size();
+        table->hashes.reserve(total);
+        for (const auto& part : parts) {
+            for (const auto& mark : part.marks) {
+                table->marks.push_back({mark.first, mark.second + table->hashes.size()});
+            }
+            table->hashes.insert(table->hashes.end(), part.hashes.begin(), part.hashes.end());
+        }
+        return table;
+    }
+
+    // An empty table for `text`, filled in file order by extend(). The
+    // background loader builds its table this way as it reads the file.
+    static shared_ptr<FileLineHashes> start(shared_ptr<const MappedText> text) {
+        shared_ptr<FileLineHashes> table(new FileLineHashes);
+        table->text = move(text);
+        return table;
+    }
+
+    // Hash up to `lines` more lines, the first starting at byte `offset`
+    // (where the last call stopped); returns where the next line starts
+    size_t extend(size_t offset, size_t lines) {
+        const char* data = text->data();
+        const char* end = data + text->size();
+        const char* line = data + offset;
+        uint64_t h;
+        for (size_t n = 0; n < lines && line < end; n++) {
+            if (hashes.size() % STRIDE == 0) marks.push_back({(size_t)(line - data), hashes.size()});
+            line = hashLineAt(line, end, h);
+            hashes.push_back(h);
+        }
+        return line - data;
+    }
+
+    const MappedText& file() const { return *text; }
+    const vector<uint64_t>& all() const { return hashes; }
+    size_t size() const { return hashes.size(); }
+
+    // Number of the line starting at `offset` (the line count at the end of
+    // the file). Reads at most STRIDE lines, from the nearest mark.
+    size_t lineAt(size_t offset) const {
+        if (offset >= text->size()) return hashes.size();
+        auto mark = upper_bound(marks.begin(), marks.end(), make_pair(offset, numeric_limits<size_t>::max()));
+        if (mark == marks.begin()) return 0;
+        --mark;
+        size_t line = mark->second;
+        const char* p = text->data() + mark->first;
+        const char* stop = text->data() + offset;
+        while (p < stop) {
+            const char* newline = static_cast<const char*>(memchr(p, '\n', stop - p));
+            if (!newline) break;
+            p = newline + 1;
+            line++;
+        }
+        return line;
+    }
+
+    // Byte offset where line `line` starts (the file size past the last
+    // line). Marks are in line order too, so this also reads at most
+    // STRIDE lines.
+    size_t offsetOf(size_t line) const {
+        if (line >= hashes.size()) return text->size();
+        auto mark = upper_bound(marks.begin(), marks.end(), line, [](size_t value, const pair<size_t, size_t>& m) {
+            return value < m.second;
+        });
+        --mark;  // The first mark is line 0
+        const char* p = text->data() + mark->first;
+        for (size_t at = mark->second; at < line; at++) {
+            p = static_cast<const char*>(memchr(p, '\n', text->data() + text->size() - p)) + 1;
+        }
+        return p - text->data();
+    }
+
+    // Hash every line of a document walked with forEachRun (a LineRope, a
+    // LineList or a snapshot). Runs of unedited bytes from the file `known`
+    // was built for copy its hashes; only edited lines are hashed.
+    template <class D>
+    static vector<uint64_t> ofDocument(const D& document, const FileLineHashes* known) {
+        vector<uint64_t> out;
+        out.reserve(document.size());
+        document.forEachRun([&](const MappedText& source, size_t offset, size_t length) {
+            if (known && &source == known->text.get()) {
+                auto first = known->hashes.begin() + known->lineAt(offset);
+                auto last = known->hashes.begin() + known->lineAt(offset + length);
+                out.insert(out.end(), first, last);
+                return;
+            }
+            MappedText::forEachLine(source.data() + offset, source.data() + offset + length, [&out](string_view line) {
+                out.push_back(hash(line));
+            });
+        }, [&out](string_view line) {
+            out.push_back(hash(line));
+        });
+        return out;
+    }
+};
+
+// Exact word frequencies for the word analytics. Each thread counts into a
+// table of its own and merge() folds them together at the end. The table
+// is open addressing over string_view keys: a word's bytes are copied into
+// the table's slabs the first time it is seen, so counting a token costs
+// a hash and a probe but never an allocation.
+class WordCounter {
+private:
+    static constexpr size_t SLAB_SIZE = 1 << 16;
+
+    struct Slot {
+        uint64_t hash = 0;
+        string_view word;
+        uint64_t count = 0;  // 0 marks an empty slot
+    };
+
+    vector<Slot> slots = vector<Slot>(1024);
+    size_t used = 0;
+    uint64_t tokens = 0;
+    vector<unique_ptr<char[]>> slabs;
+    char* cursor = nullptr;  // Free space in the current slab
+    size_t left = 0;
+
+    string_view keep(string_view word) {
+        if (word.size() > SLAB_SIZE / 4) {  // Long words get a slab of their own
+            slabs.emplace_back(new char[word.size()]);
+            memcpy(slabs.back().get(), word.data(), word.size());
+            return string_view(slabs.back().get(), word.size());
+        }
+        if (word.size() > left) {
+            slabs.emplace_back(new char[SLAB_SIZE]);
+            cursor = slabs.back().get();
+            left = SLAB_SIZE;
+        }
+        memcpy(cursor, word.data(), word.size());
+        string_view kept(cursor, word.size());
+        cursor += word.size();
+        left -= word.size();
+        return kept;
+    }
+
+    // Slot holding `word`, or the empty slot where it belongs
+    size_t find(string_view word, uint64_t hash) const {
+        size_t mask = slots.size() - 1;
+        size_t i = hash & mask;
+        while (slots[i].count != 0 && (slots[i].hash != hash || slots[i].word != word)) i = (i + 1) & mask;
+        return i;
+    }
+
+    void grow() {
+        vector<Slot> old(slots.size() * 2);
+        old.swap(slots);
+        for (const Slot& slot : old) {
+            if (slot.count != 0) slots[find(slot.word, slot.hash)] = slot;
+        }
+    }
+
+    // Add `count` to a word; `owned` when its bytes already live in this table's slabs
+    void add(string_view word, uint64_t hash, uint64_t count, bool owned) {
+        if ((used + 1) * 4 > slots.size() * 3) grow();  // Keep the table at most 3/4 full
+        Slot& slot = slots[find(word, hash)];
+        if (slot.count == 0) {
+            slot.hash = hash;
+            slot.word = owned ? word : keep(word);
+            used++;
+        }
+        slot.count += count;
+    }
+
+public:
+    void add(string_view word) {
+        tokens++;
+        add(word, FileLineHashes::hash(word), 1, false);
+    }
+
+    // Fold another thread's table into this one. Its slabs move over with
+    // it, so no word is copied again.
+    void merge(WordCounter&& other) {
+        for (auto& slab : other.slabs) slabs.push_back(move(slab));
+        for (const Slot& slot : other.slots) {
+            if (slot.count != 0) add(slot.word, slot.hash, slot.count, true);
+        }
+        tokens += other.tokens;
+        other = WordCounter();
+    }
+
+    uint64_t count(string_view word) const {
+        const Slot& slot = slots[find(word, FileLineHashes::hash(word))];
+        return slot.count;
+    }
+
+    // The k most frequent words, most frequent first (ties in byte order)
+    vector<pair<string_view, uint64_t>> top(size_t k) const {
+        vector<pair<string_view, uint64_t>> words;
+        words.reserve(used);
+        for (const Slot& slot : slots) {
+            if (slot.count != 0) words.emplace_back(slot.word, slot.count);
+        }
+        k = min(k, words.size());
+        partial_sort(words.begin(), words.begin() + k, words.end(), [](const auto& a, const auto& b) {
+            return a.second != b.second ? a.second > b.second : a.first < b.first;
+        });
+        words.resize(k);
+        return words;
+    }
+
+    uint64_t total() const { return tokens; }
+    uint64_t vocabulary() const { return used; }
+    size_t memoryUsage() const { return slots.size() * sizeof(Slot) + slabs.size() * SLAB_SIZE; }
+};
+
+// Bounded-memory word frequencies, for documents whose vocabulary would
+// not fit in memory. A Count-Min sketch of DEPTH rows of WIDTH counters
+// estimates the count of any word. The estimate is never low, and with
+// probability 1 - e^-DEPTH (98%) it is at most e * tokens / WIDTH high.
+// Updates are conservative (only the counters at the current minimum
+// grow), which keeps the estimates closer. A HyperLogLog with 4096
+// registers estimates the vocabulary size within about 1.6%. The heaviest
+// words are kept as candidates in a min-heap on their estimates: a word
+// whose estimate passes the smallest candidate takes its place. Sketches
+// of different threads merge by adding counters; the candidates of both
+// are then estimated again from the sum.
+class WordSketch {
+public:
+    static constexpr size_t WIDTH = 1 << 16;
+    static constexpr size_t DEPTH = 4;
+
+private:
+    static constexpr unsigned REGISTER_BITS = 12;
+
+    vector<uint64_t> counters = vector<uint64_t>(WIDTH * DEPTH);
+    vector<uint8_t> registers = vector<uint8_t>(size_t(1) << REGISTER_BITS);
+    uint64_t tokens = 0;
+
+    size_t capacity;
+    vector<string> words;        // Candidate slots
+    vector<uint64_t> estimates;  // By slot
+    vector<size_t> heap;         // Slots, smallest estimate first
+    vector<size_t> position;     // Where each slot is in the heap
+    unordered_map<string_view, size_t> slotOf;  // Keys view `words`
+
+    // Row r uses h1 + r * h2 (Kirsch-Mitzenmacher), one hash for all rows
+    size_t cell(uint64_t hash, size_t row) const {
+        uint64_t h1 = hash & 0xFFFFFFFFu, h2 = (hash >> 32) | 1;
+        return row * WIDTH + ((h1 + row * h2) & (WIDTH - 1));
+    }
+
+    uint64_t estimate(uint64_t hash) const {
+        uint64_t least = UINT64_MAX;
+        for (size_t row = 0; row < DEPTH; row++) least = min(least, counters[cell(hash, row)]);
+        return least;
+    }
+
+    void swapSlots(size_t a, size_t b) {
+        swap(heap[a], heap[b]);
+        position[heap[a]] = a;
+        position[heap[b]] = b;
+    }
+
+    void siftUp(size_t i) {
+        for (; i > 0 && estimates[heap[i]] < estimates[heap[(i - 1) / 2]]; i = (i - 1) / 2) swapSlots(i, (i - 1) / 2);
+    }
+
+    void siftDown(size_t i) {
+        while (true) {
+            size_t least = i, left = 2 * i + 1, right = left + 1;
+            if (left < heap.size() && estimates[heap[left]] < estimates[heap[least]]) least = left;
+            if (right < heap.size() && estimates[heap[right]] < estimates[heap[least]]) least = right;
+            if (least == i) return;
+            swapSlots(i, least);
+            i = least;
+        }
+    }
+
+    // Track `word` as a candidate with `value`, if it is heavy enough
+    void offer(string_view word, uint64_t value) {
+        auto found = slotOf.find(word);
+        if (found != slotOf.end()) {
+            estimates[found->second] = max(estimates[found->second], value);
+            siftDown(position[found->second]);
+            return;
+        }
+        size_t slot;
+        if (heap.size() < capacity) {
+            slot = heap.size();
+            heap.push_back(slot);
+            position[slot] = slot;
+        } else if (value > estimates[heap[0]]) {
+            slot = heap[0];
+            slotOf.erase(words[slot]);
+        } else {
+            return;
+        }
+        words[slot].assign(word.data(), word.size());
+        estimates[slot] = value;
+        slotOf[words[slot]] = slot;
+        siftUp(position[slot]);
+        siftDown(position[slot]);
+    }
+
+public:
+    // Keep `candidates` heavy hitters; ask for a few times the top-K wanted
+    explicit WordSketch(size_t candidates)
+        : capacity(max<size_t>(1, candidates)), words(capacity), estimates(capacity), position(capacity) {
+        slotOf.reserve(capacity);
+    }
+
+    void add(string_view word) {
+        tokens++;
+        uint64_t hash = FileLineHashes::hash(word);
+        uint64_t value = estimate(hash) + 1;
+        for (size_t row = 0; row < DEPTH; row++) {
+            uint64_t& counter = counters[cell(hash, row)];
+            counter = max(counter, value);
+        }
+        size_t reg = hash >> (64 - REGISTER_BITS);
+        uint8_t rank = 1;
+        for (uint64_t rest = hash << REGISTER_BITS; rank <= 64 - REGISTER_BITS && !(rest >> 63); rest <<= 1) rank++;
+        registers[reg] = max(registers[reg], rank);
+        offer(word, value);
+    }
+
+    void merge(WordSketch&& other) {
+        for (size_t i = 0; i < counters.size(); i++) counters[i] += other.counters[i];
+        for (size_t i = 0; i < registers.size(); i++) registers[i] = max(registers[i], other.registers[i]);
+        tokens += other.tokens;
+        vector<string> all;
+        for (size_t slot : heap) all.push_back(move(words[slot]));
+        for (size_t slot : other.heap) all.push_back(move(other.words[slot]));
+        heap.clear();
+        slotOf.clear();
+        for (const string& word : all) offer(word, count(word));
+    }
+
+    // Estimated count of `word`; 0 means it certainly does not appear
+    uint64_t count(string_view word) const { return estimate(FileLineHashes::hash(word)); }
+
+    // The k heaviest candidates by estimate, heaviest first
+    vector<pair<string_view, uint64_t>> top(size_t k) const {
+        vector<pair<string_view, uint64_t>> best;
+        for (size_t slot : heap) best.emplace_back(words[slot], estimates[slot]);
+        sort(best.begin(), best.end(), [](const auto& a, const auto& b) {
+            return a.second != b.second ? a.second > b.second : a.first < b.first;
+        });
+        if (best.size() > k) best.resize(k);
+        return best;
+    }
+
+    uint64_t total() const { return tokens; }
+
+    // HyperLogLog estimate, with linear counting while registers are empty
+    uint64_t vocabulary() const {
+        double m = (double)registers.size(), sum = 0;
+        size_t empty = 0;
+        for (uint8_t rank : registers) {
+            sum += ldexp(1.0, -rank);
+            empty += rank == 0;
+        }
+        double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+        if (estimate <= 2.5 * m && empty > 0) estimate = m * log(m / empty);
+        return (uint64_t)llround(estimate);
+    }
+
+    // The most any estimate is likely (98%) to be over
+    uint64_t errorBound() const { return (uint64_t)ceil(exp(1.0) * tokens / WIDTH); }
+
+    size_t memoryUsage() const {
+        size_t bytes = counters.size() * sizeof(uint64_t) + registers.size();
+        for (const string& word : words) bytes += sizeof(string) + word.capacity();
+        return bytes + capacity * (2 * sizeof(size_t) + sizeof(uint64_t)) + slotOf.size() * (sizeof(string_view) + 3 * sizeof(void*));
+    }
+};
+
+// Line diff over hashes: Myers' O(ND) algorithm in linear space (split at
+// the middle snake and recurse), after cutting off the common head and
+// tail. A handful of edits in a long file is found directly. If a region
+// needs more than MAX_COST edits, the search starts over with the lines
+// found on only one side set aside, since they can never match; a region
+// that still needs more is split at the furthest point reached, and once
+// the comparison has used up its budget of steps the rest becomes one
+// hunk. Very different texts (a shuffled file, say) still finish quickly,
+// with a correct diff that is not minimal.
+class LineDiff {
+public:
+    // Lines [oldBegin, oldEnd) of the old text became lines [newBegin,
+    // newEnd) of the new one; either range may be empty
+    struct Hunk {
+        size_t oldBegin, oldEnd;
+        size_t newBegin, newEnd;
+    };
+
+private:
+    // Set of line hashes with linear probing; the hashes are already
+    // uniform, so the top bits pick the slot. 0 marks a free slot, and a
+    // real 0 is kept aside.
+    class HashSet {
+    private:
+        vector<uint64_t> slots;
+        int shift = 64;
+        bool zero = false;
+
+        size_t slot(uint64_t hash) const { return (size_t)((hash * 0x9E3779B97F4A7C15ull) >> shift); }
+
+    public:
+        HashSet(const uint64_t* begin, const uint64_t* end) {
+            size_t capacity = 2;
+            while (capacity < 2 * (size_t)(end - begin)) capacity <<= 1;
+            slots.assign(capacity, 0);
+            while ((size_t)1 << (64 - shift) < capacity) shift--;
+            for (; begin < end; ++begin) {
+                if (*begin == 0) {
+                    zero = true;
+                    continue;
+                }
+                size_t i = slot(*begin);
+                while (slots[i] != 0 && slots[i] != *begin) i = (i + 1) & (slots.size() - 1);
+                slots[i] = *begin;
+            }
+        }
+
+        bool contains(uint64_t hash) const {
+            if (hash == 0) return zero;
+            size_t i = slot(hash);
+            while (slots[i] != 0 && slots[i] != hash) i = (i + 1) & (slots.size() - 1);
+            return slots[i] == hash;
+        }
+    };
+
+    // Length of the common run of x[0..n) and y[0..n), and of x(-n..0] and
+    // y(-n..0] going backwards. Snakes over unchanged text are long, so
+    // whole blocks are compared with memcmp first.
+    static size_t commonPrefix(const uint64_t* x, const uint64_t* y, size_t n) {
+        static constexpr size_t BLOCK = 32;
+        size_t i = 0;
+        while (i + BLOCK <= n && memcmp(x + i, y + i, BLOCK * sizeof(uint64_t)) == 0) i += BLOCK;
+        while (i < n && x[i] == y[i]) i++;
+        return i;
+    }
+
+    static size_t commonSuffix(const uint64_t* xEnd, const uint64_t* yEnd, size_t n) {
+        static constexpr size_t BLOCK = 32;
+        size_t i = 0;
+        while (i + BLOCK <= n && memcmp(xEnd - i - BLOCK, yEnd - i - BLOCK, BLOCK * sizeof(uint64_t)) == 0) i += BLOCK;
+        while (i < n && xEnd[-(ptrdiff_t)i - 1] == yEnd[-(ptrdiff_t)i - 1]) i++;
+        return i;
+    }
+
+    const uint64_t* a = nullptr;        // Lines being matched
+    const uint64_t* b = nullptr;
+    vector<uint64_t> keptA, keptB;      // Lines on both sides, once the others are set aside
+    vector<size_t> aLine, bLine;        // Their line numbers in the inputs
+    vector<ptrdiff_t> forward, backward;
+    struct Run {
+        size_t a, b, length;    // a[a, a + length) equals b[b, b + length)
+    };
+    vector<Run> matches;                // Matched runs, in order
+    size_t budget = 0;                  // Diagonal steps left for the whole comparison
+    bool approximate = false;           // A region went over MAX_COST or the budget ran out
+
+    static constexpr ptrdiff_t MAX_COST = 256;
+    static constexpr size_t STEPS_PER_LINE = 16;
+
+    // Split point of a[aBegin, aEnd) x b[bBegin, bEnd); false when nothing
+    // can match
+    bool bisect(size_t aBegin, size_t aEnd, size_t bBegin, size_t bEnd, size_t& splitA, size_t& splitB) {
+        ptrdiff_t n = aEnd - aBegin, m = bEnd - bBegin;
+        const uint64_t* x = a + aBegin;
+        const uint64_t* y = b + bBegin;
+        ptrdiff_t maxD = min((n + m + 1) / 2, MAX_COST + 1);
+        ptrdiff_t offset = maxD, length = 2 * maxD + 2;
+        forward.assign(length, -1);
+        backward.assign(length, -1);
+        forward[offset + 1] = backward[offset + 1] = 0;
+        ptrdiff_t delta = n - m;
+        bool odd = delta % 2 != 0;
+        ptrdiff_t fStart = 0, fEnd = 0, bStart = 0, bEnd2 = 0;
+        for (ptrdiff_t d = 0; d < maxD; d++) {
+            if (budget < (size_t)(2 * d + 2)) {
+                budget = 0;
+                approximate = true;
+                return false;
+            }
+            budget -= 2 * d + 2;
+            for (ptrdiff_t k = -d + fStart; k <= d - fEnd; k += 2) {
+                ptrdiff_t i = k == -d || (k != d && forward[offset + k - 1] < forward[offset + k + 1])
+                                  ? forward[offset + k + 1] : forward[offset + k - 1] + 1;
+                ptrdiff_t j = i - k;
+                if (i < n && j < m) {
+                    ptrdiff_t run = commonPrefix(x + i, y + j, min(n - i, m - j));
+                    i += run;
+                    j += run;
+                }
+                forward[offset + k] = i;
+                if (i > n) {
+                    fEnd += 2;
+                } else if (j > m) {
+                    fStart += 2;
+                } else if (odd) {
+                    ptrdiff_t other = offset + delta - k;
+                    if (other >= 0 && other < length && backward[other] != -1 && i >= n - backward[other]) {
+                        splitA = aBegin + i;
+                        splitB = bBegin + j;
+                        return true;
+                    }
+                }
+            }
+            for (ptrdiff_t k = -d + bStart; k <= d - bEnd2; k += 2) {
+                ptrdiff_t i = k == -d || (k != d && backward[offset + k - 1] < backward[offset + k + 1])
+                                  ? backward[offset + k + 1] : backward[offset + k - 1] + 1;
+                ptrdiff_t j = i - k;
+                if (i < n && j < m) {
+                    ptrdiff_t run = commonSuffix(x + n - i, y + m - j, min(n - i, m - j));
+                    i += run;
+                    j += run;
+                }
+                backward[offset + k] = i;
+                if (i > n) {
+                    bEnd2 += 2;
+                } else if (j > m) {
+                    bStart += 2;
+                } else if (!odd) {
+                    ptrdiff_t other = offset + delta - k;
+                    if (other >= 0 && other < length && forward[other] != -1) {
+                        ptrdiff_t fi = forward[other];
+                        if (fi >= n - i) {
+                            splitA = aBegin + fi;
+                            splitB = bBegin + (fi - (other - offset));
+                            return true;
+                        }
+                    }
+                }
+            }
+        }
+        if (maxD < (n + m + 1) / 2) {
+            // Over MAX_COST: split where the forward search got furthest
+            approximate = true;
+            ptrdiff_t best = -1;
+            for (ptrdiff_t k = -maxD + 1; k < maxD; k++) {
+                ptrdiff_t i = forward[offset + k], j = i - k;
+                if (i < 0 || i > n || j < 0 || j > m || i + j >= n + m) continue;
+                if (best < 0 || i + j > (ptrdiff_t)(splitA - aBegin + splitB - bBegin)) {
+                    best = k;
+                    splitA = aBegin + i;
+                    splitB = bBegin + j;
+                }
+            }
+            return best >= 0;
+        }
+        return false;
+    }
+
+    // Append the matches of a[aBegin, aEnd) x b[bBegin, bEnd). The left
+    // half recurses; the right half loops, so depth stays logarithmic even
+    // when the cost limit splits a long region many times.
+    void match(size_t aBegin, size_t aEnd, size_t bBegin, size_t bEnd) {
+        size_t tail = 0;
+        while (aBegin < aEnd && bBegin < bEnd) {
+            size_t head = commonPrefix(a + aBegin, b + bBegin, min(aEnd - aBegin, bEnd - bBegin));
+            if (head > 0) matches.push_back({aBegin, bBegin, head});
+            aBegin += head;
+            bBegin += head;
+            size_t end = commonSuffix(a + aEnd, b + bEnd, min(aEnd - aBegin, bEnd - bBegin));
+            aEnd -= end;
+            bEnd -= end;
+            tail += end;
+            size_t splitA, splitB;
+            if (aBegin == aEnd || bBegin == bEnd || !bisect(aBegin, aEnd, bBegin, bEnd, splitA, splitB)) break;
+            match(aBegin, splitA, bBegin, splitB);
+            aBegin = splitA;
+            bBegin = splitB;
+        }
+        if (tail > 0) matches.push_back({aEnd, bEnd, tail});
+    }
+
+public:
+    static vector<Hunk> compare(const vector<uint64_t>& before, const vector<uint64_t>& after) {
+        size_t head = commonPrefix(before.data(), after.data(), min(before.size(), after.size()));
+        size_t tail = commonSuffix(before.data() + before.size(), after.data() + after.size(),
+                                   min(before.size(), after.size()) - head);
+        size_t oldEnd = before.size() - tail, newEnd = after.size() - tail;
+
+        LineDiff diff;
+        if (head < oldEnd && head < newEnd) {
+            diff.a = before.data();
+            diff.b = after.data();
+            diff.budget = oldEnd + newEnd - 2 * head + (1 << 16);
+            diff.match(head, oldEnd, head, newEnd);
+        }
+        if (diff.approximate) {
+            // Keep only lines that occur on both sides and search again
+            diff.matches.clear();
+            diff.approximate = false;
+            HashSet oldLines(before.data() + head, before.data() + oldEnd);
+            HashSet newLines(after.data() + head, after.data() + newEnd);
+            for (size_t i = head; i < oldEnd; i++) {
+                if (!newLines.contains(before[i])) continue;
+                diff.keptA.push_back(before[i]);
+                diff.aLine.push_back(i);
+            }
+            for (size_t i = head; i < newEnd; i++) {
+                if (!oldLines.contains(after[i])) continue;
+                diff.keptB.push_back(after[i]);
+                diff.bLine.push_back(i);
+            }
+            diff.a = diff.keptA.data();
+            diff.b = diff.keptB.data();
+            diff.budget = STEPS_PER_LINE * (diff.keptA.size() + diff.keptB.size()) + (1 << 20);
+            diff.match(0, diff.keptA.size(), 0, diff.keptB.size());
+        }
+
+        vector<Hunk> hunks;
+        size_t oldAt = head, newAt = head;
+        auto gap = [&](size_t oldStop, size_t newStop) {
+            if (oldStop > oldAt || newStop > newAt) hunks.push_back({oldAt, oldStop, newAt, newStop});
+            oldAt = oldStop + 1;
+            newAt = newStop + 1;
+        };
+        for (const auto& run : diff.matches) {
+            if (diff.aLine.empty()) {
+                gap(run.a, run.b);
+                oldAt = run.a + run.length;
+                newAt = run.b + run.length;
+                continue;
+            }
+            for (size_t i = 0; i < run.length; i++) gap(diff.aLine[run.a + i], diff.bLine[run.b + i]);
+        }
+        gap(oldEnd, newEnd);
+        return hunks;
+    }
+};
+
+// What the editor last loaded from or wrote to a file
+struct DiskContents {
+    string filename;
+    FileStamp stamp;                            // The file right after that load or write
+    shared_ptr<const vector<uint64_t>> hashes;  // Hash of each of its lines
+};
+
+// Everything needed to write the document as it looked at one moment
+struct SaveJob {
+    DocumentSnapshot document;
+    shared_ptr<const FileLineHashes> known;  // Hashes of the file unedited lines are read from
+    string filename;
+    bool overwrite = false;     // Write even if another program changed the file
+    uint64_t version = 0;       // Editor version the snapshot was taken at
+    uint64_t baseVersion = 0;   // Version of the document when it was loaded or created
+    shared_ptr<WriteAheadLog> log;  // Checkpointed once the file is written
+    uint64_t logMark = 0;           // Log position the snapshot corresponds to
+};
+
+// Writes documents to disk. Explicit saves run on the calling thread; with
+// autosave on, a worker thread writes the latest snapshot it was handed
+// once `editLimit` edits have piled up or `interval` has passed since the
+// first unsaved one. One write runs at a time, so a manual save and an
+// autosave never race on the same file. Before writing, the file is
+// checked against what was last loaded from or written to it: if another
+// program changed it the save is refused (CONFLICT) unless the job says to
+// overwrite, and if the document's line hashes equal the file's nothing is
+// written at all.
+class DocumentSaver {
+public:
+    enum Outcome { WRITTEN, UNCHANGED, FAILED, CONFLICT };
+
+    struct Status {
+        bool saving = false;
+        bool lastFailed = false;
+        bool lastConflict = false;  // The file changed on disk, so the last save was refused
+        uint64_t savedVersion = 0;  // Newest version known to be on disk
+        size_t saves = 0;
+        size_t autosaves = 0;
+        size_t failures = 0;
+        size_t conflicts = 0;
+        double lastMs = 0;
+        double maxMs = 0;
+        time_t lastAt = 0;
+        string lastFile;
+    };
+
+private:
+    mutable mutex lock;         // Guards everything below except `writing`
+    condition_variable wake;
+    mutex writing;              // Held for the whole write of a file
+    unique_ptr<SaveJob> queued; // Newest snapshot not yet written by the worker
+    chrono::steady_clock::time_point dirtySince;
+    Status status;
+    uint64_t writtenVersion = 0;    // Version of the last write to status.lastFile
+    DiskContents disk;          // What the file being edited held when we last loaded or wrote it
+    FileStamp conflictStamp;    // A changed file already compared, so it is not hashed again
+    bool enabled = false;
+    bool stopping = false;
+    chrono::seconds interval{30};
+    size_t editLimit = 50;
+    thread worker;
+
+    bool due(const SaveJob& job) const {
+        uint64_t edits = job.version - max(status.savedVersion, job.baseVersion);
+        return edits >= editLimit || chrono::steady_clock::now() >= dirtySince + interval;
+    }
+
+    void work() {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            if (queued && (stopping || due(*queued))) {
+                unique_ptr<SaveJob> job = move(queued);
+                guard.unlock();
+                write(*job, true);
+                guard.lock();
+                continue;
+            }
+            if (stopping) return;
+            if (queued) {
+                wake.wait_until(guard, dirtySince + interval);
+            } else {
+                wake.wait(guard);
+            }
+        }
+    }
+
+    // Unedited chunks of a mapped file are copied over as byte ranges; if
+    // that covers the whole file and it is the file on disk, nothing is
+    // written
+    static Outcome writeFile(const SaveJob& job) {
+        const DocumentSnapshot& document = job.document;
+        bool unchanged = true;
+        document.forEachRun([&](const MappedText& source, size_t offset, size_t length) {
+            unchanged &= offset == 0 && length == source.size() && source.isCurrentFile(job.filename);
+        }, [&unchanged](string_view) {
+            unchanged = false;
+        });
+        if (unchanged) return UNCHANGED;
+
+        AtomicFileWriter file(job.filename);
+        if (file.isOpen()) {
+            document.forEachRun([&file](const MappedText& source, size_t offset, size_t length) {
+                file.writeRange(source, offset, length);
+                if (source.data()[offset + length - 1] != '\n') file.write("\n");
+            }, [&file](string_view line) {
+                file.writeLine(line);
+            });
+        }
+        return file.isOpen() && file.commit() ? WRITTEN : FAILED;
+    }
+
+    // True when the file changed on disk since `expected` was recorded.
+    // A new stamp alone is not enough: the lines are hashed and compared,
+    // so a file that was only touched or rewritten unchanged is fine.
+    bool changedOnDisk(const string& filename, const DiskContents& expected, FileStamp& now) {
+        now = FileStamp::of(filename);
+        if (expected.filename != filename || !expected.hashes || !now.exists || now == expected.stamp) return false;
+        {
+            lock_guard<mutex> guard(lock);
+            if (now == conflictStamp) return true;
+        }
+        shared_ptr<MappedText> text = MappedText::open(filename);
+        bool changed = !text || FileLineHashes::build(text)->all() != *expected.hashes;
+        lock_guard<mutex> guard(lock);
+        if (changed) conflictStamp = now;
+        return changed;
+    }
+
+    Outcome write(const SaveJob& job, bool automatic) {
+        lock_guard<mutex> writeGuard(writing);
+        DiskContents expected;
+        FileStamp current = FileStamp::of(job.filename);
+        {
+            lock_guard<mutex> guard(lock);
+            // A manual save may have overtaken this autosave while it waited.
+            // Saving the same version again only writes if the file is gone
+            // or changed on disk.
+            if (job.filename == status.lastFile &&
+                (job.version < writtenVersion || (job.version == writtenVersion && current == disk.stamp))) {
+                return UNCHANGED;
+            }
+            status.saving = true;
+            expected = disk;
+        }
+        auto start = chrono::steady_clock::now();
+        FileStamp before;
+        Outcome outcome = WRITTEN;
+        shared_ptr<const vector<uint64_t>> hashes;
+        if (changedOnDisk(job.filename, expected, before) && !job.overwrite) {
+            outcome = CONFLICT;
+        } else {
+            hashes = make_shared<const vector<uint64_t>>(FileLineHashes::ofDocument(job.document, job.known.get()));
+            bool same = expected.filename == job.filename && expected.hashes && before.exists &&
+                        *hashes == *expected.hashes;
+            outcome = same ? UNCHANGED : writeFile(job);
+        }
+        if ((outcome == WRITTEN || outcome == UNCHANGED) && job.log) job.log->checkpoint(job.logMark, job.filename);
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        FileStamp after = outcome == WRITTEN ? FileStamp::of(job.filename) : before;
+
+        lock_guard<mutex> guard(lock);
+        status.saving = false;
+        status.lastFailed = outcome == FAILED;
+        status.lastConflict = outcome == CONFLICT;
+        if (outcome == FAILED) {
+            status.failures++;
+            return outcome;
+        }
+        if (outcome == CONFLICT) {
+            status.conflicts++;
+            return outcome;
+        }
+        disk.filename = job.filename;
+        disk.stamp = after;
+        disk.hashes = hashes;
+        status.savedVersion = max(status.savedVersion, job.version);
+        writtenVersion = job.version;
+        status.saves++;
+        if (automatic) status.autosaves++;
+        status.lastMs = ms;
+        status.maxMs = max(status.maxMs, ms);
+        status.lastAt = time(nullptr);
+        status.lastFile = job.filename;
+        return outcome;
+    }
+
+public:
+    DocumentSaver() = default;
+    DocumentSaver(const DocumentSaver&) = delete;
+    DocumentSaver& operator=(const DocumentSaver&) = delete;
+
+    // Any snapshot still waiting is written before the worker exits
+    ~DocumentSaver() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_one();
+        if (worker.joinable()) worker.join();
+    }
+
+    // Save on the calling thread. The job is newer than any snapshot still
+    // waiting for the worker, so that one is dropped.
+    Outcome save(const SaveJob& job) {
+        {
+            lock_guard<mutex> guard(lock);
+            queued.reset();
+        }
+        return write(job, false);
+    }
+
+    // Hand the worker a newer snapshot; an older one still waiting is dropped
+    void schedule(unique_ptr<SaveJob> job) {
+        {
+            lock_guard<mutex> guard(lock);
+            if (!enabled) return;
+            if (!queued) dirtySince = chrono::steady_clock::now();
+            queued = move(job);
+        }
+        wake.notify_one();
+    }
+
+    // Start autosaving every `seconds` or `edits` edits; 0 seconds turns it off
+    void configure(unsigned seconds, size_t edits) {
+        lock_guard<mutex> guard(lock);
+        enabled = seconds > 0;
+        interval = chrono::seconds(seconds);
+        editLimit = max<size_t>(1, edits);
+        if (!enabled) queued.reset();
+        if (enabled && !worker.joinable()) worker = thread([this] { work(); });
+        wake.notify_one();
+    }
+
+    bool autosaving() const {
+        lock_guard<mutex> guard(lock);
+        return enabled;
+    }
+
+    unsigned intervalSeconds() const {
+        lock_guard<mutex> guard(lock);
+        return (unsigned)interval.count();
+    }
+
+    size_t edits() const {
+        lock_guard<mutex> guard(lock);
+        return editLimit;
+    }
+
+    // A freshly loaded or created document matches what is on disk
+    void markSaved(uint64_t version, DiskContents contents) {
+        lock_guard<mutex> guard(lock);
+        status.savedVersion = max(status.savedVersion, version);
+        status.lastConflict = false;
+        disk = move(contents);
+    }
+
+    DiskContents diskContents() const {
+        lock_guard<mutex> guard(lock);
+        return disk;
+    }
+
+    Status current() const {
+        lock_guard<mutex> guard(lock);
+        return status;
+    }
+};
+
+// Reads a mapped file on a background thread, so a large document can be
+// used while it loads. The worker hashes the lines in file order (the
+// table the saver and diff need anyway) and publishes them in batches of
+// whole lines; the editor moves the batches into its document between
+// commands, or waits for the one holding a line it needs. The first batch
+// is small, so the first screen shows up at once.
+class DocumentLoader {
+public:
+    struct Batch {
+        size_t begin, end;  // Byte range of the file, whole lines
+        size_t lines;
+    };
+
+private:
+    static constexpr size_t FIRST_BATCH = 1 << 12;  // Lines; a few screens
+    static constexpr size_t BATCH = 1 << 16;
+
+    shared_ptr<const MappedText> text;
+    shared_ptr<FileLineHashes> table;  // Only the worker touches it until `done`
+    mutable mutex lock;                // Guards everything below
+    condition_variable published;
+    vector<Batch> ready;                // Read but not taken yet
+    size_t readBytes = 0, readLines = 0;
+    bool done = false;
+    bool stopping = false;
+    thread worker;
+
+    void work() {
+        size_t offset = 0, lines = FIRST_BATCH;
+        while (offset < text->size()) {
+            size_t end = table->extend(offset, lines);
+            lock_guard<mutex> guard(lock);
+            if (stopping) return;
+            ready.push_back({offset, end, table->size() - readLines});
+            readBytes = offset = end;
+            readLines = table->size();
+            lines = BATCH;
+            published.notify_all();
+        }
+        lock_guard<mutex> guard(lock);
+        done = true;
+        published.notify_all();
+    }
+
+public:
+    explicit DocumentLoader(shared_ptr<const MappedText> file) : text(file), table(FileLineHashes::start(file)) {
+        worker = thread([this] { work(); });
+    }
+
+    ~DocumentLoader() { cancel(); }
+
+    DocumentLoader(const DocumentLoader&) = delete;
+    DocumentLoader& operator=(const DocumentLoader&) = delete;
+
+    const shared_ptr<const MappedText>& file() const { return text; }
+
+    // Move the batches read so far into `batches`, first waiting up to
+    // `wait` until `lines` lines have been read in all. Returns true once
+    // the batches handed out include the last one.
+    bool take(vector<Batch>& batches, size_t lines, chrono::milliseconds wait) {
+        unique_lock<mutex> guard(lock);
+        published.wait_for(guard, wait, [&] { return done || stopping || readLines >= lines; });
+        batches.clear();
+        swap(batches, ready);
+        return done;
+    }
+
+    // Stop reading; batches not taken yet can still be taken
+    void cancel() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        if (worker.joinable()) worker.join();
+    }
+
+    // Hashes of every line of the file, once it has all been read
+    shared_ptr<const FileLineHashes> hashes() const {
+        lock_guard<mutex> guard(lock);
+        return done ? table : nullptr;
+    }
+
+    // Share of the file read so far, in percent
+    int percent() const {
+        lock_guard<mutex> guard(lock);
+        return text->size() > 0 ? (int)(readBytes * 100 / text->size()) : 100;
+    }
+};
+
+// Class for the text editor
+class TextEditor {
+private:
+    Document document;  // Line storage (rope by default, see Document above)
+    EditJournal journal;     // Undo/redo history
+    EditCommand pending;     // Command being recorded by the current edit
+    bool recording = false;  // True while an edit records deltas into `pending`
+    string currentFilename;  // Stores the current filename being edited
+    shared_ptr<const FileLineHashes> fileHashes;  // Line hashes of the file the document was loaded from
+    unique_ptr<DocumentLoader> loader;  // Reads the rest of the file while the document is in use
+    size_t loadedLines = 0;  // Lines of the file moved into the document so far
+    size_t documentBytes = 0;  // Size of the document as saved (lines plus newlines)
+    unique_ptr<WordIndex> wordIndex;  // Optional word -> lines index, kept in sync by the helpers below
+    FormatStack format;      // Bold/italic/case steps not yet written into the lines
+    bool pager = false;      // Display through the scrollable viewer instead of printing everything
+    bool journaling = true;  // Keep a crash journal next to the file; batch runs do without
+    DocumentSaver saver;     // Manual saves and the autosave worker
+    uint64_t version = 0;    // Bumped by every edit, undo and redo
+    uint64_t baseVersion = 0;       // Version when the document was loaded or created
+    uint64_t scheduledVersion = 0;  // Version last handed to the saver
+    shared_ptr<WriteAheadLog> recoveryLog;  // <file>.journal, once the document has a file
+    string logRecords;       // Records of the current command, appended to the log when it ends
+    bool logEachLine = true; // Off while a whole-document transform is logged as one record
+    ostream output{cout.rdbuf()};  // Messages and results; a server session captures them
+
+    // All line edits go through these helpers so the word index and the
+    // undo journal stay in sync
+    void setLine(size_t index, string_view text) {
+        string_view before = document.at(index);
+        if (recording && pending.kind == EditCommand::LINES) pending.deltas.push_back(LineDelta::change(index, before, text));
+        if (recoveryLog) WriteAheadLog::change(logRecords, index, before, text);
+        if (wordIndex) wordIndex->changeLine(index, before, text);
+        documentBytes += text.size() - before.size();
+        document.set(index, text);
+    }
+
+    void insertLine(size_t index, string_view text) {
+        if (recording) pending.deltas.push_back(LineDelta::insert(index, text));
+        if (recoveryLog) WriteAheadLog::insert(logRecords, index, text);
+        if (wordIndex) wordIndex->insertLine(index, text);
+        documentBytes += text.size() + 1;
+        document.insert(index, text);
+    }
+
+    void eraseLine(size_t index) {
+        string_view before = document.at(index);
+        if (recording) pending.deltas.push_back(LineDelta::erase(index, before));
+        if (recoveryLog) WriteAheadLog::erase(logRecords, index);
+        if (wordIndex) wordIndex->eraseLine(index, before);
+        documentBytes -= before.size() + 1;
+        document.erase(index);
+    }
+
+    template <class F>
+    void rewriteLines(F f, size_t from = 0, size_t to = numeric_limits<size_t>::max()) {
+        document.rewrite(from, min(to, document.size()), [&](size_t index, string_view line, string& out) {
+            if (!f(index, line, out)) return false;
+            if (recording && pending.kind == EditCommand::LINES) {
+                pending.deltas.push_back(LineDelta::change(index, line, out));
+            } else if (recording && pending.kind == EditCommand::MATERIALIZE) {
+                // Only the case change needs undo data; the markers are stripped by length
+                string_view converted(out.data() + format.prefixSize(), line.size());
+                if (converted != line) {
+                    pending.deltas.push_back(LineDelta::change(index, line, converted));
+                    pending.deltas.back().inserted.clear();
+                }
+            }
+            if (recoveryLog && logEachLine) WriteAheadLog::change(logRecords, index, line, out);
+            if (wordIndex) wordIndex->changeLine(index, line, out);
+            documentBytes += out.size() - line.size();
+            return true;
+        });
+    }
+
+    // Start recording an undoable edit. Line edits work on the text as it
+    // is shown, so pending formatting is written into the lines first.
+    void beginEdit(const string& name, EditCommand::Kind kind = EditCommand::LINES) {
+        if (kind == EditCommand::LINES) materializeFormat();
+        pending = EditCommand();
+        pending.name = name;
+        pending.kind = kind;
+        recording = true;
+    }
+
+    // Hand the records of the finished command to the recovery log
+    void logCommand() {
+        if (recoveryLog && !logRecords.empty()) recoveryLog->append(logRecords);
+        logRecords.clear();
+    }
+
+    // Store the recorded edit in the journal (if it changed anything)
+    void commitEdit() {
+        recording = false;
+        logCommand();
+        if (pending.kind == EditCommand::LINES && pending.deltas.empty()) return;
+        version++;
+        pending.at = chrono::steady_clock::now();
+        journal.record(move(pending));
+    }
+
+    // Rewrite every line with build(line, bytes), which appends the new
+    // line to `bytes` and returns true, or returns false to keep the line.
+    // The document is processed in blocks: all cores build the new lines of
+    // a block from disjoint line ranges, then one pass commits them through
+    // rewriteLines (storage, journal and word index are single-threaded).
+    template <class F>
+    void transformLines(F build) {
+        static const size_t BLOCK = 1 << 16;
+        struct Part {
+            string bytes;                       // New lines, back to back
+            vector<pair<size_t, size_t>> ends;  // (line index, end offset in bytes)
+        };
+        vector<Part> parts(ThreadPool::shared().size() + 1);
+        for (size_t blockBegin = 0; blockBegin < document.size(); blockBegin += BLOCK) {
+            size_t blockEnd = min(document.size(), blockBegin + BLOCK);
+            for (auto& part : parts) {
+                part.bytes.clear();
+                part.ends.clear();
+            }
+            ThreadPool::shared().parallelFor(blockEnd - blockBegin, 4096, [&](size_t part, size_t begin, size_t end) {
+                Part& p = parts[part];
+                document.forEach(blockBegin + begin, blockBegin + end, [&](size_t index, string_view line) {
+                    if (build(line, p.bytes)) p.ends.push_back({index, p.bytes.size()});
+                });
+            });
+
+            size_t part = 0, next = 0, start = 0;
+            rewriteLines([&](size_t index, string_view, string& out) {
+                while (part < parts.size() && next == parts[part].ends.size()) {
+                    part++;
+                    next = start = 0;
+                }
+                if (part == parts.size() || parts[part].ends[next].first != index) return false;
+                size_t end = parts[part].ends[next++].second;
+                out.assign(parts[part].bytes, start, end - start);
+                start = end;
+                return true;
+            }, blockBegin, blockEnd);
+        }
+    }
+
+    // Write the formatting stack into every line (one parallel pass for
+    // the whole stack) and empty it
+    void applyFormat() {
+        finishLoading();  // Lines published later would miss the formatting
+        if (recoveryLog) WriteAheadLog::applyFormat(logRecords);
+        logEachLine = false;
+        transformLines([this](string_view line, string& bytes) { return format.apply(line, bytes); });
+        logEachLine = true;
+        format.clear();
+    }
+
+    // Cut `prefix` bytes from the start and `suffix` from the end of every line
+    void stripFormat(size_t prefix, size_t suffix) {
+        if (prefix + suffix == 0) return;
+        finishLoading();
+        if (recoveryLog) WriteAheadLog::stripFormat(logRecords, prefix, suffix);
+        logEachLine = false;
+        transformLines([prefix, suffix](string_view line, string& bytes) {
+            bytes.append(line.data() + prefix, line.size() - prefix - suffix);
+            return true;
+        });
+        logEachLine = true;
+    }
+
+    // Materialize pending formatting as its own undo step
+    void materializeFormat() {
+        if (format.empty()) return;
+        beginEdit("materializeFormat", EditCommand::MATERIALIZE);
+        pending.steps = format.steps();
+        applyFormat();
+        commitEdit();
+    }
+
+    // Push a bold/italic/case step; O(1), nothing is rewritten yet
+    void pushFormat(const string& name, const FormatStep& step) {
+        beginEdit(name, EditCommand::FORMAT);
+        pending.steps.push_back(step);
+        format.push(step);
+        if (recoveryLog) WriteAheadLog::pushFormat(logRecords, step);
+        commitEdit();
+    }
+
+    // Undo a command by applying its deltas backwards
+    void revert(const EditCommand& command) {
+        if (command.kind == EditCommand::FORMAT) {
+            format.pop();
+            if (recoveryLog) WriteAheadLog::popFormat(logRecords);
+            return;
+        }
+        if (command.kind == EditCommand::MATERIALIZE) {
+            // Strip the markers, restore the case-changed spans, and put the steps back
+            format.assign(command.steps);
+            if (recoveryLog) WriteAheadLog::setFormat(logRecords, command.steps);
+            stripFormat(format.prefixSize(), format.suffixSize());
+        }
+        for (auto it = command.deltas.rbegin(); it != command.deltas.rend(); ++it) {
+            if (it->kind == LineDelta::INSERT) {
+                eraseLine(it->line);
+            } else if (it->kind == LineDelta::ERASE) {
+                insertLine(it->line, it->removed);
+            } else {
+                // Case changes keep the span length, so the new span is as long as the old one
+                size_t length = command.kind == EditCommand::LINES ? it->inserted.size() : it->removed.size();
+                string text(document.at(it->line));
+                text.replace(it->offset, length, it->removed);
+                setLine(it->line, text);
+            }
+        }
+    }
+
+    // Redo a command by applying its deltas forwards
+    void reapply(const EditCommand& command) {
+        if (command.kind == EditCommand::FORMAT) {
+            format.push(command.steps[0]);
+            if (recoveryLog) WriteAheadLog::pushFormat(logRecords, command.steps[0]);
+            return;
+        }
+        if (command.kind == EditCommand::MATERIALIZE) {
+            applyFormat();
+            return;
+        }
+        for (const auto& delta : command.deltas) {
+            if (delta.kind == LineDelta::INSERT) {
+                insertLine(delta.line, delta.inserted);
+            } else if (delta.kind == LineDelta::ERASE) {
+                eraseLine(delta.line);
+            } else {
+                string text(document.at(delta.line));
+                text.replace(delta.offset, delta.removed.size(), delta.inserted);
+                setLine(delta.line, text);
+            }
+        }
+    }
+
+    // Calls f(index, text) for every line in [from, to) as it is shown, with
+    // pending formatting applied on the fly. Safe to run on several threads.
+    template <class F>
+    void forEachVisible(size_t from, size_t to, F f) const {
+        if (format.empty()) {
+            document.forEach(from, to, f);
+            return;
+        }
+        string visible;
+        document.forEach(from, to, [&](size_t index, string_view line) {
+            visible.clear();
+            f(index, format.apply(line, visible) ? string_view(visible) : line);
+        });
+    }
+
+    string visibleLine(size_t index) const {
+        string visible;
+        string_view line = document.at(index);
+        return format.apply(line, visible) ? visible : string(line);
+    }
+
+    // A document just loaded or created is what is on disk (or nothing)
+    void startVersion(DiskContents contents = DiskContents()) {
+        baseVersion = scheduledVersion = ++version;
+        saver.markSaved(version, move(contents));
+    }
+
+    // Hash of every line as shown. Unedited runs of the loaded file take
+    // the hashes computed at load, so only edited lines are read.
+    vector<uint64_t> documentHashes() const {
+        if (format.empty()) return FileLineHashes::ofDocument(document, fileHashes.get());
+        vector<vector<uint64_t>> parts(ThreadPool::shared().size() + 1);
+        ThreadPool::shared().parallelFor(document.size(), 4096, [&](size_t part, size_t begin, size_t end) {
+            forEachVisible(begin, end, [&](size_t, string_view line) {
+                parts[part].push_back(FileLineHashes::hash(line));
+            });
+        });
+        vector<uint64_t> hashes;
+        hashes.reserve(document.size());
+        for (const auto& part : parts) hashes.insert(hashes.end(), part.begin(), part.end());
+        return hashes;
+    }
+
+    // Snapshot the document for the saver; cheap with the rope. Called
+    // between commands with no pending formatting, so the stored lines are
+    // exactly what the file will hold and the log can restart from it.
+    SaveJob saveJob() {
+        SaveJob job;
+        job.document = document.snapshot();
+        job.known = fileHashes;
+        job.filename = currentFilename;
+        job.version = version;
+        job.baseVersion = baseVersion;
+        job.log = recoveryLog;
+        if (recoveryLog) job.logMark = recoveryLog->mark();
+        return job;
+    }
+
+    // Redo one record of the recovery log; false if it does not fit the document
+    bool replayRecord(const WriteAheadLog::Record& record) {
+        switch (record.type) {
+            case WriteAheadLog::INSERT:
+                if (record.line > document.size()) return false;
+                insertLine(record.line, record.text);
+                return true;
+            case WriteAheadLog::ERASE:
+                if (record.line >= document.size()) return false;
+                eraseLine(record.line);
+                return true;
+            case WriteAheadLog::CHANGE: {
+                if (record.line >= document.size()) return false;
+                string text(document.at(record.line));
+                if (record.offset > text.size() || record.length > text.size() - record.offset) return false;
+                text.replace(record.offset, record.length, record.text);
+                setLine(record.line, text);
+                return true;
+            }
+            case WriteAheadLog::PUSH_FORMAT:
+                format.push(record.steps[0]);
+                return true;
+            case WriteAheadLog::POP_FORMAT:
+                if (format.empty()) return false;
+                format.pop();
+                return true;
+            case WriteAheadLog::SET_FORMAT:
+                format.assign(record.steps);
+                return true;
+            case WriteAheadLog::APPLY_FORMAT:
+                applyFormat();
+                return true;
+            case WriteAheadLog::STRIP_FORMAT: {
+                bool fits = true;
+                document.forEach(0, document.size(), [&](size_t, string_view line) {
+                    fits &= line.size() >= record.offset + record.length;
+                });
+                if (fits) stripFormat(record.offset, record.length);
+                return fits;
+            }
+        }
+        return false;
+    }
+
+    // Replay the recovery log of the file just loaded, then keep logging to it
+    void openRecoveryLog() {
+        uint64_t bytes;
+        size_t records;
+        auto result = WriteAheadLog::replay(currentFilename, [this](const WriteAheadLog::Record& record) {
+            return replayRecord(record);
+        }, bytes, records);
+        if (result == WriteAheadLog::STALE) {
+            string path = WriteAheadLog::pathFor(currentFilename);
+            rename(path.c_str(), (path + ".stale").c_str());
+            output << YELLOW << "The journal was written for another version of this file; kept it as "
+                 << path << ".stale.\n" << RESET;
+        } else if (records > 0) {
+            version++;
+            output << GREEN << "Recovered " << records << " unsaved edit(s) from the journal.\n" << RESET;
+        }
+        recoveryLog = WriteAheadLog::open(currentFilename, records > 0 ? bytes : 0);
+        if (!recoveryLog) output << YELLOW << "Cannot write the journal; unsaved edits will not survive a crash.\n" << RESET;
+    }
+
+    // Rebuild the word index from scratch, if it is enabled
+    void rebuildWordIndex() {
+        if (!wordIndex) return;
+        wordIndex.reset(new WordIndex);
+        document.forEach(0, document.size(), [this](size_t index, string_view line) {
+            wordIndex->insertLine(index, line);
+        });
+    }
+
+    // Append batches of the loading file to the document. Lines edited so
+    // far all come before them, so no index changes.
+    void publish(const vector<DocumentLoader::Batch>& batches) {
+        const MappedText& file = *loader->file();
+        for (const auto& batch : batches) {
+            size_t first = document.size();
+            document.append(loader->file(), batch.begin, batch.end);
+            documentBytes += batch.end - batch.begin;
+            if (batch.end == file.size() && file.data()[batch.end - 1] != '\n') documentBytes++;
+            loadedLines += batch.lines;
+            if (wordIndex) {
+                document.forEach(first, document.size(), [this](size_t index, string_view line) {
+                    wordIndex->insertLine(index, line);
+                });
+            }
+        }
+    }
+
+    // Move the lines the loader has read into the document. With `lines`,
+    // first wait until the document has that many (or holds the whole
+    // file), so an operation waits only for the region it touches;
+    // `report` shows the progress on the terminal while it waits.
+    void takeLoaded(size_t lines = 0, bool report = false) {
+        bool reported = false;
+        vector<DocumentLoader::Batch> batches;
+        while (loader) {
+            // Lines the file still has to supply for the document to reach `lines`
+            size_t wanted = 0;
+            if (lines == numeric_limits<size_t>::max()) wanted = lines;
+            else if (lines > document.size()) wanted = loadedLines + (lines - document.size());
+            bool last = loader->take(batches, wanted, chrono::milliseconds(wanted > 0 ? 200 : 0));
+            publish(batches);
+            if (last) {
+                fileHashes = loader->hashes();
+                saver.markSaved(baseVersion, {currentFilename, loader->file()->stamp(),
+                                              shared_ptr<const vector<uint64_t>>(fileHashes, &fileHashes->all())});
+                loader.reset();
+            } else if (document.size() >= lines) {
+                break;
+            } else if (report) {
+                output << "\r" << loadProgress() << flush;
+                reported = true;
+            }
+        }
+        if (reported) output << "\r\033[K" << flush;
+    }
+
+    // Stop the background load. The document keeps the lines read so far
+    // but no longer stands for the file, so a save cannot cut the file
+    // short. Returns what happened, or "" if nothing was loading.
+    string stopLoading() {
+        if (!loader) return "";
+        loader->cancel();
+        int percent = loader->percent();
+        takeLoaded();
+        if (!loader) return "";  // The last batch was already read
+        loader.reset();
+        string message = "Stopped loading " + currentFilename + " at " + to_string(percent) +
+                         "%. The document holds its first " + to_string(loadedLines) +
+                         " line(s) and is no longer tied to the file; saving asks for a new name.\n";
+        if (recoveryLog) {
+            // Edits of a partial copy must not be replayed onto the file
+            recoveryLog.reset();
+            remove(WriteAheadLog::pathFor(currentFilename).c_str());
+        }
+        currentFilename.clear();
+        fileHashes.reset();
+        saver.markSaved(0, DiskContents());
+        return message;
+    }
+
+public:
+    // Function to handle input safely (to avoid invalid entries)
+    int getIntInput(const string& prompt) {
+        int value;
+        while (true) {
+            output << prompt;
+            if (cin >> value) {
+                cin.ignore(numeric_limits<streamsize>::max(), '\n');  // clear input buffer
+                return value;
+            } else {
+                output << RED << "Invalid input. Please enter a valid number.\n" << RESET;
+                cin.clear();  // clear error flag
+                cin.ignore(numeric_limits<streamsize>::max(), '\n');  // discard invalid input
+            }
+        }
+    }
+
+    // Function to get string input safely
+    string getStringInput(const string& prompt) {
+        string input;
+        output << prompt;
+        getline(cin, input);
+        return input;
+    }
+
+    // How far the background load has got ("" when nothing is loading)
+    string loadProgress() const {
+        if (!loader) return "";
+        return "Loading " + currentFilename + ": " + to_string(loader->percent()) + "%, " +
+               to_string(loadedLines) + " lines so far";
+    }
+
+    // Publish what the loader has read, without waiting; the progress
+    // line for the menu
+    string loadStatus() {
+        takeLoaded();
+        return loadProgress();
+    }
+
+    // Wait until the whole file is in the document
+    void finishLoading() {
+        takeLoaded(numeric_limits<size_t>::max(), pager);
+    }
+
+    // 28. Stop loading the document, keeping the lines read so far
+    void cancelLoading() {
+        string message = stopLoading();
+        if (message.empty()) {
+            output << YELLOW << "Nothing is loading.\n" << RESET;
+        } else {
+            output << YELLOW << message << RESET;
+        }
+    }
+
+    // 1. Create a new document (reset the text)
+    void createNewDocument() {
+        EDITOR_STAT("createNewDocument", 0);
+        loader.reset();
+        document.clear();
+        documentBytes = 0;
+        loadedLines = 0;
+        journal.clear();
+        format.clear();
+        currentFilename = "";
+        fileHashes.reset();
+        recoveryLog.reset();
+        startVersion();
+        rebuildWordIndex();
+        output << GREEN << "New document created.\n" << RESET;
+    }
+
+    // 2. Load an existing document from a file. The lines are read on a
+    // background thread; this returns with the first batch in place, and
+    // the rest arrives while the document is in use.
+    void loadDocument(const string& filename, bool show = true) {
+        EDITOR_STAT("loadDocument", 0);
+        // A file that cannot be opened leaves the current document as it was
+        shared_ptr<MappedText> file = MappedText::open(filename);
+        if (file) {
+            EDITOR_STAT_BYTES(file->size());
+            loader.reset();  // Stop reading the previous file
+            recoveryLog.reset();  // Edits from here on do not belong to the old file
+            document.clear();
+            documentBytes = 0;
+            loadedLines = 0;
+            journal.clear();
+            format.clear();
+            currentFilename = filename;
+            fileHashes.reset();  // The loader hashes the lines as it reads them
+            startVersion({filename, file->stamp(), nullptr});
+            rebuildWordIndex();
+            loader.reset(new DocumentLoader(file));  // Lines are read straight from the mapped file
+            takeLoaded(1);
+            output << GREEN << "Document loaded successfully.\n" << RESET;
+            // Journal records are edits of the whole file, so they are replayed onto all of it
+            if (journaling && WriteAheadLog::hasRecords(filename)) finishLoading();
+            if (journaling) openRecoveryLog();
+            if (show) displayDocument();  // Show the content after loading
+        } else {
+            output << RED << "Failed to load document.\n" << RESET;
+        }
+    }
+
+    // 3. Save the current document to a file. If another program changed
+    // the file since it was loaded or saved, nothing is written unless
+    // `overwrite` is set.
+    DocumentSaver::Outcome saveDocument(bool overwrite = false) {
+        EDITOR_STAT("saveDocument", documentBytes);
+        finishLoading();
+        if (document.empty()) {
+            output << RED << "The document is empty. Add content before saving.\n" << RESET;
+            return DocumentSaver::FAILED; // Exit the function to prevent saving
+        }
+
+        if (currentFilename.empty()) {
+            currentFilename = getStringInput("Enter the filename to save as: ");
+        }
+
+        // The log restarts from the saved file, so that must be the stored lines
+        materializeFormat();
+        scheduledVersion = version;
+        SaveJob job = saveJob();
+        job.overwrite = overwrite;
+        DocumentSaver::Outcome outcome = saver.save(job);
+        if ((outcome == DocumentSaver::WRITTEN || outcome == DocumentSaver::UNCHANGED) && journaling && !recoveryLog) {
+            recoveryLog = WriteAheadLog::open(currentFilename);
+        }
+        if (outcome == DocumentSaver::UNCHANGED) {
+            output << GREEN << "No changes to save in " << currentFilename << ".\n" << RESET;
+        } else if (outcome == DocumentSaver::WRITTEN) {
+            output << GREEN << "Document saved successfully to " << currentFilename << ".\n" << RESET;
+        } else if (outcome == DocumentSaver::CONFLICT) {
+            output << YELLOW << currentFilename << " was changed by another program since it was loaded or saved, "
+                 << "so it was not overwritten. Use diff to compare.\n" << RESET;
+        } else {
+            output << RED << "Failed to save document. Please check the file path or permissions.\n" << RESET;
+        }
+        return outcome;
+    }
+
+    // Save under a new name
+    DocumentSaver::Outcome saveDocumentAs(const string& filename, bool overwrite = false) {
+        currentFilename = filename;
+        return saveDocument(overwrite);
+    }
+
+    const string& filename() const { return currentFilename; }
+
+    // Line ranges where the document differs from `onDisk` (the hashes of
+    // the file's lines). These are the only lines a save has to write.
+    vector<LineDiff::Hunk> changedLines(const vector<uint64_t>& onDisk) const {
+        return LineDiff::compare(onDisk, documentHashes());
+    }
+
+    // 27. Show how the document differs from its file on disk, as hunks of
+    // removed (-) and added (+) lines. The file is only read again if
+    // another program changed it since it was loaded or saved.
+    void showChanges() {
+        EDITOR_STAT("showChanges", documentBytes);
+        finishLoading();
+        if (currentFilename.empty()) {
+            output << YELLOW << "The document has no file to compare with yet.\n" << RESET;
+            return;
+        }
+        DiskContents disk = saver.diskContents();
+        FileStamp stamp = FileStamp::of(currentFilename);
+        shared_ptr<MappedText> file;
+        shared_ptr<const vector<uint64_t>> onDisk;
+        bool ours = disk.filename == currentFilename && disk.hashes;
+        if (!stamp.exists) {
+            output << YELLOW << currentFilename << " no longer exists on disk.\n" << RESET;
+            onDisk = make_shared<const vector<uint64_t>>();
+        } else if (ours && stamp == disk.stamp) {
+            onDisk = disk.hashes;
+        } else {
+            file = MappedText::open(currentFilename);
+            if (!file) {
+                output << RED << "Cannot read " << currentFilename << ".\n" << RESET;
+                return;
+            }
+            shared_ptr<const FileLineHashes> table = FileLineHashes::build(file);
+            onDisk = shared_ptr<const vector<uint64_t>>(table, &table->all());
+            if (ours && *onDisk != *disk.hashes) {
+                output << YELLOW << currentFilename << " was changed by another program since it was loaded or saved.\n"
+                     << RESET;
+            }
+        }
+
+        vector<LineDiff::Hunk> hunks = changedLines(*onDisk);
+        if (hunks.empty()) {
+            output << GREEN << "No changes: the document matches " << currentFilename << ".\n" << RESET;
+            return;
+        }
+        // Removed lines are read from the file: if it is still the one that
+        // was loaded, the hash table finds each hunk; otherwise hunks come in
+        // file order, so they are found in one forward pass
+        const FileLineHashes* loaded = nullptr;
+        if (!file && fileHashes && fileHashes->file().stamp() == stamp) loaded = fileHashes.get();
+        if (!file && !loaded && stamp.exists) file = MappedText::open(currentFilename);
+        const MappedText* source = loaded ? &loaded->file() : file.get();
+        const char* at = source ? source->data() : nullptr;
+        const char* end = source ? source->data() + source->size() : nullptr;
+        size_t atLine = 0, removed = 0, added = 0;
+        auto nextLine = [&](string_view& line) {
+            const char* newline = static_cast<const char*>(memchr(at, '\n', end - at));
+            const char* stop = newline ? newline : end;
+            line = string_view(at, stop - at);
+            at = newline ? newline + 1 : end;
+            atLine++;
+        };
+        auto range = [](size_t from, size_t to) {
+            size_t count = to - from;
+            string text = to_string(count > 0 ? from + 1 : from);
+            if (count != 1) text += "," + to_string(count);
+            return text;
+        };
+        for (const auto& hunk : hunks) {
+            output << CYAN << "@@ -" << range(hunk.oldBegin, hunk.oldEnd) << " +" << range(hunk.newBegin, hunk.newEnd)
+                 << " @@\n" << RESET;
+            string_view line;
+            if (loaded && hunk.oldBegin > atLine) {
+                at = source->data() + loaded->offsetOf(hunk.oldBegin);
+                atLine = hunk.oldBegin;
+            }
+            while (at && at < end && atLine < hunk.oldBegin) nextLine(line);
+            while (at && at < end && atLine < hunk.oldEnd) {
+                nextLine(line);
+                output << RED << "-" << line << RESET << '\n';
+            }
+            forEachVisible(hunk.newBegin, hunk.newEnd, [this](size_t, string_view text) {
+                output << GREEN << "+" << text << RESET << '\n';
+            });
+            removed += hunk.oldEnd - hunk.oldBegin;
+            added += hunk.newEnd - hunk.newBegin;
+        }
+        output << hunks.size() << " hunk(s): " << removed << " line(s) removed, " << added << " added.\n";
+        output.flush();
+    }
+
+    // 4. Display the document: in the viewer on a terminal, otherwise as one
+    // buffered stream of numbered lines (flushed once, not per line). Lines
+    // still loading are printed batch by batch as they arrive.
+    void displayDocument() {
+        EDITOR_STAT("displayDocument", documentBytes);
+        takeLoaded(1);
+        if (document.empty()) {
+            output << YELLOW << "The document is empty.\n" << RESET;
+            return;
+        }
+        if (pager) {
+            viewDocument();
+            return;
+        }
+        for (size_t from = 0; from < document.size() || loader;) {
+            takeLoaded(from + 1);
+            size_t to = document.size();
+            forEachVisible(from, to, [this](size_t index, string_view line) {
+                output << CYAN << index + 1 << ": " << RESET << line << '\n';
+            });
+            from = to;
+        }
+        output.flush();
+    }
+
+    // Page through the document; only the visible lines are ever fetched,
+    // and while the file loads the viewer waits only for the page it shows
+    void viewDocument() {
+        string stopped;
+        {
+            Terminal terminal;
+            DocumentViewer viewer(terminal, [this](size_t wanted) {
+                takeLoaded(wanted);
+                return document.size();
+            }, [this](size_t from, size_t to, const function<void(size_t, string_view)>& f) {
+                forEachVisible(from, to, f);
+            }, [this] {
+                return loader ? "loading " + to_string(loader->percent()) + "%" : string();
+            }, [this, &stopped] {
+                stopped = stopLoading();
+            });
+            viewer.run();
+        }
+        if (!stopped.empty()) output << YELLOW << stopped << RESET;
+    }
+
+    // Use the viewer for displayDocument (interactive sessions only)
+    void setPager(bool on) {
+        pager = on;
+    }
+
+    // Without the journal, loading ignores any journal left for the file
+    // and edits are not logged, so a run that never saves leaves nothing behind
+    void setJournaling(bool on) {
+        journaling = on;
+        if (!on) recoveryLog.reset();
+    }
+
+    // Write messages and results to `buffer` instead of standard output
+    void setOutput(streambuf* buffer) {
+        output.rdbuf(buffer);
+    }
+
+    // 5. Add a new line 
+    void addLine(const string& text) {
+        EDITOR_STAT("addLine", text.size());
+        finishLoading();
+        beginEdit("add");
+        insertLine(document.size(), text);
+        commitEdit();
+    }
+
+    // 6. Remove 
+    void removeLine() {
+        EDITOR_STAT("removeLine", 0);
+        finishLoading();
+        if (!document.empty()) {
+            beginEdit("remove");
+            eraseLine(document.size() - 1);
+            commitEdit();
+        } else {
+            output << RED << "No line to remove.\n" << RESET;
+        }
+    }
+
+    // 7. Undo 
+    void undo() {
+        EDITOR_STAT("undo", 0);
+        const EditCommand* command = journal.undo();
+        if (command) {
+            revert(*command);
+            logCommand();
+            version++;
+        } else {
+            output << RED << "Nothing to undo.\n" << RESET;
+        }
+    }
+
+    // 8. Redo 
+    void redo() {
+        EDITOR_STAT("redo", 0);
+        const EditCommand* command = journal.redo();
+        if (command) {
+            reapply(*command);
+            logCommand();
+            version++;
+        } else {
+            output << RED << "Nothing to redo.\n" << RESET;
+        }
+    }
+
+    // Cap the memory used by undo history (oldest steps are dropped first)
+    void setUndoMemoryLimit(size_t bytes) {
+        journal.setMemoryLimit(bytes);
+    }
+
+    // Merge quick runs of small edits into one undo step (the menu does;
+    // scripts and server requests undo one command at a time)
+    void setUndoCoalescing(bool on) {
+        journal.setCoalescing(on);
+    }
+
+    // Share one copy of identical edited lines
+    void setLineInterning(bool on) {
+        document.setInterning(on);
+    }
+
+    // Compress edited lines beyond the `lines` most recently edited ones;
+    // 0 turns compression off
+    void setColdStorage(size_t lines) {
+        document.setHotLimit(lines);
+    }
+
+    // Autosave every `seconds` or after `edits` edits, whichever comes
+    // first; 0 seconds turns it off
+    void setAutosave(unsigned seconds, size_t edits) {
+        saver.configure(seconds, edits);
+    }
+
+    // Called between commands: give the autosave worker a snapshot if the
+    // document changed since the last one. Never waits for a write.
+    void scheduleAutosave() {
+        // Pending formatting waits for the next line edit to be written into
+        // the lines (the log already has it)
+        if (version == scheduledVersion || currentFilename.empty() || document.empty() || !format.empty() ||
+            loader || !saver.autosaving()) return;
+        scheduledVersion = version;
+        saver.schedule(unique_ptr<SaveJob>(new SaveJob(saveJob())));
+    }
+
+    // True when the document has edits that are not on disk yet
+    bool hasUnsavedChanges() const {
+        return version > saver.current().savedVersion;
+    }
+
+    // One line for the menu: autosave settings and how the last save went
+    string saveStatus() const {
+        DocumentSaver::Status status = saver.current();
+        string line = saver.autosaving() ? "Autosave: every " + to_string(saver.intervalSeconds()) + " s or " +
+                                               to_string(saver.edits()) + " edits"
+                                         : string("Autosave: off");
+        if (status.saving) {
+            line += ", saving...";
+        } else if (status.lastFailed) {
+            line += ", last save failed";
+        } else if (status.lastConflict) {
+            line += ", file changed on disk (not saved)";
+        } else {
+            line += version > status.savedVersion ? ", unsaved changes" : ", all changes saved";
+        }
+        if (status.lastAt) {
+            char last[64];
+            strftime(last, sizeof(last), "%H:%M:%S", localtime(&status.lastAt));
+            snprintf(last + strlen(last), sizeof(last) - strlen(last), " in %.1f ms", status.lastMs);
+            line += " (last save ";
+            line += last;
+            line += ")";
+        }
+        return line;
+    }
+
+
+    // 9. Search for a word in the document
+    void searchWord(const string& word) {
+        EDITOR_STAT("searchWord", documentBytes);
+        finishLoading();
+        if (word.empty()) {
+            output << RED << "Enter a word to search for.\n" << RESET;
+            return;
+        }
+        vector<SearchHit> hits = findAll(word);
+
+        // Hits come sorted by line, so print each line once with its columns
+        for (size_t i = 0; i < hits.size();) {
+            size_t line = hits[i].line;
+            output << CYAN << "Found at line " << line + 1 << " (column";
+            for (; i < hits.size() && hits[i].line == line; i++) output << " " << hits[i].column + 1;
+            output << "): " << RESET << visibleLine(line) << endl;
+        }
+
+        if (hits.empty()) {
+            output << RED << "Word not found in the document.\n" << RESET;
+        }
+    }
+
+    // Count every word of the document into a Counter (WordCounter or
+    // WordSketch) per part, then merge the parts pairwise, in parallel,
+    // until one is left
+    template <class Counter, class... Args>
+    Counter countAllWords(Args... args) const {
+        vector<Counter> parts;
+        for (size_t i = 0; i <= ThreadPool::shared().size(); i++) parts.emplace_back(args...);
+        size_t used = ThreadPool::shared().parallelFor(document.size(), 16384, [&](size_t part, size_t begin, size_t end) {
+            forEachVisible(begin, end, [&](size_t, string_view line) {
+                forEachWord(line, [&](string_view word) { parts[part].add(word); });
+            });
+        });
+        for (size_t step = 1; step < used; step *= 2) {
+            size_t pairs = (used - step + 2 * step - 1) / (2 * step);
+            ThreadPool::shared().parallelFor(pairs, 1, [&](size_t, size_t begin, size_t end) {
+                for (size_t pair = begin; pair < end; pair++) {
+                    size_t into = pair * 2 * step;
+                    parts[into].merge(move(parts[into + step]));
+                }
+            });
+        }
+        return move(parts[0]);
+    }
+
+    template <class Counter>
+    void reportFrequencies(const Counter& counts, size_t k, const vector<string>& words, bool estimated) {
+        uint64_t total = counts.total();
+        output << CYAN << total << " word(s), " << (estimated ? "about " : "") << counts.vocabulary() << " distinct.\n" << RESET;
+        vector<pair<string_view, uint64_t>> top = counts.top(k);
+        if (!top.empty()) output << CYAN << "Top " << top.size() << ":\n" << RESET;
+        for (size_t i = 0; i < top.size(); i++) {
+            char row[64];
+            snprintf(row, sizeof(row), "%4zu. %10llu %6.2f%%  ", i + 1, (unsigned long long)top[i].second,
+                     100.0 * top[i].second / max<uint64_t>(1, total));
+            output << row << top[i].first << '\n';
+        }
+        for (const string& word : words) {
+            uint64_t count = counts.count(word);
+            if (count > 0) {
+                output << CYAN << "The word \"" << word << "\" appears " << (estimated ? "at most " : "") << RESET << count << " times.\n";
+            } else {
+                output << RED << "The word \"" << word << "\" does not appear in the document.\n" << RESET;
+            }
+        }
+    }
+
+    // Every occurrence of `word`, sorted by line and column. Line ranges
+    // are scanned in parallel straight from document storage.
+    vector<SearchHit> findAll(string_view word) const {
+        vector<vector<SearchHit>> partHits(ThreadPool::shared().size() + 1);
+        ThreadPool::shared().parallelFor(document.size(), 16384, [&](size_t part, size_t begin, size_t end) {
+            forEachVisible(begin, end, [&](size_t index, string_view line) {
+                for (size_t pos = SearchKernel::find(line, word); pos != string_view::npos;
+                     pos = SearchKernel::find(line, word, pos + 1)) {
+                    partHits[part].push_back({index, pos});
+                }
+            });
+        });
+        vector<SearchHit> hits;
+        for (auto& part : partHits) hits.insert(hits.end(), part.begin(), part.end());
+        return hits;
+    }
+    
+   
+    // 26. Find every place within `maxEdits` edits of `word`, closest
+    // matches first. Line ranges are scanned in parallel like findAll.
+    void fuzzySearch(const string& word, int maxEdits) {
+        EDITOR_STAT("fuzzySearch", documentBytes);
+        finishLoading();
+        if (word.empty() || word.size() > FuzzyMatcher::MAX_WORD) {
+            output << RED << "Enter a word of 1 to " << FuzzyMatcher::MAX_WORD << " bytes.\n" << RESET;
+            return;
+        }
+        if (maxEdits < 0 || (size_t)maxEdits >= word.size()) {
+            output << RED << "Allow between 0 and " << word.size() - 1 << " edits for this word.\n" << RESET;
+            return;
+        }
+
+        struct FuzzyHit {
+            size_t line, column, length;
+            unsigned distance;
+        };
+        FuzzyMatcher matcher(word, (unsigned)maxEdits);
+        vector<vector<FuzzyHit>> partHits(ThreadPool::shared().size() + 1);
+        ThreadPool::shared().parallelFor(document.size(), 16384, [&](size_t part, size_t begin, size_t end) {
+            forEachVisible(begin, end, [&](size_t index, string_view line) {
+                matcher.forEachMatch(line, [&](const FuzzyMatcher::Match& match) {
+                    partHits[part].push_back({index, match.start, match.end - match.start, match.distance});
+                });
+            });
+        });
+        vector<FuzzyHit> hits;
+        for (auto& part : partHits) hits.insert(hits.end(), part.begin(), part.end());
+        if (hits.empty()) {
+            output << RED << "No match within " << maxEdits << " edit(s).\n" << RESET;
+            return;
+        }
+
+        // Parts come in line order, so a stable sort keeps lines in order
+        // within each distance
+        stable_sort(hits.begin(), hits.end(), [](const FuzzyHit& a, const FuzzyHit& b) { return a.distance < b.distance; });
+        vector<size_t> perDistance(maxEdits + 1);
+        for (const auto& hit : hits) {
+            string line = visibleLine(hit.line);
+            output << CYAN << "Found \"" << line.substr(hit.column, hit.length) << "\" at line " << hit.line + 1
+                 << " (column " << hit.column + 1 << "), " << hit.distance << " edit(s): " << RESET << line << '\n';
+            perDistance[hit.distance]++;
+        }
+        output << GREEN << hits.size() << " match(es):";
+        for (int d = 0; d <= maxEdits; d++) output << " " << perDistance[d] << " with " << d << " edit(s)" << (d < maxEdits ? "," : "");
+        output << "\n" << RESET;
+        output.flush();
+    }
+
+    //10. Replace word
+    void replaceWord(const string& oldWord, const string& newWord) {
+        EDITOR_STAT("replaceWord", documentBytes);
+        replaceWords({{oldWord, newWord}});
+    }
+
+    // Replace every old word of the table with its new word in one pass
+    void replaceWords(const vector<pair<string, string>>& table) {
+        EDITOR_STAT("replaceWords", documentBytes);
+        finishLoading();
+        ReplaceEngine engine(table);
+        if (engine.empty()) {
+            output << RED << "Nothing to replace.\n" << RESET;
+            return;
+        }
+
+        size_t replaced = 0, changedLines = 0;
+        beginEdit("replaceWord");
+        rewriteLines([&](size_t, string_view line, string& out) {
+            size_t count = engine.apply(line, out);
+            replaced += count;
+            changedLines += count > 0;
+            return count > 0;
+        });
+        commitEdit();
+        output << GREEN << "Replaced " << replaced << " occurrence(s) in " << changedLines << " line(s).\n" << RESET;
+    }
+
+    // 24. Search with a regular expression. Lines are printed as soon as
+    // they match, so the first hit shows up before the scan is done.
+    void regexSearch(const string& pattern) {
+        EDITOR_STAT("regexSearch", documentBytes);
+        finishLoading();
+        Regex regex(pattern);
+        if (!regex.valid()) {
+            output << RED << "Invalid pattern: " << regex.error() << ".\n" << RESET;
+            return;
+        }
+        size_t lines = 0;
+        forEachVisible(0, document.size(), [&](size_t index, string_view line) {
+            bool found = false;
+            regex.forEachMatch(line, [&](size_t start, size_t) {
+                if (!found) output << CYAN << "Found at line " << index + 1 << " (column";
+                output << " " << start + 1;
+                found = true;
+            });
+            if (!found) return;
+            output << "): " << RESET << line << '\n';
+            if (lines++ == 0) output.flush();
+        });
+        output.flush();
+        if (lines == 0) {
+            output << RED << "No match in the document.\n" << RESET;
+        }
+    }
+
+    // 25. Replace every match of a regular expression; $1-$9, ${n} and $&
+    // in the replacement insert capture groups and the whole match
+    void regexReplace(const string& pattern, const string& replacement) {
+        EDITOR_STAT("regexReplace", documentBytes);
+        finishLoading();
+        Regex regex(pattern);
+        if (!regex.valid()) {
+            output << RED << "Invalid pattern: " << regex.error() << ".\n" << RESET;
+            return;
+        }
+        Regex::Replacement parsed = Regex::parseReplacement(replacement);
+        if (parsed.highestGroup > regex.groupCount()) {
+            output << RED << "The replacement uses group " << parsed.highestGroup << " but the pattern has "
+                 << regex.groupCount() << ".\n" << RESET;
+            return;
+        }
+
+        size_t replaced = 0, changedLines = 0;
+        beginEdit("regexReplace");
+        rewriteLines([&](size_t, string_view line, string& out) {
+            size_t count = regex.replace(line, parsed, out);
+            replaced += count;
+            changedLines += count > 0;
+            return count > 0;
+        });
+        commitEdit();
+        output << GREEN << "Replaced " << replaced << " match(es) in " << changedLines << " line(s).\n" << RESET;
+    }
+
+    // Load "old<TAB>new" pairs from a file, one per line; a file that
+    // cannot be opened is reported on `messages`
+    static bool loadReplaceTable(const string& filename, vector<pair<string, string>>& table, ostream& messages) {
+        ifstream file(filename);
+        if (!file.is_open()) {
+            messages << RED << "Failed to open replace table.\n" << RESET;
+            return false;
+        }
+        string line;
+        while (getline(file, line)) {
+            size_t tab = line.find('\t');
+            if (tab != string::npos) {
+                table.push_back({line.substr(0, tab), line.substr(tab + 1)});
+            }
+        }
+        return true;
+    }
+
+    // 20. Replace words from an "old<TAB>new" table file
+    void replaceFromTable(const string& filename) {
+        vector<pair<string, string>> table;
+        if (loadReplaceTable(filename, table, output)) replaceWords(table);
+    }
+
+    // 11. Insert text at a specific line number
+    void insertAtLine(int lineNumber, const string& text) {
+        EDITOR_STAT("insertAtLine", text.size());
+        if (lineNumber > 0) takeLoaded(lineNumber, pager);  // Wait only for lines up to this one
+        if (lineNumber < 1 || lineNumber > (int)document.size() + 1) {
+            output << RED << "Invalid line number.\n" << RESET;
+            return;
+        }
+
+        beginEdit("insertAtLine");
+        insertLine(lineNumber - 1, text);
+        commitEdit();
+    }
+
+    // 12. Delete a specific line by number
+    void deleteLineByNumber(int lineNumber) {
+        EDITOR_STAT("deleteLineByNumber", 0);
+        if (lineNumber > 0) takeLoaded(lineNumber, pager);
+        if (lineNumber < 1 || lineNumber > (int)document.size()) {
+            output << RED << "Invalid line number.\n" << RESET;
+            return;
+        }
+
+        beginEdit("deleteLineByNumber");
+        eraseLine(lineNumber - 1);
+        commitEdit();
+    }
+
+    // 13. Change content of a specific line
+    void changeLine(int lineNumber, const string& newContent) {
+        EDITOR_STAT("changeLine", newContent.size());
+        if (lineNumber > 0) takeLoaded(lineNumber, pager);
+        if (lineNumber < 1 || lineNumber > (int)document.size()) {
+            output << RED << "Invalid line number.\n" << RESET;
+            return;
+        }
+
+        beginEdit("changeLine");
+        setLine(lineNumber - 1, newContent);
+        commitEdit();
+    }
+
+    // 14. Count total lines in the document
+    void countLines() {
+        EDITOR_STAT("countLines", 0);
+        finishLoading();
+        output << CYAN << "Total lines in the document: " << RESET << document.size() << endl;
+    }
+
+    // 15. Count occurrences of a word in the document using a hash table
+    void countWordOccurrences(const string& word) {
+        EDITOR_STAT("countWordOccurrences", wordIndex ? 0 : documentBytes);
+        finishLoading();
+        if (wordIndex && format.empty()) {  // The index only knows the stored text
+            size_t count = wordIndex->count(word);
+            if (count > 0) {
+                output << CYAN << "The word \"" << word << "\" appears " << RESET << count << " times.\n";
+            } else {
+                output << RED << "The word \"" << word << "\" does not appear in the document.\n" << RESET;
+            }
+            return;
+        }
+
+        // One word needs no table: compare every token, in parallel
+        vector<size_t> partCounts(ThreadPool::shared().size() + 1);
+        ThreadPool::shared().parallelFor(document.size(), 16384, [&](size_t part, size_t begin, size_t end) {
+            size_t found = 0;
+            forEachVisible(begin, end, [&](size_t, string_view line) {
+                forEachWord(line, [&](string_view currentWord) { found += currentWord == word; });
+            });
+            partCounts[part] = found;
+        });
+        size_t count = 0;
+        for (size_t found : partCounts) count += found;
+
+        // Display the occurrence of the given word
+        if (count > 0) {
+            output << CYAN << "The word \"" << word << "\" appears " << RESET << count << " times.\n";
+        } else {
+            output << RED << "The word \"" << word << "\" does not appear in the document.\n" << RESET;
+        }
+    }
+
+    // 29. Word frequencies in one pass: the `k` most frequent words, the
+    // vocabulary size and the count of every word in `words`. With `sketch`
+    // the counts come from a WordSketch, whose memory stays fixed however
+    // large the vocabulary, and are estimates.
+    void wordFrequencies(size_t k, const vector<string>& words, bool sketch) {
+        EDITOR_STAT("wordFrequencies", documentBytes);
+        finishLoading();
+        if (sketch) {
+            WordSketch counts = countAllWords<WordSketch>(max<size_t>(256, 4 * k));
+            reportFrequencies(counts, k, words, true);
+            output << "Counts are estimates: never low, and at most " << counts.errorBound()
+                   << " high with 98% confidence. Sketch memory: " << counts.memoryUsage() / 1024 << " KB.\n";
+        } else {
+            WordCounter counts = countAllWords<WordCounter>();
+            reportFrequencies(counts, k, words, false);
+            output << "Table memory: " << counts.memoryUsage() / 1024 << " KB.\n";
+        }
+        output.flush();
+    }
+
+    // 16. Bold the entire document (simulated by wrapping text with **).
+    // Formatting is a lazy view until the next line edit writes it into the lines.
+    void boldText() {
+        EDITOR_STAT("boldText", 0);
+        pushFormat("boldText", {FormatStep::WRAP, "**", "**"});
+    }
+
+    // 17. Italicize the entire document (simulated by wrapping text with _)
+    void italicizeText() {
+        EDITOR_STAT("italicizeText", 0);
+        pushFormat("italicizeText", {FormatStep::WRAP, "_", "_"});
+    }
+
+    // 18. Convert the document to lowercase
+    void convertToLowerCase() {
+        EDITOR_STAT("convertToLowerCase", 0);
+        pushFormat("convertToLowerCase", {FormatStep::LOWERCASE, "", ""});
+    }
+
+    // 19. Convert the document to uppercase
+    void convertToUpperCase() {
+        EDITOR_STAT("convertToUpperCase", 0);
+        pushFormat("convertToUpperCase", {FormatStep::UPPERCASE, "", ""});
+    }
+
+    // 21. Search for lines containing a whole word (uses the word index when enabled)
+    void searchWholeWord(const string& word) {
+        EDITOR_STAT("searchWholeWord", wordIndex ? 0 : documentBytes);
+        finishLoading();
+        vector<size_t> lines;
+        if (wordIndex && format.empty()) {
+            lines = wordIndex->linesWith(word);
+        } else {
+            forEachVisible(0, document.size(), [&](size_t index, string_view line) {
+                bool found = false;
+                forEachWord(line, [&](string_view w) { found |= w == word; });
+                if (found) lines.push_back(index);
+            });
+        }
+        for (size_t line : lines) {
+            output << CYAN << "Found at line " << line + 1 << ": " << RESET << visibleLine(line) << endl;
+        }
+        if (lines.empty()) {
+            output << RED << "Word not found in the document.\n" << RESET;
+        }
+    }
+
+    // Heap used by the document storage, the undo history and the word index
+    size_t storageBytes() const {
+        return document.memoryUsage() + journal.memoryUsed();
+    }
+
+    // Statistics of every operation plus document totals, as a table or as JSON
+    void writeStats(ostream& out, bool json) const {
+        vector<OperationStats> operations = EditorStats::instance().all();
+        size_t heap = document.memoryUsage(), history = journal.memoryUsed();
+        size_t bytes = documentBytes + document.size() * (format.prefixSize() + format.suffixSize());
+        DocumentSaver::Status saves = saver.current();
+        ColdStorageStats cold = document.coldStats();
+        char row[256];
+        if (!json) {
+            out << CYAN << "operation               calls     bytes    p50 us    p99 us    max us\n" << RESET;
+            for (const auto& op : operations) {
+                if (op.calls == 0) continue;
+                snprintf(row, sizeof(row), "%-20s %8llu %9llu %9.1f %9.1f %9.1f\n", op.name.c_str(),
+                         (unsigned long long)op.calls, (unsigned long long)op.bytes,
+                         op.latencyNs.percentile(50) / 1000.0, op.latencyNs.percentile(99) / 1000.0,
+                         op.latencyNs.maximum() / 1000.0);
+                out << row;
+            }
+            out << CYAN << "Document: " << RESET << document.size() << " lines, " << bytes << " bytes, "
+                << heap << " bytes of storage in " << document.slabCount() << " slabs"
+                << (document.interning() ? " (interned)" : "") << ", " << history << " bytes of undo history\n";
+            snprintf(row, sizeof(row), "%zu saves (%zu automatic), %zu failed, %zu refused (file changed on disk), "
+                     "last %.1f ms, max %.1f ms\n", saves.saves, saves.autosaves, saves.failures, saves.conflicts,
+                     saves.lastMs, saves.maxMs);
+            out << CYAN << "Saves: " << RESET << row;
+            if (loader) {
+                out << CYAN << "Loading: " << RESET << loader->percent() << "% of " << currentFilename << " read, "
+                    << loadedLines << " lines published\n";
+            }
+            if (cold.blocks > 0) {
+                snprintf(row, sizeof(row), "%zu lines in %zu blocks, %zu -> %zu bytes (%.1fx), cache hit rate %.1f%% "
+                         "(%zu hits, %zu misses)\n", cold.lines, cold.blocks, cold.rawBytes, cold.compressedBytes,
+                         cold.ratio(), cold.hitRate() * 100, cold.cacheHits, cold.cacheMisses);
+                out << CYAN << "Compressed: " << RESET << row;
+            }
+            if (recoveryLog) {
+                out << CYAN << "Journal: " << RESET << recoveryLog->size() << " bytes since the last save, "
+                    << recoveryLog->syncCount() << " fsyncs" << (recoveryLog->healthy() ? "" : " (write failed)") << "\n";
+            }
+            return;
+        }
+        out << "{\"document\":{\"lines\":" << document.size() << ",\"bytes\":" << bytes
+            << ",\"storage_heap_bytes\":" << heap << ",\"storage_slabs\":" << document.slabCount()
+            << ",\"interning\":" << (document.interning() ? "true" : "false") << ",\"undo_bytes\":" << history << "},";
+        snprintf(row, sizeof(row), "\"saves\":{\"autosave\":%s,\"saves\":%zu,\"autosaves\":%zu,\"failures\":%zu,"
+                 "\"conflicts\":%zu,\"last_ms\":%.3f,\"max_ms\":%.3f},", saver.autosaving() ? "true" : "false",
+                 saves.saves, saves.autosaves, saves.failures, saves.conflicts, saves.lastMs, saves.maxMs);
+        out << row;
+        snprintf(row, sizeof(row), "\"compression\":{\"hot_line_limit\":%zu,\"blocks\":%zu,\"lines\":%zu,"
+                 "\"raw_bytes\":%zu,\"compressed_bytes\":%zu,\"ratio\":%.3f,\"cached_blocks\":%zu,"
+                 "\"cache_hits\":%zu,\"cache_misses\":%zu,\"hit_rate\":%.4f},", cold.hotLimit, cold.blocks,
+                 cold.lines, cold.rawBytes, cold.compressedBytes, cold.ratio(), cold.cachedBlocks, cold.cacheHits,
+                 cold.cacheMisses, cold.hitRate());
+        out << row;
+        if (loader) out << "\"loading\":{\"percent\":" << loader->percent() << ",\"lines\":" << loadedLines << "},";
+        if (recoveryLog) {
+            out << "\"journal\":{\"bytes\":" << recoveryLog->size() << ",\"fsyncs\":" << recoveryLog->syncCount()
+                << ",\"healthy\":" << (recoveryLog->healthy() ? "true" : "false") << "},";
+        }
+        out << "\"operations\":[";
+        bool first = true;
+        for (const auto& op : operations) {
+            if (op.calls == 0) continue;
+            const LatencyHistogram& h = op.latencyNs;
+            snprintf(row, sizeof(row),
+                     "%s{\"name\":\"%s\",\"calls\":%llu,\"bytes\":%llu,\"mean_ns\":%.0f,\"p50_ns\":%llu,"
+                     "\"p90_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu}",
+                     first ? "" : ",", op.name.c_str(), (unsigned long long)op.calls, (unsigned long long)op.bytes,
+                     h.mean(), (unsigned long long)h.percentile(50), (unsigned long long)h.percentile(90),
+                     (unsigned long long)h.percentile(99), (unsigned long long)h.percentile(99.9),
+                     (unsigned long long)h.maximum());
+            out << row;
+            first = false;
+        }
+        out << "]}\n";
+    }
+
+    // 23. Show per-operation statistics
+    void showStats() {
+#ifdef TEXT_EDITOR_NO_STATS
+        output << YELLOW << "Statistics are disabled in this build.\n" << RESET;
+#else
+        writeStats(output, false);
+#endif
+    }
+
+    // Write JSON statistics to $EDITOR_STATS when it is set
+    void dumpStats() const {
+        const char* path = getenv("EDITOR_STATS");
+        if (!path || !*path) return;
+        ofstream out(path, ios::trunc);
+        if (out.is_open()) writeStats(out, true);
+    }
+
+    // Called at safe points to honour a SIGUSR1 dump request
+    void dumpStatsIfRequested() const {
+        if (!statsDumpRequested) return;
+        statsDumpRequested = 0;
+        dumpStats();
+    }
+
+    // 22. Turn the persistent word index on or off
+    void toggleWordIndex() {
+        EDITOR_STAT("toggleWordIndex", documentBytes);
+        if (wordIndex) {
+            wordIndex.reset();
+            output << YELLOW << "Word index disabled.\n" << RESET;
+        } else {
+            wordIndex.reset(new WordIndex);
+            rebuildWordIndex();
+            output << GREEN << "Word index enabled.\n" << RESET;
+        }
+    }
+};
+
+
+
+// Editing menu shared by new and loaded documents
+void editingMenu(TextEditor& editor) {
+    bool editing = true;
+    while (editing) {
+        cout << YELLOW << "====================================\n";
+        cout << "          EDITING MENU\n";
+        cout << "====================================\n";
+        cout << editor.saveStatus() << "\n";
+        string loading = editor.loadStatus();
+        if (!loading.empty()) cout << loading << "\n";
+        cout << "1. Add Line\n";
+        cout << "2. Remove Line\n";
+        cout << "3. Undo\n";
+        cout << "4. Redo\n";
+        cout << "5. Display Document\n";
+        cout << "6. Save Document\n";
+        cout << "7. Search Word\n";
+        cout << "8. Replace Word\n";
+        cout << "9. Insert at Line\n";
+        cout << "10. Delete Line by Number\n";
+        cout << "11. Change Line Content\n";
+        cout << "12. Count Lines\n";
+        cout << "13. Count Word Occurrences\n";
+        cout << "14. Bold Text\n";
+        cout << "15. Italicize Text\n";
+        cout << "16. Convert to Lowercase\n";
+        cout << "17. Convert to Uppercase\n";
+        cout << "18. Replace Words From Table\n";
+        cout << "19. Search Whole Word\n";
+        cout << "20. Toggle Word Index\n";
+        cout << "21. Show Statistics\n";
+        cout << "22. Regex Search\n";
+        cout << "23. Regex Replace\n";
+        cout << "24. Autosave Settings\n";
+        cout << "25. Fuzzy Search\n";
+        cout << "26. Show Changes\n";
+        cout << "27. Stop Loading\n";
+        cout << "28. Word Frequencies\n";
+        cout << "29. Exit\n";
+        cout << YELLOW << "====================================\n" << RESET;
+        int action = editor.getIntInput("Enter your choice: ");
+        clearScreen() ; 
+        switch (action) {
+            case 1: {
+                string text = editor.getStringInput("Enter line to add: ");
+                editor.addLine(text);
+                
+                break;
+                
+            }
+            case 2:
+                editor.removeLine();
+                
+                break;
+            case 3:
+                editor.undo();
+                
+                break;
+            case 4:
+                editor.redo();
+              
+                break;
+            case 5:
+                editor.displayDocument();
+                
+                break;
+            case 6:
+                if (editor.saveDocument() == DocumentSaver::CONFLICT &&
+                    editor.getStringInput("Overwrite it anyway? (y/n): ") == "y") {
+                    editor.saveDocument(true);
+                }
+                break;
+            case 7: {
+                string word = editor.getStringInput("Enter word to search: ");
+                editor.searchWord(word);
+                
+                break;
+            }
+            case 8: {
+                string oldWord = editor.getStringInput("Enter word to replace: ");
+                string newWord = editor.getStringInput("Enter new word: ");
+                editor.replaceWord(oldWord, newWord);
+                
+                break;
+            }
+           
+            case 9: {
+                int lineNumber = editor.getIntInput("Enter line number to insert at: ");
+                string text = editor.getStringInput("Enter text to insert: ");
+                editor.insertAtLine(lineNumber, text);
+                
+                break;
+            }
+            case 10: {
+                int lineNumber = editor.getIntInput("Enter line number to delete: ");
+                editor.deleteLineByNumber(lineNumber);
+               
+                break;
+            }
+            case 11: {
+                int lineNumber = editor.getIntInput("Enter line number to change: ");
+                string newText = editor.getStringInput("Enter new content: ");
+                editor.changeLine(lineNumber, newText);
+                
+                break;
+            }
+            case 12:
+                editor.countLines();
+               
+                break;
+            case 13: {
+                string word = editor.getStringInput("Enter word to count: ");
+                editor.countWordOccurrences(word);
+               
+                break;
+            }
+            case 14:
+                editor.boldText();
+                
+                break;
+            case 15:
+                editor.italicizeText();
+               
+                break;
+            case 16:
+                editor.convertToLowerCase();
+               
+                break;
+            case 17:
+                editor.convertToUpperCase();
+                
+                break;
+            case 18: {
+                string filename = editor.getStringInput("Enter replace table file (old<TAB>new per line): ");
+                editor.replaceFromTable(filename);
+                break;
+            }
+            case 19: {
+                string word = editor.getStringInput("Enter whole word to search: ");
+                editor.searchWholeWord(word);
+                break;
+            }
+            case 20:
+                editor.toggleWordIndex();
+                break;
+            case 21:
+                editor.showStats();
+                break;
+            case 22: {
+                string pattern = editor.getStringInput("Enter regular expression: ");
+                editor.regexSearch(pattern);
+                break;
+            }
+            case 23: {
+                string pattern = editor.getStringInput("Enter regular expression: ");
+                string replacement = editor.getStringInput("Enter replacement ($1-$9 for groups): ");
+                editor.regexReplace(pattern, replacement);
+                break;
+            }
+            case 24: {
+                int seconds = editor.getIntInput("Autosave interval in seconds (0 turns it off): ");
+                int edits = seconds > 0 ? editor.getIntInput("Also save after how many edits: ") : 1;
+                if (seconds < 0 || edits < 1) {
+                    cout << RED << "Invalid autosave settings.\n" << RESET;
+                    break;
+                }
+                editor.setAutosave((unsigned)seconds, (size_t)edits);
+                cout << GREEN << editor.saveStatus() << "\n" << RESET;
+                break;
+            }
+            case 25: {
+                string word = editor.getStringInput("Enter word to search for: ");
+                int edits = editor.getIntInput("Allow how many edits (typos): ");
+                editor.fuzzySearch(word, edits);
+                break;
+            }
+            case 26:
+                editor.showChanges();
+                break;
+            case 27:
+                editor.cancelLoading();
+                break;
+            case 28: {
+                int k = editor.getIntInput("How many of the most frequent words: ");
+                string list = editor.getStringInput("Words to count (separated by spaces, blank for none): ");
+                bool sketch = editor.getStringInput("Exact, or bounded-memory estimates? (e/s): ") == "s";
+                vector<string> words;
+                forEachWord(list, [&words](string_view word) { words.emplace_back(word); });
+                editor.wordFrequencies(k > 0 ? (size_t)k : 0, words, sketch);
+                break;
+            }
+            case 29:
+                editing = false;
+                clearScreen() ;
+                break;
+            default:
+                cout << RED << "Invalid choice, try again.\n" << RESET;
+        }
+        editor.dumpStatsIfRequested();
+        editor.scheduleAutosave();
+    }
+}
+
+// Main menu function
+void mainMenu() {
+    TextEditor editor;
+    editor.setPager(Terminal::interactive());
+    editor.setAutosave(30, 50);
+    int choice;
+
+    do {
+        // Main Menu UI
+        cout << SEA_BLUE << "====================================\n";
+        cout << "        TEXT EDITOR MENU\n";
+        cout << "====================================\n";
+        cout << "1. Create New Document\n";
+        cout << "2. Load Document\n";
+        cout << "3. Exit\n";
+        cout << SEA_BLUE << "====================================\n" << RESET;
+        choice = editor.getIntInput("Enter your choice: ");
+        clearScreen() ;
+
+        if (choice == 1) {
+            editor.createNewDocument();
+            // After creating a new document, display text editor menu
+            editingMenu(editor);
+        } else if (choice == 2) {
+            string filename = editor.getStringInput("Enter the filename to load: ");
+            editor.loadDocument(filename);
+            editingMenu(editor);
+        } else if (choice == 3) {
+            cout << GREEN << "Exiting program.\n" << RESET;
+        } else {
+            cout << RED << "Invalid choice, please try again.\n" << RESET;
+        }
+    } while (choice != 3);
+    editor.dumpStats();
+}
+
+// Runs editor commands from a script without prompts, screen clears or
+// menus. One command per line; arguments are bare words or "quoted strings",
+// and the text of add/insert/change is the rest of the line.
+class ScriptRunner {
+private:
+    struct Timing {
+        size_t calls = 0;
+        double totalMs = 0;
+        double maxMs = 0;
+    };
+
+    TextEditor& editor;
+    bool printEachTiming;
+    unordered_map<string, Timing> timings;
+    vector<string> order;  // Command names in first-use order, for the report
+    size_t commands = 0;
+    double totalMs = 0;
+
+    // Text argument: a quoted string or everything left on the line
+    static string restOfLine(string_view rest) {
+        skipSpaces(rest);
+        string text;
+        if (!rest.empty() && rest[0] == '"' && nextToken(rest, text)) return text;
+        return string(rest);
+    }
+
+    static bool nextNumber(string_view& rest, int& number) {
+        string token;
+        if (!nextToken(rest, token)) return false;
+        char* end;
+        long value = strtol(token.c_str(), &end, 10);
+        if (token.empty() || *end != '\0') return false;
+        number = (int)value;
+        return true;
+    }
+
+    // Run one command; false when the line cannot be understood
+    bool execute(const string& name, string_view rest) {
+        string a, b;
+        int number;
+        if (name == "add") {
+            editor.addLine(restOfLine(rest));
+        } else if (name == "remove") {
+            editor.removeLine();
+        } else if (name == "insert") {
+            if (!nextNumber(rest, number)) return false;
+            editor.insertAtLine(number, restOfLine(rest));
+        } else if (name == "delete") {
+            if (!nextNumber(rest, number)) return false;
+            editor.deleteLineByNumber(number);
+        } else if (name == "change") {
+            if (!nextNumber(rest, number)) return false;
+            editor.changeLine(number, restOfLine(rest));
+        } else if (name == "replace") {
+            if (!nextToken(rest, a) || !nextToken(rest, b)) return false;
+            editor.replaceWord(a, b);
+        } else if (name == "regex") {
+            if (!nextToken(rest, a)) return false;
+            editor.regexSearch(a);
+        } else if (name == "regex-replace") {
+            if (!nextToken(rest, a) || !nextToken(rest, b)) return false;
+            editor.regexReplace(a, b);
+        } else if (name == "replace-table") {
+            if (!nextToken(rest, a)) return false;
+            editor.replaceFromTable(a);
+        } else if (name == "search") {
+            if (!nextToken(rest, a)) return false;
+            editor.searchWord(a);
+        } else if (name == "fuzzy") {
+            if (!nextToken(rest, a) || !nextNumber(rest, number)) return false;
+            editor.fuzzySearch(a, number);
+        } else if (name == "search-word") {
+            if (!nextToken(rest, a)) return false;
+            editor.searchWholeWord(a);
+        } else if (name == "count") {
+            if (!nextToken(rest, a)) return false;
+            editor.countWordOccurrences(a);
+        } else if (name == "words" || name == "words-sketch") {
+            if (!nextNumber(rest, number) || number < 0) return false;
+            vector<string> words;
+            while (nextToken(rest, a)) words.push_back(a);
+            editor.wordFrequencies((size_t)number, words, name == "words-sketch");
+        } else if (name == "count-lines") {
+            editor.countLines();
+        } else if (name == "bold") {
+            editor.boldText();
+        } else if (name == "italic") {
+            editor.italicizeText();
+        } else if (name == "lower") {
+            editor.convertToLowerCase();
+        } else if (name == "upper") {
+            editor.convertToUpperCase();
+        } else if (name == "undo") {
+            editor.undo();
+        } else if (name == "redo") {
+            editor.redo();
+        } else if (name == "display") {
+            editor.displayDocument();
+        } else if (name == "index") {
+            editor.toggleWordIndex();
+        } else if (name == "stats") {
+            editor.showStats();
+        } else if (name == "undo-limit") {
+            if (!nextNumber(rest, number) || number < 0) return false;
+            editor.setUndoMemoryLimit((size_t)number);
+        } else if (name == "autosave") {
+            string_view settings = rest;
+            if (nextToken(settings, a) && a == "off") {
+                editor.setAutosave(0, 1);
+                return true;
+            }
+            int edits = 50;
+            if (!nextNumber(rest, number) || number <= 0) return false;
+            settings = rest;
+            if (nextToken(settings, b) && (!nextNumber(rest, edits) || edits < 1)) return false;
+            editor.setAutosave((unsigned)number, (size_t)edits);
+        } else if (name == "intern") {
+            if (!nextToken(rest, a) || (a != "on" && a != "off")) return false;
+            editor.setLineInterning(a == "on");
+        } else if (name == "compress") {
+            string_view settings = rest;
+            if (nextToken(settings, a) && a == "off") {
+                editor.setColdStorage(0);
+                return true;
+            }
+            if (!nextNumber(rest, number) || number <= 0) return false;
+            editor.setColdStorage((size_t)number);
+        } else if (name == "new") {
+            editor.createNewDocument();
+        } else if (name == "load") {
+            if (!nextToken(rest, a)) return false;
+            editor.loadDocument(a, false);
+        } else if (name == "save" || name == "save!") {
+            // save! overwrites a file another program changed
+            if (nextToken(rest, a)) {
+                editor.saveDocumentAs(a, name == "save!");
+            } else if (!editor.filename().empty()) {
+                editor.saveDocument(name == "save!");
+            } else {
+                return false;  // No file to save to, and no one to ask
+            }
+        } else if (name == "diff") {
+            editor.showChanges();
+        } else if (name == "cancel-load") {
+            editor.cancelLoading();
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+public:
+    ScriptRunner(TextEditor& editor, bool printEachTiming) : editor(editor), printEachTiming(printEachTiming) {}
+
+    static void skipSpaces(string_view& rest) {
+        while (!rest.empty() && (rest[0] == ' ' || rest[0] == '\t')) rest.remove_prefix(1);
+    }
+
+    // Read a bare word or a "quoted string" with \" and \\ escapes
+    static bool nextToken(string_view& rest, string& token) {
+        skipSpaces(rest);
+        if (rest.empty()) return false;
+        token.clear();
+        if (rest[0] != '"') {
+            size_t end = rest.find_first_of(" \t");
+            token.assign(rest.substr(0, end));
+            rest.remove_prefix(end == string_view::npos ? rest.size() : end);
+            return true;
+        }
+        size_t i = 1;
+        for (; i < rest.size() && rest[i] != '"'; i++) {
+            if (rest[i] == '\\' && i + 1 < rest.size()) i++;
+            token += rest[i];
+        }
+        if (i >= rest.size()) return false;  // Unterminated quote
+        rest.remove_prefix(i + 1);
+        return true;
+    }
+
+    // Run a single command line; false when it cannot be understood.
+    // Blank lines and comments do nothing.
+    bool runLine(string_view line) {
+        string name;
+        if (!nextToken(line, name) || name[0] == '#') return true;
+        return execute(name, line);
+    }
+
+    // Run every command of `script`; stops at the first bad line
+    bool run(istream& script, const string& scriptName) {
+        string line;
+        size_t lineNumber = 0;
+        while (getline(script, line)) {
+            lineNumber++;
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            string_view rest(line);
+            string name;
+            if (!nextToken(rest, name) || name[0] == '#') continue;  // Blank line or comment
+
+            auto start = chrono::steady_clock::now();
+            bool ok = execute(name, rest);
+            double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+            if (!ok) {
+                cerr << scriptName << ":" << lineNumber << ": cannot run \"" << line << "\"\n";
+                return false;
+            }
+
+            auto found = timings.find(name);
+            if (found == timings.end()) {
+                found = timings.emplace(name, Timing()).first;
+                order.push_back(name);
+            }
+            found->second.calls++;
+            found->second.totalMs += ms;
+            found->second.maxMs = max(found->second.maxMs, ms);
+            commands++;
+            totalMs += ms;
+            editor.dumpStatsIfRequested();
+            editor.scheduleAutosave();
+            if (printEachTiming) cerr << scriptName << ":" << lineNumber << ": " << name << " " << ms << " ms\n";
+        }
+        return true;
+    }
+
+    // Per-command timing summary
+    void report(ostream& out) const {
+        out << "command            calls     total ms      mean us       max us\n";
+        for (const auto& name : order) {
+            const Timing& t = timings.at(name);
+            char row[128];
+            snprintf(row, sizeof(row), "%-14s %9zu %12.3f %12.3f %12.3f\n", name.c_str(), t.calls, t.totalMs,
+                     t.totalMs * 1000 / t.calls, t.maxMs * 1000);
+            out << row;
+        }
+        char total[128];
+        snprintf(total, sizeof(total), "%zu commands in %.3f ms (%.0f commands/s)\n", commands, totalMs,
+                 totalMs > 0 ? commands / (totalMs / 1000) : 0.0);
+        out << total;
+    }
+};
+
+// Headless mode: editor --script ops.txt [input.txt] [-o output.txt]
+int runScript(int argc, char* argv[]) {
+    string scriptName, input, output;
+    bool printEachTiming = false;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--script" && i + 1 < argc) {
+            scriptName = argv[++i];
+        } else if (arg == "-o" && i + 1 < argc) {
+            output = argv[++i];
+        } else if (arg == "--timings") {
+            printEachTiming = true;
+        } else if (arg == "--no-color") {
+            useColors = false;
+        } else if (input.empty() && arg[0] != '-') {
+            input = arg;
+        } else {
+            cerr << "Usage: " << argv[0] << " --script <file|-> [input] [-o output] [--timings] [--no-color]\n";
+            return 2;
+        }
+    }
+
+#if !defined(_WIN32) && !defined(_WIN64)
+    if (!isatty(STDOUT_FILENO)) useColors = false;  // Plain text when piped
+#endif
+    ios::sync_with_stdio(false);
+    TextEditor editor;
+    editor.setJournaling(false);  // The result goes to -o or nowhere; no journal is left beside the input
+    editor.setUndoCoalescing(false);
+    if (!input.empty()) {
+        editor.loadDocument(input, false);
+        if (editor.filename().empty()) return 1;
+    }
+
+    bool ok;
+    if (scriptName == "-") {
+        ScriptRunner runner(editor, printEachTiming);
+        ok = runner.run(cin, "<stdin>");
+        runner.report(cerr);
+    } else {
+        ifstream script(scriptName);
+        if (!script.is_open()) {
+            cerr << "Cannot open script " << scriptName << "\n";
+            return 1;
+        }
+        ScriptRunner runner(editor, printEachTiming);
+        ok = runner.run(script, scriptName);
+        runner.report(cerr);
+    }
+
+    if (ok && !output.empty()) editor.saveDocumentAs(output);
+    editor.dumpStats();
+    cout.flush();
+    return ok ? 0 : 1;
+}
+
+#if !defined(_WIN32) && !defined(_WIN64)
+// Set by SIGINT and SIGTERM; the server stops at its next poll
+volatile sig_atomic_t serverStopRequested = 0;
+
+void requestServerStop(int) {
+    serverStopRequested = 1;
+}
+
+// Server mode: documents stay loaded and many clients run script commands
+// on them over a Unix domain socket, so a small automated edit costs
+// neither a process start nor a file load.
+//
+// Protocol: one request per line, "<document> <command> [arguments]". The
+// command is any script command except those that switch files (new,
+// load, save <file>). The document is a path, relative to the server's
+// directory; its first request loads it and it stays loaded until
+// ":close <document>". ":list", ":stats" and ":shutdown" go to the server
+// itself. Every request gets one reply, "ok <n>\n" or "error <n>\n"
+// followed by n bytes of output, and the requests of one connection are
+// answered in order.
+//
+// The main thread only polls the sockets. Requests run on a pool of
+// worker threads. Each document has a queue and at most one worker runs
+// its requests at a time, so different documents are served in parallel
+// while the requests of one document run one after another.
+class EditorServer {
+private:
+    static constexpr size_t MAX_REQUEST = 1 << 20;  // Longest request line
+    static constexpr int SEND_TIMEOUT_SECONDS = 30; // A client that stops reading loses its reply
+
+    // The flags are guarded by `lock`; `input` belongs to the poll loop
+    struct Connection {
+        int fd = -1;
+        string input;         // Bytes read but not handled yet
+        bool busy = false;    // A request is waiting for its reply
+        bool eof = false;     // The client sent all it will send
+        bool failed = false;  // A reply could not be written
+    };
+
+    struct Request {
+        shared_ptr<Connection> from;
+        string command;       // Script command line; empty to close the document
+        chrono::steady_clock::time_point received;
+    };
+
+    struct Session {
+        string name;          // Absolute path of the document
+        stringbuf captured;   // Output of the command being run
+        TextEditor editor;
+        ScriptRunner runner{editor, false};
+        bool loaded = false;
+        deque<Request> queue; // Guarded by `lock`
+        bool running = false; // A worker has the session; guarded by `lock`
+
+        Session() {
+            editor.setOutput(&captured);
+            editor.setUndoCoalescing(false);
+        }
+    };
+
+    string path;
+    unsigned workerCount = max(1u, thread::hardware_concurrency());
+    int listener = -1;
+    int wake[2] = {-1, -1};   // Workers write a byte here to wake the poll loop
+    bool stopping = false;
+    vector<shared_ptr<Connection>> connections;  // Only the poll loop changes the list
+    unique_ptr<ThreadPool> workers;
+
+    mutable mutex lock;       // Guards the sessions, their queues, the connection flags and the statistics
+    map<string, shared_ptr<Session>> sessions;
+    chrono::steady_clock::time_point started;
+    LatencyHistogram latencyNs;                  // From reading a request to writing its reply
+    map<string, LatencyHistogram> commandLatencyNs;
+    size_t requests = 0, errors = 0, accepted = 0;
+    uint64_t bytesIn = 0, bytesOut = 0;
+
+    static bool writeAll(int fd, const string& bytes) {
+        size_t done = 0;
+        while (done < bytes.size()) {
+            ssize_t n = ::write(fd, bytes.data() + done, bytes.size() - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            done += n;
+        }
+        return true;
+    }
+
+    void wakeLoop() {
+        char byte = 1;
+        if (::write(wake[1], &byte, 1) < 0) return;  // The pipe is full, so the loop wakes anyway
+    }
+
+    // Documents are known by their absolute path
+    static string documentPath(const string& name) {
+        error_code error;
+        filesystem::path absolute = filesystem::absolute(name, error);
+        return (error ? filesystem::path(name) : absolute).lexically_normal().string();
+    }
+
+    // Send a reply and count it. Runs on a worker, or on the poll loop for
+    // what it answers itself; a connection has one request at a time, so
+    // two replies never race on one socket.
+    void reply(Connection& to, const string& command, bool ok, const string& body,
+               chrono::steady_clock::time_point received) {
+        string message = string(ok ? "ok " : "error ") + to_string(body.size()) + "\n" + body;
+        bool sent = writeAll(to.fd, message);
+        uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - received).count();
+        lock_guard<mutex> guard(lock);
+        to.failed |= !sent;
+        to.busy = false;
+        requests++;
+        errors += !ok;
+        bytesOut += message.size();
+        latencyNs.record(ns);
+        commandLatencyNs[command].record(ns);
+    }
+
+    // Queue a request on its document; a worker takes the document if none
+    // has it. The caller holds `lock`.
+    void enqueue(const shared_ptr<Session>& session, Request request) {
+        request.from->busy = true;
+        session->queue.push_back(move(request));
+        if (session->running) return;
+        session->running = true;
+        workers->submit([this, session] { serveNext(session); });
+    }
+
+    // Run the oldest request of a document (on a worker). If more are
+    // queued the document goes back to the pool, so it takes turns with
+    // the others.
+    void serveNext(shared_ptr<Session> session) {
+        Request request;
+        {
+            lock_guard<mutex> guard(lock);
+            request = move(session->queue.front());
+            session->queue.pop_front();
+        }
+        string output, command = ":close";
+        bool ok;
+        if (request.command.empty()) {
+            ok = closeDocument(*session, output);
+        } else {
+            string_view rest(request.command);
+            ScriptRunner::nextToken(rest, command);
+            ok = execute(*session, request.command, output);
+        }
+        reply(*request.from, command, ok, output, request.received);
+        {
+            lock_guard<mutex> guard(lock);
+            if (session->queue.empty()) {
+                session->running = false;
+                // A document that failed to load is not kept
+                auto found = sessions.find(session->name);
+                if (!session->loaded && found != sessions.end() && found->second == session) sessions.erase(found);
+            } else {
+                workers->submit([this, session] { serveNext(session); });
+            }
+        }
+        wakeLoop();  // The connection may have more requests waiting
+    }
+
+    // Run one script command on a document, loading it first if needed
+    bool execute(Session& session, const string& command, string& output) {
+        string_view rest(command);
+        string name, file;
+        ScriptRunner::nextToken(rest, name);
+        if (name == "new" || name == "load" || ((name == "save" || name == "save!") && ScriptRunner::nextToken(rest, file))) {
+            output = name + " would switch files; a server session stays on its document.\n";
+            return false;
+        }
+        if (!session.loaded) {
+            session.editor.loadDocument(session.name, false);
+            output = session.captured.str();
+            session.captured.str("");
+            if (session.editor.filename().empty()) return false;
+            output.clear();  // Only the command's own output is returned
+            session.loaded = true;
+        }
+        bool ok = session.runner.runLine(command);
+        session.editor.scheduleAutosave();
+        output = session.captured.str();
+        session.captured.str("");
+        if (!ok) output += "cannot run \"" + command + "\"\n";
+        return ok;
+    }
+
+    // Drop a document from memory. Its unsaved edits stay in its journal,
+    // and the next request for it loads it again.
+    bool closeDocument(Session& session, string& output) {
+        bool unsaved = session.loaded && session.editor.hasUnsavedChanges();
+        {
+            lock_guard<mutex> guard(lock);
+            if (!session.queue.empty()) {
+                output = "More requests for " + session.name + " are waiting; close it after them.\n";
+                return false;
+            }
+            auto found = sessions.find(session.name);
+            if (found != sessions.end() && found->second.get() == &session) sessions.erase(found);
+        }
+        output = "Closed " + session.name + (unsaved ? "; its unsaved edits are kept in its journal.\n" : ".\n");
+        return true;
+    }
+
+    // Server statistics; the caller holds `lock`
+    string statistics() const {
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        char row[256];
+        string text;
+        snprintf(row, sizeof(row), "Up %.1f s: %zu request(s), %zu error(s), %.1f requests/s, %.2f MB in, %.2f MB out\n",
+                 seconds, requests, errors, seconds > 0 ? requests / seconds : 0.0, bytesIn / 1e6, bytesOut / 1e6);
+        text += row;
+        snprintf(row, sizeof(row), "%zu connection(s) open, %zu accepted; %zu document(s) open; %u worker(s)\n",
+                 connections.size(), accepted, sessions.size(), workerCount);
+        text += row;
+        snprintf(row, sizeof(row), "Latency: p50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us\n",
+                 latencyNs.percentile(50) / 1000.0, latencyNs.percentile(90) / 1000.0,
+                 latencyNs.percentile(99) / 1000.0, latencyNs.maximum() / 1000.0);
+        text += row;
+        text += "command            calls    p50 us    p99 us    max us\n";
+        for (const auto& command : commandLatencyNs) {
+            const LatencyHistogram& h = command.second;
+            snprintf(row, sizeof(row), "%-14s %9llu %9.1f %9.1f %9.1f\n", command.first.c_str(),
+                     (unsigned long long)h.count(), h.percentile(50) / 1000.0, h.percentile(99) / 1000.0,
+                     h.maximum() / 1000.0);
+            text += row;
+        }
+        return text;
+    }
+
+    // A request addressed to the server rather than to a document
+    void serverCommand(const shared_ptr<Connection>& from, const string& command, string_view rest,
+                       chrono::steady_clock::time_point received) {
+        string argument, text;
+        bool ok = true;
+        if (command == ":list") {
+            lock_guard<mutex> guard(lock);
+            for (const auto& session : sessions) {
+                text += session.first;
+                if (!session.second->queue.empty()) text += " (" + to_string(session.second->queue.size()) + " queued)";
+                text += "\n";
+            }
+        } else if (command == ":stats") {
+            lock_guard<mutex> guard(lock);
+            text = statistics();
+        } else if (command == ":close" && ScriptRunner::nextToken(rest, argument)) {
+            lock_guard<mutex> guard(lock);
+            auto found = sessions.find(documentPath(argument));
+            if (found != sessions.end()) {
+                enqueue(found->second, {from, "", received});  // After the requests already queued for it
+                return;
+            }
+            ok = false;
+            text = argument + " is not loaded.\n";
+        } else if (command == ":shutdown") {
+            stopping = true;
+            text = "Shutting down.\n";
+        } else {
+            ok = false;
+            text = "Unknown server command " + command + ".\n";
+        }
+        reply(*from, command, ok, text, received);
+    }
+
+    // Handle one request line (on the poll loop)
+    void handle(const shared_ptr<Connection>& from, string line) {
+        auto received = chrono::steady_clock::now();
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        string_view rest(line);
+        string target;
+        if (!ScriptRunner::nextToken(rest, target)) {
+            ScriptRunner::skipSpaces(rest);
+            if (!rest.empty()) reply(*from, "?", false, "Unterminated quote.\n", received);
+            return;  // Otherwise a blank line
+        }
+        if (target[0] == '#') return;  // Comment
+        if (target[0] == ':') {
+            serverCommand(from, target, rest, received);
+            return;
+        }
+        ScriptRunner::skipSpaces(rest);
+        if (rest.empty()) {
+            reply(*from, "?", false, "Give a command after the document name.\n", received);
+            return;
+        }
+        string name = documentPath(target);
+        lock_guard<mutex> guard(lock);
+        shared_ptr<Session>& session = sessions[name];
+        if (!session) {
+            session = make_shared<Session>();
+            session->name = name;
+        }
+        enqueue(session, {from, string(rest), received});
+    }
+
+    // Start the next request of every connection that is not waiting for a
+    // reply. A connection runs one request at a time, so its replies come
+    // in order.
+    void dispatch() {
+        for (const auto& connection : connections) {
+            size_t start = 0;
+            while (true) {
+                {
+                    lock_guard<mutex> guard(lock);
+                    if (connection->busy || connection->failed) break;
+                }
+                size_t newline = connection->input.find('\n', start);
+                if (newline == string::npos) {
+                    if (connection->input.size() - start >= MAX_REQUEST) {
+                        reply(*connection, "?", false, "Request line longer than 1 MB.\n", chrono::steady_clock::now());
+                        lock_guard<mutex> guard(lock);
+                        connection->failed = true;
+                    }
+                    break;
+                }
+                string line = connection->input.substr(start, newline - start);
+                start = newline + 1;
+                handle(connection, move(line));
+            }
+            connection->input.erase(0, start);
+        }
+    }
+
+    // Hang up on clients that are done, once their last reply is out
+    void closeFinished() {
+        lock_guard<mutex> guard(lock);
+        auto done = remove_if(connections.begin(), connections.end(), [](const shared_ptr<Connection>& c) {
+            bool finished = c->failed || (c->eof && c->input.find('\n') == string::npos);
+            if (!finished || c->busy) return false;
+            ::close(c->fd);
+            return true;
+        });
+        connections.erase(done, connections.end());
+    }
+
+    // Read what the clients send and answer it, until :shutdown or a signal
+    void loop() {
+        vector<pollfd> fds;
+        vector<shared_ptr<Connection>> watched;
+        while (!stopping && !serverStopRequested) {
+            closeFinished();
+            fds.assign({{listener, POLLIN, 0}, {wake[0], POLLIN, 0}});
+            watched.clear();
+            for (const auto& connection : connections) {
+                // A client with a long backlog is not read until it shrinks
+                if (connection->eof || connection->input.size() >= MAX_REQUEST) continue;
+                fds.push_back({connection->fd, POLLIN, 0});
+                watched.push_back(connection);
+            }
+            if (poll(fds.data(), fds.size(), 500) < 0) {
+                if (errno == EINTR) continue;
+                cerr << "poll failed: " << strerror(errno) << "\n";
+                break;
+            }
+            if (fds[1].revents) {
+                char drain[256];
+                while (::read(wake[0], drain, sizeof(drain)) > 0) {}
+            }
+            for (size_t i = 0; i < watched.size(); i++) {
+                if (!(fds[i + 2].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+                Connection& connection = *watched[i];
+                char buffer[1 << 16];
+                ssize_t n = ::read(connection.fd, buffer, sizeof(buffer));
+                if (n < 0 && errno == EINTR) continue;
+                lock_guard<mutex> guard(lock);
+                if (n > 0) {
+                    connection.input.append(buffer, n);
+                    bytesIn += n;
+                    continue;
+                }
+                connection.eof = true;
+                // A last request without a newline still counts
+                if (!connection.input.empty() && connection.input.back() != '\n') connection.input += '\n';
+            }
+            if (fds[0].revents & POLLIN) {
+                int fd = accept(listener, nullptr, nullptr);
+                if (fd >= 0) {
+                    fcntl(fd, F_SETFD, FD_CLOEXEC);
+                    timeval timeout = {SEND_TIMEOUT_SECONDS, 0};
+                    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+                    connections.push_back(make_shared<Connection>());
+                    connections.back()->fd = fd;
+                    lock_guard<mutex> guard(lock);
+                    accepted++;
+                }
+            }
+            dispatch();
+        }
+    }
+
+    // True when `address` is a socket file that no server answers on
+    static bool stale(const sockaddr_un& address) {
+        struct stat info;
+        if (lstat(address.sun_path, &info) != 0 || !S_ISSOCK(info.st_mode)) return false;
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        bool answered = probe >= 0 && connect(probe, (const sockaddr*)&address, sizeof(address)) == 0;
+        if (probe >= 0) ::close(probe);
+        return !answered;
+    }
+
+    bool openSocket() {
+        sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path)) {
+            cerr << "Socket path is too long: " << path << "\n";
+            return false;
+        }
+        memcpy(address.sun_path, path.data(), path.size());
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        bool bound = listener >= 0 && ::bind(listener, (const sockaddr*)&address, sizeof(address)) == 0;
+        if (!bound && listener >= 0 && errno == EADDRINUSE && stale(address)) {
+            unlink(path.c_str());  // Left behind by a server that is gone
+            bound = ::bind(listener, (const sockaddr*)&address, sizeof(address)) == 0;
+        }
+        if (!bound || ::listen(listener, 128) != 0 || pipe(wake) != 0) {
+            cerr << "Cannot listen on " << path << ": " << strerror(errno) << "\n";
+            return false;
+        }
+        fcntl(listener, F_SETFD, FD_CLOEXEC);
+        for (int fd : wake) fcntl(fd, F_SETFL, O_NONBLOCK);
+        return true;
+    }
+
+public:
+    ~EditorServer() {
+        if (listener >= 0) ::close(listener);
+        for (int fd : wake) {
+            if (fd >= 0) ::close(fd);
+        }
+    }
+
+    // Parse "--serve <socket> [--workers N]"
+    bool configure(int argc, char* argv[]) {
+        for (int i = 1; i < argc; i++) {
+            string arg = argv[i];
+            if (arg == "--serve" && i + 1 < argc) {
+                path = argv[++i];
+            } else if (arg == "--workers" && i + 1 < argc) {
+                workerCount = max(1, stoi(argv[++i]));
+            } else {
+                return false;
+            }
+        }
+        return !path.empty();
+    }
+
+    // Serve until :shutdown, SIGINT or SIGTERM. Requests already queued
+    // are answered before the server exits, and its statistics go to
+    // stderr. Unsaved edits stay in the documents' journals.
+    int run() {
+        if (!openSocket()) return 1;
+        started = chrono::steady_clock::now();
+        workers.reset(new ThreadPool(workerCount));
+        cerr << "Serving on " << path << " with " << workerCount << " worker(s)\n";
+        loop();
+        unlink(path.c_str());
+        workers.reset();  // Waits for the queued requests
+        closeFinished();
+        for (const auto& connection : connections) ::close(connection->fd);
+        cerr << statistics();
+        connections.clear();
+        sessions.clear();
+        return 0;
+    }
+};
+#endif
+
+// Server mode: editor --serve <socket> [--workers N]
+int runServer(int argc, char* argv[]) {
+#if defined(_WIN32) || defined(_WIN64)
+    (void)argc;
+    cerr << argv[0] << ": server mode needs Unix domain sockets, which this build does not support\n";
+    return 2;
+#else
+    EditorServer server;
+    bool configured;
+    try {
+        configured = server.configure(argc, argv);
+    } catch (const exception&) {
+        configured = false;
+    }
+    if (!configured) {
+        cerr << "Usage: " << argv[0] << " --serve <socket> [--workers N]\n";
+        return 2;
+    }
+    useColors = false;
+    ios::sync_with_stdio(false);
+    signal(SIGPIPE, SIG_IGN);  // A client that hangs up only fails its reply
+    signal(SIGINT, requestServerStop);
+    signal(SIGTERM, requestServerStop);
+    return server.run();
+#endif
+}
+
+// Project mode: search or replace in every file under a directory without
+// loading the files into a TextEditor. The walk hands files to a
+// work-stealing pool; each file is mapped read-only and scanned with the
+// editor's own kernels (SearchKernel, Regex, ReplaceEngine). A file with
+// replacements is rewritten through AtomicFileWriter, copying the unchanged
+// bytes between changed lines straight from the mapping.
+class ProjectSweep {
+public:
+    enum Mode { SEARCH, REGEX, REPLACE, REGEX_REPLACE };
+
+private:
+    static constexpr size_t BINARY_PROBE = 8192;         // A NUL in this prefix means a binary file
+    static constexpr size_t RANGE_COPY_MIN = 64 * 1024;  // Shorter gaps are copied through the buffer
+
+    // Counters of one worker, summed when the sweep is done
+    struct Totals {
+        size_t files = 0, bytes = 0, matchedFiles = 0, hits = 0, lines = 0;
+        size_t binary = 0, unreadable = 0, failedWrites = 0;
+    };
+
+    Mode mode = SEARCH;
+    string root;
+    string word;
+    vector<pair<string, string>> table;
+    string pattern;
+    Regex::Replacement replacement;
+    unsigned threads = max(1u, thread::hardware_concurrency());
+    bool hidden = false;
+    bool dryRun = false;
+    bool countsOnly = false;
+
+    unique_ptr<ReplaceEngine> engine;
+    vector<unique_ptr<Regex>> regexes;  // One per worker: the lazy DFA cache is not thread safe
+    vector<Totals> totals;              // One per worker
+    vector<string> scratch;             // Rewritten line, one per worker
+    size_t walkErrors = 0;              // Entries the walk could not read
+    mutex outputLock;
+
+    static bool skippedName(const string& name) {
+        auto endsWith = [&](const char* suffix) {
+            size_t n = strlen(suffix);
+            return name.size() >= n && name.compare(name.size() - n, n, suffix) == 0;
+        };
+        // Files the editor itself writes next to a document
+        return endsWith(".saving") || endsWith(".journal") || endsWith(".stale");
+    }
+
+    // Print one file's results in a single piece so workers do not interleave
+    void print(const string& text) {
+        lock_guard<mutex> guard(outputLock);
+        cout << text;
+    }
+
+    size_t searchWord(string_view bytes, string& report) {
+        size_t hits = 0, lineNumber = 0, lineStart = 0, lineEnd = 0, scanned = 0;
+        for (size_t pos = SearchKernel::find(bytes, word); pos != string_view::npos;
+             pos = SearchKernel::find(bytes, word, pos + 1)) {
+            if (hits == 0 || pos >= lineEnd) {
+                if (hits > 0 && !countsOnly) {
+                    report += "): ";
+                    report += RESET;
+                    report.append(bytes.data() + lineStart, lineEnd - lineStart);
+                    report += '\n';
+                }
+                // Count the newlines up to the hit to get its line number
+                while (true) {
+                    const void* newline = memchr(bytes.data() + scanned, '\n', pos - scanned);
+                    if (!newline) break;
+                    scanned = static_cast<const char*>(newline) - bytes.data() + 1;
+                    lineStart = scanned;
+                    lineNumber++;
+                }
+                scanned = pos;
+                const void* newline = memchr(bytes.data() + pos, '\n', bytes.size() - pos);
+                lineEnd = newline ? static_cast<const char*>(newline) - bytes.data() : bytes.size();
+                if (!countsOnly) {
+                    report += "  ";
+                    report += CYAN;
+                    report += "Found at line " + to_string(lineNumber + 1) + " (column";
+                }
+            }
+            if (!countsOnly) report += " " + to_string(pos - lineStart + 1);
+            hits++;
+        }
+        if (hits > 0 && !countsOnly) {
+            report += "): ";
+            report += RESET;
+            report.append(bytes.data() + lineStart, lineEnd - lineStart);
+            report += '\n';
+        }
+        return hits;
+    }
+
+    size_t searchRegex(Regex& regex, string_view bytes, string& report) {
+        size_t hits = 0, lineNumber = 0;
+        MappedText::forEachLine(bytes.data(), bytes.data() + bytes.size(), [&](string_view line) {
+            bool found = false;
+            regex.forEachMatch(line, [&](size_t start, size_t) {
+                if (!found && !countsOnly) {
+                    report += "  ";
+                    report += CYAN;
+                    report += "Found at line " + to_string(lineNumber + 1) + " (column";
+                }
+                if (!countsOnly) report += " " + to_string(start + 1);
+                found = true;
+                hits++;
+            });
+            if (found && !countsOnly) {
+                report += "): ";
+                report += RESET;
+                report.append(line.data(), line.size());
+                report += '\n';
+            }
+            lineNumber++;
+        });
+        return hits;
+    }
+
+    // Rewrite every line with a replacement. Returns false when the new
+    // file could not be written; the old one is then left as it was.
+    bool replace(size_t worker, const string& path, const MappedText& text, size_t& replaced, size_t& changedLines,
+                 string& report) {
+        const char* data = text.data();
+        size_t size = text.size(), offset = 0, copied = 0, lineNumber = 0;
+        string& out = scratch[worker];
+        unique_ptr<AtomicFileWriter> writer;
+        auto copyUpTo = [&](size_t end) {
+            if (end - copied >= RANGE_COPY_MIN) {
+                writer->writeRange(text, copied, end - copied);
+            } else {
+                writer->write(string_view(data + copied, end - copied));
+            }
+        };
+
+        while (offset < size) {
+            const char* newline = static_cast<const char*>(memchr(data + offset, '\n', size - offset));
+            size_t stop = newline ? newline - data : size;
+            string_view line(data + offset, stop - offset);
+            size_t count = mode == REPLACE ? engine->apply(line, out) : regexes[worker]->replace(line, replacement, out);
+            if (count > 0) {
+                replaced += count;
+                changedLines++;
+                if (!dryRun) {
+                    if (!writer) writer.reset(new AtomicFileWriter(path));
+                    copyUpTo(offset);
+                    writer->write(out);
+                    copied = stop;
+                }
+                if (!countsOnly) {
+                    report += "  ";
+                    report += CYAN;
+                    report += "Line " + to_string(lineNumber + 1) + ": ";
+                    report += RESET;
+                    report += out;
+                    report += '\n';
+                }
+            }
+            offset = newline ? stop + 1 : size;
+            lineNumber++;
+        }
+        if (!writer) return true;
+        copyUpTo(size);
+        return writer->commit();
+    }
+
+    void process(size_t worker, const string& path) {
+        Totals& counts = totals[worker];
+        shared_ptr<MappedText> text = MappedText::open(path);
+        if (!text) {
+            counts.unreadable++;
+            print(string(RED) + "Cannot read " + path + "\n" + RESET);
+            return;
+        }
+        string_view bytes(text->data(), text->size());
+        if (memchr(bytes.data(), '\0', min(bytes.size(), BINARY_PROBE))) {
+            counts.binary++;
+            return;
+        }
+        counts.files++;
+        counts.bytes += bytes.size();
+
+        string report;
+        if (mode == SEARCH || mode == REGEX) {
+            size_t hits = mode == SEARCH ? searchWord(bytes, report) : searchRegex(*regexes[worker], bytes, report);
+            if (hits == 0) return;
+            counts.matchedFiles++;
+            counts.hits += hits;
+            print(string(YELLOW) + path + ": " + to_string(hits) + " hit(s)\n" + RESET + report);
+            return;
+        }
+
+        size_t replaced = 0, changedLines = 0;
+        bool written = replace(worker, path, *text, replaced, changedLines, report);
+        if (replaced == 0) return;
+        counts.matchedFiles++;
+        counts.hits += replaced;
+        counts.lines += changedLines;
+        if (!written) {
+            counts.failedWrites++;
+            print(string(RED) + "Failed to write " + path + "\n" + RESET);
+            return;
+        }
+        print(string(YELLOW) + path + ": " + to_string(replaced) + " replacement(s) in " + to_string(changedLines) +
+              " line(s)\n" + RESET + report);
+    }
+
+    void submitFile(WorkStealingPool& pool, string path) {
+        pool.submit([this, path = move(path)](size_t worker) { process(worker, path); });
+    }
+
+    // Feed every regular file under the root to the pool. Symbolic links are
+    // not followed, and hidden files and directories are skipped unless
+    // --hidden was given.
+    void walk(WorkStealingPool& pool) {
+        error_code error;
+        if (filesystem::is_regular_file(filesystem::symlink_status(root, error))) {
+            submitFile(pool, root);
+            return;
+        }
+        filesystem::recursive_directory_iterator it(root, filesystem::directory_options::skip_permission_denied, error);
+        if (error) {
+            print(string(RED) + "Cannot open directory " + root + ": " + error.message() + "\n" + RESET);
+            walkErrors++;
+            return;
+        }
+        for (; it != filesystem::recursive_directory_iterator(); it.increment(error)) {
+            if (error) {
+                walkErrors++;
+                error.clear();
+                continue;
+            }
+            string name = it->path().filename().string();
+            if (!hidden && !name.empty() && name[0] == '.') {
+                if (it->is_directory(error)) it.disable_recursion_pending();
+                continue;
+            }
+            if (it->is_symlink(error) || !it->is_regular_file(error) || skippedName(name)) continue;
+            submitFile(pool, it->path().string());
+        }
+    }
+
+public:
+    // Parse "--project <dir> <command> <args...> [options]"
+    bool configure(int argc, char* argv[]) {
+        vector<string> positional;
+        for (int i = 1; i < argc; i++) {
+            string arg = argv[i];
+            if (arg == "--project" && i + 1 < argc) {
+                root = argv[++i];
+            } else if (arg == "--threads" && i + 1 < argc) {
+                threads = max(1, stoi(argv[++i]));
+            } else if (arg == "--hidden") {
+                hidden = true;
+            } else if (arg == "--dry-run") {
+                dryRun = true;
+            } else if (arg == "--counts") {
+                countsOnly = true;
+            } else if (arg == "--no-color") {
+                useColors = false;
+            } else if (arg.size() > 2 && arg.compare(0, 2, "--") == 0) {
+                return false;
+            } else {
+                positional.push_back(arg);
+            }
+        }
+        if (root.empty() || positional.empty()) return false;
+
+        const string& command = positional[0];
+        size_t arguments = positional.size() - 1;
+        if (command == "search" && arguments == 1 && !positional[1].empty()) {
+            mode = SEARCH;
+            word = positional[1];
+            return word.find('\n') == string::npos;
+        }
+        if (command == "regex" && arguments == 1) {
+            mode = REGEX;
+            pattern = positional[1];
+            return true;
+        }
+        if (command == "replace" && arguments == 2) {
+            mode = REPLACE;
+            table.push_back({positional[1], positional[2]});
+            return true;
+        }
+        if (command == "replace-table" && arguments == 1) {
+            mode = REPLACE;
+            return TextEditor::loadReplaceTable(positional[1], table, cerr);
+        }
+        if (command == "regex-replace" && arguments == 2) {
+            mode = REGEX_REPLACE;
+            pattern = positional[1];
+            replacement = Regex::parseReplacement(positional[2]);
+            return true;
+        }
+        return false;
+    }
+
+    // Build the matchers; false (with a message) when the pattern is unusable
+    bool prepare() {
+        if (mode == REPLACE) {
+            engine.reset(new ReplaceEngine(table));
+            if (engine->empty()) {
+                cerr << "Nothing to replace.\n";
+                return false;
+            }
+        }
+        if (mode == REGEX || mode == REGEX_REPLACE) {
+            for (unsigned i = 0; i < threads; i++) {
+                regexes.emplace_back(new Regex(pattern));
+                if (!regexes.back()->valid()) {
+                    cerr << "Invalid pattern: " << regexes.back()->error() << ".\n";
+                    return false;
+                }
+            }
+            if (replacement.highestGroup > regexes[0]->groupCount()) {
+                cerr << "The replacement uses group " << replacement.highestGroup << " but the pattern has "
+                     << regexes[0]->groupCount() << ".\n";
+                return false;
+            }
+        }
+        totals.assign(threads, Totals());
+        scratch.assign(threads, string());
+        return true;
+    }
+
+    // Sweep the tree, then print the summary to `summary`. Returns false
+    // when some file could not be read or written.
+    bool run(ostream& summary) {
+        auto start = chrono::steady_clock::now();
+        size_t steals;
+        {
+            WorkStealingPool pool(threads);
+            walk(pool);
+            pool.finish();
+            steals = pool.steals();
+        }
+        cout.flush();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        Totals sum;
+        sum.unreadable = walkErrors;
+        for (const Totals& t : totals) {
+            sum.files += t.files;
+            sum.bytes += t.bytes;
+            sum.matchedFiles += t.matchedFiles;
+            sum.hits += t.hits;
+            sum.lines += t.lines;
+            sum.binary += t.binary;
+            sum.unreadable += t.unreadable;
+            sum.failedWrites += t.failedWrites;
+        }
+
+        char line[256];
+        double mb = sum.bytes / 1e6;
+        snprintf(line, sizeof(line), "Scanned %zu file(s), %.1f MB in %.3f s on %u thread(s): %.1f MB/s, %.0f files/s\n",
+                 sum.files, mb, seconds, threads, seconds > 0 ? mb / seconds : 0.0,
+                 seconds > 0 ? sum.files / seconds : 0.0);
+        summary << line;
+        if (mode == SEARCH || mode == REGEX) {
+            summary << sum.hits << " hit(s) in " << sum.matchedFiles << " file(s)\n";
+        } else {
+            summary << (dryRun ? "Would replace " : "Replaced ") << sum.hits << " occurrence(s) in " << sum.lines
+                    << " line(s) of " << sum.matchedFiles << " file(s)\n";
+        }
+        summary << "Skipped " << sum.binary << " binary file(s); " << sum.unreadable << " unreadable, "
+                << sum.failedWrites << " failed write(s); " << steals << " task(s) stolen\n";
+        return sum.unreadable == 0 && sum.failedWrites == 0;
+    }
+};
+
+// Project mode: editor --project <dir> search <word> | regex <pattern> |
+// replace <old> <new> | replace-table <file> | regex-replace <pattern> <replacement>
+int runProject(int argc, char* argv[]) {
+    ProjectSweep sweep;
+    bool configured;
+    try {
+        configured = sweep.configure(argc, argv);
+    } catch (const exception&) {
+        configured = false;
+    }
+    if (!configured) {
+        cerr << "Usage: " << argv[0] << " --project <dir> search <word> | regex <pattern> | replace <old> <new> |"
+             << " replace-table <file> | regex-replace <pattern> <replacement>"
+             << " [--threads N] [--hidden] [--dry-run] [--counts] [--no-color]\n";
+        return 2;
+    }
+#if !defined(_WIN32) && !defined(_WIN64)
+    if (!isatty(STDOUT_FILENO)) useColors = false;  // Plain text when piped
+#endif
+    ios::sync_with_stdio(false);
+    if (!sweep.prepare()) return 2;
+    return sweep.run(cerr) ? 0 : 1;
+}
+
+// Streaming mode: runs the line-local editor operations over a file of any
+// size in constant memory. A reader thread fills large blocks and a writer
+// thread writes finished output, each with two buffers that are passed back
+// and forth, so reading, transforming and writing all overlap. Every line
+// goes through the stages in command-line order. Consecutive bold, italic
+// and case steps fold into one FormatStack, the same way the editor folds them.
+class StreamPipeline {
+private:
+    static constexpr size_t BLOCK_SIZE = 4 << 20;
+
+    struct Stage {
+        enum Kind { REPLACE, FORMAT, COUNT, SEARCH };
+        Kind kind;
+        unique_ptr<ReplaceEngine> engine;  // REPLACE
+        FormatStack format;                // FORMAT
+        string word;                       // COUNT and SEARCH
+        size_t found = 0;                  // Replacements, words counted or hits
+        size_t lines = 0;                  // Lines changed or matched
+
+        explicit Stage(Kind kind) : kind(kind) {}
+    };
+
+    // Buffers handed from one thread to another. pop() waits for a buffer
+    // and returns false once the channel is closed and empty.
+    class Channel {
+    private:
+        mutex lock;
+        condition_variable ready;
+        deque<string> buffers;
+        bool closed = false;
+
+    public:
+        void push(string buffer) {
+            {
+                lock_guard<mutex> guard(lock);
+                buffers.push_back(move(buffer));
+            }
+            ready.notify_one();
+        }
+
+        bool pop(string& buffer) {
+            unique_lock<mutex> guard(lock);
+            ready.wait(guard, [this] { return closed || !buffers.empty(); });
+            if (buffers.empty()) return false;
+            buffer = move(buffers.front());
+            buffers.pop_front();
+            return true;
+        }
+
+        void close() {
+            {
+                lock_guard<mutex> guard(lock);
+                closed = true;
+            }
+            ready.notify_all();
+        }
+    };
+
+    string input, output;
+    vector<Stage> stages;
+    ostream* report = &cout;
+    size_t lineNumber = 0, bytesIn = 0, bytesOut = 0;
+    string scratch[2];      // Stage outputs, used in turn
+    string carry;           // Start of a line cut off at the end of a block
+    bool readFailed = false, writeFailed = false;
+
+    void addFormat(const FormatStep& step) {
+        if (stages.empty() || stages.back().kind != Stage::FORMAT) stages.emplace_back(Stage::FORMAT);
+        stages.back().format.push(step);
+    }
+
+    bool transforms() const {
+        for (const auto& stage : stages) {
+            if (stage.kind == Stage::REPLACE || stage.kind == Stage::FORMAT) return true;
+        }
+        return false;
+    }
+
+    void search(Stage& stage, string_view line) {
+        bool found = false;
+        for (size_t pos = SearchKernel::find(line, stage.word); pos != string_view::npos;
+             pos = SearchKernel::find(line, stage.word, pos + 1)) {
+            if (!found) *report << CYAN << "Found at line " << lineNumber << " (column";
+            *report << " " << pos + 1;
+            found = true;
+            stage.found++;
+        }
+        if (!found) return;
+        *report << "): " << RESET << line << '\n';
+        stage.lines++;
+    }
+
+    // Run one line through every stage and append the result to `out`
+    void processLine(string_view line, bool newline, string& out) {
+        lineNumber++;
+        string_view current = line;
+        int next = 0;
+        for (auto& stage : stages) {
+            string& target = scratch[next];
+            size_t count = 0;
+            switch (stage.kind) {
+            case Stage::REPLACE:
+                count = stage.engine->apply(current, target);
+                stage.found += count;
+                break;
+            case Stage::FORMAT:
+                target.clear();
+                count = stage.format.apply(current, target);
+                break;
+            case Stage::COUNT:
+                forEachWord(current, [&stage](string_view word) { stage.found += word == stage.word; });
+                break;
+            case Stage::SEARCH:
+                search(stage, current);
+                break;
+            }
+            if (count > 0) {
+                stage.lines++;
+                current = target;
+                next ^= 1;
+            }
+        }
+        out.append(current.data(), current.size());
+        if (newline) out += '\n';
+    }
+
+    void readInput(FILE* file, Channel& filled, Channel& spare) {
+        string buffer;
+        while (spare.pop(buffer)) {
+            buffer.resize(BLOCK_SIZE);
+            size_t count = fread(&buffer[0], 1, BLOCK_SIZE, file);
+            buffer.resize(count);
+            if (count == 0) {
+                readFailed = ferror(file) != 0;
+                break;
+            }
+            filled.push(move(buffer));
+        }
+        filled.close();
+    }
+
+    void writeOutput(Channel& filled, Channel& spare) {
+        unique_ptr<AtomicFileWriter> writer;
+        if (output != "-") writer.reset(new AtomicFileWriter(output));
+        bool failed = writer && !writer->isOpen();
+        string buffer;
+        while (filled.pop(buffer)) {
+            if (!failed && writer) {
+                writer->write(buffer);
+            } else if (!failed) {
+                failed = fwrite(buffer.data(), 1, buffer.size(), stdout) != buffer.size();
+            }
+            buffer.clear();
+            spare.push(move(buffer));
+        }
+        if (writer) {
+            failed |= !writer->commit();
+        } else {
+            failed |= fflush(stdout) != 0;
+        }
+        writeFailed = failed;
+    }
+
+    // Hand `out` to the writer and take back an empty buffer
+    void flushOutput(string& out, Channel& toWrite, Channel& spare) {
+        if (output.empty()) {
+            out.clear();
+            return;
+        }
+        bytesOut += out.size();
+        toWrite.push(move(out));
+        spare.pop(out);
+    }
+
+public:
+    // Parse "--stream <input> [-o output] <stage>..."
+    bool configure(int argc, char* argv[]) {
+        for (int i = 1; i < argc; i++) {
+            string arg = argv[i];
+            auto operand = [&](string& value) {
+                if (i + 1 >= argc) return false;
+                value = argv[++i];
+                return true;
+            };
+            string a, b;
+            if (arg == "--stream") {
+                if (!operand(input)) return false;
+            } else if (arg == "-o") {
+                if (!operand(output)) return false;
+            } else if (arg == "--no-color") {
+                useColors = false;
+            } else if (arg == "replace") {
+                if (!operand(a) || !operand(b)) return false;
+                stages.emplace_back(Stage::REPLACE);
+                stages.back().engine.reset(new ReplaceEngine({{a, b}}));
+            } else if (arg == "replace-table") {
+                vector<pair<string, string>> table;
+                if (!operand(a) || !TextEditor::loadReplaceTable(a, table, cerr)) return false;
+                stages.emplace_back(Stage::REPLACE);
+                stages.back().engine.reset(new ReplaceEngine(table));
+            } else if (arg == "bold") {
+                addFormat({FormatStep::WRAP, "**", "**"});
+            } else if (arg == "italic") {
+                addFormat({FormatStep::WRAP, "_", "_"});
+            } else if (arg == "lower") {
+                addFormat({FormatStep::LOWERCASE, "", ""});
+            } else if (arg == "upper") {
+                addFormat({FormatStep::UPPERCASE, "", ""});
+            } else if (arg == "count" || arg == "search") {
+                if (!operand(a) || a.empty()) return false;
+                stages.emplace_back(arg == "count" ? Stage::COUNT : Stage::SEARCH);
+                stages.back().word = a;
+            } else {
+                return false;
+            }
+        }
+        if (input.empty() || stages.empty()) return false;
+        // Transformed text needs somewhere to go
+        if (output.empty() && transforms()) return false;
+        if (output == "-") report = &cerr;  // Keep the text on stdout clean
+        return true;
+    }
+
+    // Stream the input through the stages; false on a read or write error
+    bool run() {
+        FILE* file = input == "-" ? stdin : fopen(input.c_str(), "rb");
+        if (!file) {
+            cerr << "Cannot open " << input << "\n";
+            return false;
+        }
+        auto start = chrono::steady_clock::now();
+
+        Channel filledIn, spareIn, filledOut, spareOut;
+        for (int i = 0; i < 2; i++) {
+            spareIn.push(string());
+            spareOut.push(string());
+        }
+        thread reader([&] { readInput(file, filledIn, spareIn); });
+        thread writer;
+        if (!output.empty()) writer = thread([&] { writeOutput(filledOut, spareOut); });
+
+        string block, out;
+        spareOut.pop(out);
+        while (filledIn.pop(block)) {
+            bytesIn += block.size();
+            const char* p = block.data();
+            const char* end = p + block.size();
+            while (p < end) {
+                const char* newline = static_cast<const char*>(memchr(p, '\n', end - p));
+                if (!newline) {
+                    carry.append(p, end - p);  // Finished by the next block
+                    break;
+                }
+                if (carry.empty()) {
+                    processLine(string_view(p, newline - p), true, out);
+                } else {
+                    carry.append(p, newline - p);
+                    processLine(carry, true, out);
+                    carry.clear();
+                }
+                p = newline + 1;
+                if (out.size() >= BLOCK_SIZE) flushOutput(out, filledOut, spareOut);
+            }
+            block.clear();
+            spareIn.push(move(block));
+        }
+        if (!carry.empty()) processLine(carry, false, out);  // Last line had no newline
+        flushOutput(out, filledOut, spareOut);
+
+        spareIn.close();
+        reader.join();
+        filledOut.close();
+        if (writer.joinable()) writer.join();
+        if (file != stdin) fclose(file);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        for (const auto& stage : stages) {
+            if (stage.kind == Stage::REPLACE) {
+                *report << GREEN << "Replaced " << stage.found << " occurrence(s) in " << stage.lines << " line(s).\n" << RESET;
+            } else if (stage.kind == Stage::FORMAT) {
+                *report << GREEN << "Formatted " << stage.lines << " line(s).\n" << RESET;
+            } else if (stage.kind == Stage::COUNT && stage.found > 0) {
+                *report << CYAN << "The word \"" << stage.word << "\" appears " << RESET << stage.found << " times.\n";
+            } else if (stage.kind == Stage::COUNT) {
+                *report << RED << "The word \"" << stage.word << "\" does not appear in the document.\n" << RESET;
+            } else if (stage.found > 0) {
+                *report << CYAN << "\"" << stage.word << "\": " << RESET << stage.found << " hit(s) in " << stage.lines
+                        << " line(s).\n";
+            } else {
+                *report << RED << "Word \"" << stage.word << "\" not found in the document.\n" << RESET;
+            }
+        }
+        report->flush();
+        char summary[256];
+        snprintf(summary, sizeof(summary), "Streamed %zu lines, %.1f MB in, %.1f MB out in %.3f s (%.1f MB/s)\n",
+                 lineNumber, bytesIn / 1e6, bytesOut / 1e6, seconds, seconds > 0 ? bytesIn / 1e6 / seconds : 0.0);
+        cerr << summary;
+        if (readFailed) cerr << "Error reading " << input << "\n";
+        if (writeFailed) cerr << "Error writing " << output << "; the old file was left as it was\n";
+        return !readFailed && !writeFailed;
+    }
+};
+
+// Streaming mode: editor --stream <input|-> [-o output|-] <stage>...
+int runStream(int argc, char* argv[]) {
+    StreamPipeline pipeline;
+    if (!pipeline.configure(argc, argv)) {
+        cerr << "Usage: " << argv[0] << " --stream <input|-> [-o <output|->] <stage>... [--no-color]\n"
+             << "Stages run in order: replace <old> <new>, replace-table <file>, upper, lower, bold, italic,"
+             << " count <word>, search <word>. Replace and formatting stages need -o.\n";
+        return 2;
+    }
+#if !defined(_WIN32) && !defined(_WIN64)
+    if (!isatty(STDOUT_FILENO)) useColors = false;  // Plain text when piped
+#endif
+    ios::sync_with_stdio(false);
+    return pipeline.run() ? 0 : 1;
+}
+
+// Benchmark mode: builds synthetic documents, times every editor operation
+// and prints one JSON object per measurement, e.g.
+// {"backend":"rope","lines":1000,"dist":"uniform","op":"searchWord",...}
+class Benchmark {
+private:
+    // Swallows editor messages, so only the timings are printed
+    struct NullBuffer : streambuf {
+        int overflow(int c) override { return c; }
+    };
+
+    vector<size_t> sizes = {1000, 10000, 100000, 1000000};
+    string distribution = "uniform";
+    size_t lineLength = 60;
+    size_t repetitions = 1000;
+    string directory;
+
+    static size_t peakRssKb() {
+#if defined(_WIN32) || defined(_WIN64)
+        return 0;
+#else
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+        return usage.ru_maxrss / 1024;
+#else
+        return usage.ru_maxrss;
+#endif
+#endif
+    }
+
+    // Write a document of `lines` lines drawn from the chosen length distribution.
+    // Every 1000th line carries "needle" so search and replace have a few hits.
+    size_t writeDocument(const string& path, size_t lines) const {
+        mt19937 random(42);
+        uniform_int_distribution<size_t> uniform(1, 2 * lineLength);
+        lognormal_distribution<double> lognormal(log((double)lineLength), 1.0);
+        uniform_int_distribution<int> word(0, 999);
+        ofstream out(path, ios::binary);
+        string line;
+        size_t bytes = 0;
+        for (size_t i = 0; i < lines; i++) {
+            size_t length = lineLength;
+            if (distribution == "uniform") length = uniform(random);
+            else if (distribution == "lognormal") length = min<size_t>(1 << 16, (size_t)lognormal(random) + 1);
+            line.clear();
+            if (i % 1000 == 0) line = "needle ";
+            while (line.size() < length) line.append("w").append(to_string(word(random))).append(" ");
+            line.resize(length);
+            out << line << '\n';
+            bytes += length + 1;
+        }
+        return bytes;
+    }
+
+    void emit(size_t lines, const string& op, size_t iterations, double seconds, size_t bytes) const {
+        char row[400];
+        snprintf(row, sizeof(row),
+                 "{\"backend\":\"%s\",\"lines\":%zu,\"dist\":\"%s\",\"op\":\"%s\",\"iterations\":%zu,"
+                 "\"ns_per_op\":%.1f,\"ops_per_s\":%.1f,\"mb_per_s\":%.2f,\"peak_rss_kb\":%zu}\n",
+#ifdef TEXT_EDITOR_LIST_BACKEND
+                 "list",
+#else
+                 "rope",
+#endif
+                 lines, distribution.c_str(), op.c_str(), iterations, seconds * 1e9 / iterations,
+                 iterations / seconds, bytes / seconds / 1e6, peakRssKb());
+        cout << row << flush;
+    }
+
+    // Time `iterations` calls of f
+    template <class F>
+    void measure(size_t lines, const string& op, size_t iterations, size_t bytes, F f) const {
+        auto start = chrono::steady_clock::now();
+        for (size_t i = 0; i < iterations; i++) f(i);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        emit(lines, op, iterations, max(seconds, 1e-9), bytes);
+    }
+
+    void runSize(size_t lines) const {
+        string input = directory + "/editor-bench-input.txt";
+        string output = directory + "/editor-bench-output.txt";
+        size_t bytes = writeDocument(input, lines);
+        size_t reps = repetitions;
+        size_t lineBytes = bytes / max<size_t>(1, lines);
+
+        NullBuffer null;
+        TextEditor editor;
+        editor.setOutput(&null);
+        measure(lines, "loadDocument", 1, bytes, [&](size_t) { editor.loadDocument(input, false); });
+        measure(lines, "loadDocument.finish", 1, bytes, [&](size_t) { editor.finishLoading(); });
+        measure(lines, "saveDocument.clean", 1, bytes, [&](size_t) { editor.saveDocumentAs(output); });
+        measure(lines, "searchWord", 1, bytes, [&](size_t) { editor.searchWord("needle"); });
+        measure(lines, "countWordOccurrences", 1, bytes, [&](size_t) { editor.countWordOccurrences("w7"); });
+        measure(lines, "wordFrequencies", 1, bytes, [&](size_t) { editor.wordFrequencies(10, {"w7"}, false); });
+        measure(lines, "wordFrequencies.sketch", 1, bytes, [&](size_t) { editor.wordFrequencies(10, {"w7"}, true); });
+
+        const pair<const char*, size_t> places[] = {{"head", 0}, {"middle", lines / 2}, {"tail", lines}};
+        for (const auto& place : places) {
+            int at = (int)min(place.second, lines - 1) + 1;
+            string where = place.first;
+            measure(lines, "insertAtLine." + where, reps, lineBytes * reps,
+                    [&](size_t) { editor.insertAtLine(at, "inserted line for the benchmark"); });
+            measure(lines, "changeLine." + where, reps, lineBytes * reps,
+                    [&](size_t i) { editor.changeLine(at, i % 2 ? "changed line" : "changed line again"); });
+            measure(lines, "deleteLineByNumber." + where, reps, lineBytes * reps,
+                    [&](size_t) { editor.deleteLineByNumber(at); });
+        }
+
+        measure(lines, "replaceWord", 1, bytes, [&](size_t) { editor.replaceWord("needle", "thread"); });
+        measure(lines, "boldText", 1, bytes, [&](size_t) { editor.boldText(); });
+        measure(lines, "italicizeText", 1, bytes, [&](size_t) { editor.italicizeText(); });
+        measure(lines, "convertToUpperCase", 1, bytes, [&](size_t) { editor.convertToUpperCase(); });
+        measure(lines, "convertToLowerCase", 1, bytes, [&](size_t) { editor.convertToLowerCase(); });
+        measure(lines, "undo", 1, bytes, [&](size_t) { editor.undo(); });
+        measure(lines, "redo", 1, bytes, [&](size_t) { editor.redo(); });
+        measure(lines, "saveDocument.edited", 1, bytes, [&](size_t) { editor.saveDocumentAs(output); });
+
+        remove(input.c_str());
+        remove(output.c_str());
+    }
+
+public:
+    // Parse --sizes a,b,c --dist fixed|uniform|lognormal --line-length N --reps N --dir D
+    bool configure(int argc, char* argv[]) {
+        directory = filesystem::temp_directory_path().string();
+        for (int i = 2; i < argc; i++) {
+            string arg = argv[i];
+            if (i + 1 >= argc) return false;
+            string value = argv[++i];
+            if (arg == "--sizes") {
+                sizes.clear();
+                stringstream list(value);
+                string size;
+                while (getline(list, size, ',')) sizes.push_back(stoull(size));
+            } else if (arg == "--dist" && (value == "fixed" || value == "uniform" || value == "lognormal")) {
+                distribution = value;
+            } else if (arg == "--line-length") {
+                lineLength = max<size_t>(1, stoull(value));
+            } else if (arg == "--reps") {
+                repetitions = max<size_t>(1, stoull(value));
+            } else if (arg == "--dir") {
+                directory = value;
+            } else {
+                return false;
+            }
+        }
+        return !sizes.empty();
+    }
+
+    // Each size runs in its own process (where fork exists) so peak RSS is per size
+    void run() const {
+        for (size_t lines : sizes) {
+            if (lines == 0) continue;
+#if defined(_WIN32) || defined(_WIN64)
+            runSize(lines);
+#else
+            cout.flush();
+            pid_t child = fork();
+            if (child == 0) {
+                runSize(lines);
+                cout.flush();
+                _exit(0);
+            }
+            int status;
+            if (child > 0) waitpid(child, &status, 0);
+            else runSize(lines);
+#endif
+        }
+    }
+};
+
+int runBenchmark(int argc, char* argv[]) {
+    Benchmark benchmark;
+    try {
+        if (!benchmark.configure(argc, argv)) {
+            cerr << "Usage: " << argv[0] << " --bench [--sizes 1000,10000,...] [--dist fixed|uniform|lognormal]"
+                 << " [--line-length N] [--reps N] [--dir D]\n";
+            return 2;
+        }
+    } catch (const exception&) {
+        cerr << "Invalid number in benchmark options.\n";
+        return 2;
+    }
+    useColors = false;
+    benchmark.run();
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+	enableANSI();
+#if !defined(_WIN32) && !defined(_WIN64)
+    signal(SIGUSR1, requestStatsDump);  // kill -USR1 writes $EDITOR_STATS
+#endif
+    if (argc > 1 && string(argv[1]) == "--bench") {
+        return runBenchmark(argc, argv);
+    }
+    if (argc > 1 && string(argv[1]) == "--project") {
+        return runProject(argc, argv);
+    }
+    if (argc > 1 && string(argv[1]) == "--stream") {
+        return runStream(argc, argv);
+    }
+    if (argc > 1 && string(argv[1]) == "--serve") {
+        return runServer(argc, argv);
+    }
+    if (argc > 1) {
+        return runScript(argc, argv);
+    }
+    mainMenu();
+    
+    return 0;
 }
\ No newline at end of file
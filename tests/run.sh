@@ -0,0 +1,38 @@
+#!/bin/sh
+# Regression checks for batch mode: tests/run.sh path/to/editor
+#
+# Each directory under tests/ is one check. By default the editor runs
+# script.txt on input.txt with -o output.txt, and output.txt must equal
+# expected.txt (and stdout must equal expected.out, if there is one).
+# A directory with an executable check.sh runs that instead, with the
+# editor's path as its argument. Checks run in a scratch copy of their
+# directory, so scripts may name files next to them.
+if [ $# -ne 1 ] || [ ! -x "$1" ]; then
+    echo "Usage: $0 path/to/editor" >&2
+    exit 2
+fi
+editor=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+failed=0
+for dir in "$(dirname "$0")"/*/; do
+    name=$(basename "$dir")
+    work=$(mktemp -d)
+    cp -R "$dir". "$work"
+    if (
+        cd "$work" || exit 1
+        if [ -x check.sh ]; then
+            ./check.sh "$editor"
+        else
+            "$editor" --script script.txt input.txt -o output.txt --no-color > stdout.txt 2> /dev/null &&
+                cmp -s output.txt expected.txt &&
+                { [ ! -f expected.out ] || cmp -s stdout.txt expected.out; }
+        fi
+    ); then
+        echo "ok   $name"
+    else
+        echo "FAIL $name (kept in $work)"
+        failed=1
+        continue
+    fi
+    rm -rf "$work"
+done
+exit $failed
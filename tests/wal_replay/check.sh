@@ -0,0 +1,22 @@
+#!/bin/sh
+# Journal replay: an edit made in the menu survives the editor being killed
+# before it saves, and batch runs leave no doc.txt.journal behind.
+editor=$1
+
+echo "change 1 BATCH" > batch-script.txt
+"$editor" --script batch-script.txt doc.txt -o batch.txt --no-color > /dev/null 2>&1
+[ ! -e doc.txt.journal ] || { echo "batch run left a journal" >&2; exit 1; }
+
+# Load doc.txt, change line 1, then get killed without saving.
+(printf '2\ndoc.txt\n11\n1\nCHANGED\n'; sleep 3) | "$editor" > /dev/null 2>&1 &
+pid=$!
+sleep 1
+kill -9 $pid 2> /dev/null
+wait 2> /dev/null
+[ -s doc.txt.journal ] || { echo "no journal after the kill" >&2; exit 1; }
+grep -q CHANGED doc.txt && { echo "edit reached doc.txt before a save" >&2; exit 1; }
+
+# Reload: the edit is replayed and shows in the display.
+printf '2\ndoc.txt\n5\n29\n3\n' | "$editor" > replay.txt 2>&1
+grep -q "Recovered 1 unsaved edit" replay.txt || { echo "journal not replayed" >&2; exit 1; }
+grep -q "CHANGED" replay.txt || { echo "replayed edit missing" >&2; exit 1; }